@@ -0,0 +1,322 @@
+/*
+ * Export the samples of the sampler as a timeline in the Chrome trace event
+ * format (JSON), readable by chrome://tracing and Perfetto.
+ *
+ * Each thread is a track. Samples are read oldest first: a frame present in
+ * consecutive samples of a thread (same code object at the same depth from
+ * the oldest frame) becomes a single "complete" event ("ph": "X") lasting from
+ * the first sample to the first sample without it. When the label of a thread
+ * changes, all its frames are closed: the label of an event is in its args.
+ */
+
+#include "Python.h"
+#include "frameobject.h"
+#include "faulthandler.h"
+
+#if PY_MAJOR_VERSION >= 3
+#  define PYSTRING_FROMSTRING PyUnicode_FromString
+#  define PYSTRING_ASSTRING PyUnicode_AsUTF8
+#else
+#  define PYSTRING_FROMSTRING PyString_FromString
+#  define PYSTRING_ASSTRING PyString_AsString
+#endif
+
+typedef struct {
+    PyObject *code;   /* borrowed reference, kept alive by the ring */
+    int lineno;
+    PY_LONG_LONG start;
+} trace_frame_t;
+
+typedef struct {
+    long thread_id;
+    /* label of the open frames, 0 if none */
+    int label;
+    /* time of the last sample of the thread */
+    PY_LONG_LONG last;
+    /* open frames, oldest frame first */
+    int nframe;
+    trace_frame_t frames[_Py_SAMPLE_MAX_DEPTH];
+} trace_thread_t;
+
+typedef struct {
+    PyObject *events;
+    PyObject *pid;
+    trace_thread_t *threads;
+    size_t nthread;
+    size_t alloc;
+} trace_t;
+
+/* Get the track of a thread, create it if needed. Return NULL on error. */
+static trace_thread_t*
+trace_get_thread(trace_t *trace, long thread_id)
+{
+    trace_thread_t *thread;
+    size_t alloc, i;
+
+    for (i=0; i < trace->nthread; i++) {
+        if (trace->threads[i].thread_id == thread_id)
+            return &trace->threads[i];
+    }
+
+    if (trace->nthread == trace->alloc) {
+        alloc = trace->alloc * 2 + 8;
+        thread = PyMem_Realloc(trace->threads, alloc * sizeof(trace_thread_t));
+        if (thread == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        trace->threads = thread;
+        trace->alloc = alloc;
+    }
+    thread = &trace->threads[trace->nthread];
+    trace->nthread++;
+    thread->thread_id = thread_id;
+    thread->label = 0;
+    thread->last = 0;
+    thread->nframe = 0;
+    return thread;
+}
+
+/* Add an event to the list of events: a new reference to event is
+   stolen. */
+static int
+trace_add_event(trace_t *trace, PyObject *event)
+{
+    int res;
+
+    if (event == NULL)
+        return -1;
+    res = PyList_Append(trace->events, event);
+    Py_DECREF(event);
+    return res;
+}
+
+/* Add the label of a thread to the args of an event */
+static int
+trace_set_label(PyObject *event, int label)
+{
+    PyObject *args, *name;
+    int res;
+
+    args = PyDict_GetItemString(event, "args");
+    if (args == NULL) {
+        args = PyDict_New();
+        if (args == NULL)
+            return -1;
+        res = PyDict_SetItemString(event, "args", args);
+        Py_DECREF(args);
+        if (res < 0)
+            return -1;
+    }
+    name = PYSTRING_FROMSTRING(_Py_SampleLabelName(label));
+    if (name == NULL)
+        return -1;
+    res = PyDict_SetItemString(args, "label", name);
+    Py_DECREF(name);
+    return res;
+}
+
+/* Add a complete event of the frame, ending at end */
+static int
+trace_close_frame(trace_t *trace, trace_thread_t *thread,
+                  trace_frame_t *frame, PY_LONG_LONG end)
+{
+    PyCodeObject *code;
+    PyObject *event, *name;
+    char buffer[100];
+
+    if (PyCode_Check(frame->code)) {
+        code = (PyCodeObject *)frame->code;
+        event = Py_BuildValue("{s:O,s:s,s:L,s:L,s:O,s:l,s:{s:O,s:i}}",
+                              "name", code->co_name,
+                              "ph", "X",
+                              "ts", frame->start,
+                              "dur", end - frame->start,
+                              "pid", trace->pid,
+                              "tid", thread->thread_id,
+                              "args",
+                                  "file", code->co_filename,
+                                  "line", frame->lineno);
+    }
+    else {
+        /* builtin function: "[C] module.function", no file and no line */
+        name = _Py_CFunctionName(frame->code);
+        if (name == NULL)
+            return -1;
+        PyOS_snprintf(buffer, sizeof(buffer), "[C] %s",
+                      PYSTRING_ASSTRING(name));
+        Py_DECREF(name);
+        event = Py_BuildValue("{s:s,s:s,s:L,s:L,s:O,s:l}",
+                              "name", buffer,
+                              "ph", "X",
+                              "ts", frame->start,
+                              "dur", end - frame->start,
+                              "pid", trace->pid,
+                              "tid", thread->thread_id);
+    }
+    if (event != NULL && thread->label != 0
+        && trace_set_label(event, thread->label) < 0)
+        Py_CLEAR(event);
+    return trace_add_event(trace, event);
+}
+
+/* Close the open frames of a thread from the depth 'depth' */
+static int
+trace_close_frames(trace_t *trace, trace_thread_t *thread, int depth,
+                   PY_LONG_LONG end)
+{
+    while (thread->nframe > depth) {
+        thread->nframe--;
+        if (trace_close_frame(trace, thread,
+                              &thread->frames[thread->nframe], end) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Visitor of _Py_SamplerTimeline() */
+static int
+trace_sample(long thread_id, PY_LONG_LONG timestamp, int state, int label,
+             const _Py_SampleFrame *frames, int nframe, void *arg)
+{
+    trace_t *trace = arg;
+    trace_thread_t *thread;
+    trace_frame_t *frame;
+    int depth;
+
+    thread = trace_get_thread(trace, thread_id);
+    if (thread == NULL)
+        return -1;
+
+    /* frames are stored most recent call first */
+    depth = 0;
+    if (label == thread->label) {
+        while (depth < thread->nframe && depth < nframe
+               && thread->frames[depth].code
+                  == frames[nframe - 1 - depth].code)
+            depth++;
+    }
+    if (trace_close_frames(trace, thread, depth, timestamp) < 0)
+        return -1;
+    thread->label = label;
+
+    for (; depth < nframe; depth++) {
+        frame = &thread->frames[depth];
+        frame->code = frames[nframe - 1 - depth].code;
+        frame->lineno = frames[nframe - 1 - depth].lineno;
+        frame->start = timestamp;
+    }
+    thread->nframe = nframe;
+    thread->last = timestamp;
+    return 0;
+}
+
+/* Get the name of a thread from the threading module, or "Thread 0xHHHH" */
+static PyObject*
+trace_thread_name(long thread_id)
+{
+    PyObject *threading, *active, *thread, *key, *name;
+    char buffer[50];
+
+    name = NULL;
+    threading = PyImport_ImportModule("threading");
+    if (threading != NULL) {
+        active = PyObject_GetAttrString(threading, "_active");
+        Py_DECREF(threading);
+        if (active != NULL) {
+            key = PyLong_FromLong(thread_id);
+            if (key != NULL) {
+                thread = PyObject_GetItem(active, key);
+                Py_DECREF(key);
+                if (thread != NULL) {
+                    name = PyObject_GetAttrString(thread, "name");
+                    Py_DECREF(thread);
+                }
+            }
+            Py_DECREF(active);
+        }
+    }
+    if (name != NULL)
+        return name;
+
+    /* the thread is gone or is not a threading thread */
+    PyErr_Clear();
+    PyOS_snprintf(buffer, sizeof(buffer),
+                  "Thread 0x%lx", (unsigned long)thread_id);
+    return PYSTRING_FROMSTRING(buffer);
+}
+
+/* Export the samples of the sampler in the Chrome trace event format: return
+   a JSON string, or None if the sampler is not running.
+
+   Must be called with the GIL held. Raise an exception and return NULL on
+   error. */
+PyObject*
+_Py_SamplesChromeTrace(void)
+{
+    trace_t trace;
+    trace_thread_t *thread;
+    PY_LONG_LONG period;
+    PyObject *os, *json, *name, *event, *result;
+    size_t i;
+    int res;
+
+    memset(&trace, 0, sizeof(trace));
+    result = NULL;
+
+    os = PyImport_ImportModule("os");
+    if (os == NULL)
+        return NULL;
+    trace.pid = PyObject_CallMethod(os, "getpid", "");
+    Py_DECREF(os);
+    if (trace.pid == NULL)
+        return NULL;
+    trace.events = PyList_New(0);
+    if (trace.events == NULL)
+        goto done;
+
+    res = _Py_SamplerTimeline(trace_sample, &trace, &period);
+    if (res < 0)
+        goto done;
+    if (res == 1) {
+        /* the sampler is not running */
+        result = Py_None;
+        Py_INCREF(result);
+        goto done;
+    }
+
+    for (i=0; i < trace.nthread; i++) {
+        thread = &trace.threads[i];
+        /* the last sample lasts one period */
+        if (trace_close_frames(&trace, thread, 0,
+                               thread->last + period) < 0)
+            goto done;
+
+        name = trace_thread_name(thread->thread_id);
+        if (name == NULL)
+            goto done;
+        event = Py_BuildValue("{s:s,s:s,s:O,s:l,s:{s:O}}",
+                              "name", "thread_name",
+                              "ph", "M",
+                              "pid", trace.pid,
+                              "tid", thread->thread_id,
+                              "args", "name", name);
+        Py_DECREF(name);
+        if (trace_add_event(&trace, event) < 0)
+            goto done;
+    }
+
+    json = PyImport_ImportModule("json");
+    if (json == NULL)
+        goto done;
+    result = PyObject_CallMethod(json, "dumps", "({s:O,s:s})",
+                                 "traceEvents", trace.events,
+                                 "displayTimeUnit", "ms");
+    Py_DECREF(json);
+
+done:
+    PyMem_Free(trace.threads);
+    Py_XDECREF(trace.events);
+    Py_XDECREF(trace.pid);
+    return result;
+}
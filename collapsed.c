@@ -0,0 +1,547 @@
+/*
+ * Export the samples of the sampler in the collapsed stack format, and merge
+ * collapsed profiles of different processes.
+ *
+ * Each line is a stack, oldest frame first, followed by a space and the
+ * number of samples: "[running];main (app.py:10):12;work (app.py:3):5 42".
+ * The first frame is the state of the thread, then its label if any. A frame
+ * is identified by the name, the file name and the first line of its code
+ * object, and by the current line: there is no address, so the stacks of
+ * different processes running the same code are identical lines. Merging
+ * profiles sums the counts of identical lines, reading the files line by
+ * line.
+ *
+ * ";", "%" and newlines are percent-encoded in names. The format is read by
+ * flamegraph.pl, speedscope and inferno.
+ */
+
+#include "Python.h"
+#include "frameobject.h"
+#include "faulthandler.h"
+
+#if PY_MAJOR_VERSION >= 3
+#  define PYINT_FROMSSIZE_T PyLong_FromSsize_t
+#  define PYINT_ASSSIZE_T PyLong_AsSsize_t
+#  define PYSTRING_ASSTRING PyUnicode_AsUTF8
+#  define PYSTRING_CHECK PyUnicode_Check
+#  define BUILTINS_MODULE "builtins"
+#else
+#  define PYINT_FROMSSIZE_T PyInt_FromSsize_t
+#  define PYINT_ASSSIZE_T PyInt_AsSsize_t
+#  define PYSTRING_ASSTRING PyString_AsString
+#  define PYSTRING_CHECK PyString_Check
+#  define BUILTINS_MODULE "__builtin__"
+#endif
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t alloc;
+} cbuf_t;
+
+typedef struct {
+    PyObject *stack;   /* bytes string, strong reference */
+    unsigned PY_LONG_LONG count;
+} stack_count_t;
+
+typedef struct {
+    /* stack => index in counts */
+    PyObject *index;
+    stack_count_t *counts;
+    size_t ncount;
+    size_t alloc;
+    /* line being written or read */
+    cbuf_t line;
+} collapsed_t;
+
+static int
+cbuf_write(cbuf_t *buf, const char *data, size_t size)
+{
+    size_t alloc;
+    char *ptr;
+
+    if (size > buf->alloc - buf->len) {
+        alloc = buf->alloc * 2;
+        if (alloc < buf->len + size)
+            alloc = buf->len + size;
+        if (alloc < 256)
+            alloc = 256;
+        ptr = PyMem_Realloc(buf->data, alloc);
+        if (ptr == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        buf->data = ptr;
+        buf->alloc = alloc;
+    }
+    memcpy(buf->data + buf->len, data, size);
+    buf->len += size;
+    return 0;
+}
+
+static int
+cbuf_puts(cbuf_t *buf, const char *str)
+{
+    return cbuf_write(buf, str, strlen(str));
+}
+
+/* Write a name: percent-encode ";", "%" and newlines */
+static int
+cbuf_name(cbuf_t *buf, const char *str)
+{
+    char escape[4];
+    const char *start;
+
+    for (start = str; *str != '\0'; str++) {
+        if (*str != ';' && *str != '%' && *str != '\n' && *str != '\r')
+            continue;
+        if (cbuf_write(buf, start, str - start) < 0)
+            return -1;
+        PyOS_snprintf(escape, sizeof(escape), "%%%02X", (unsigned char)*str);
+        if (cbuf_write(buf, escape, 3) < 0)
+            return -1;
+        start = str + 1;
+    }
+    return cbuf_write(buf, start, str - start);
+}
+
+static int
+cbuf_decimal(cbuf_t *buf, unsigned PY_LONG_LONG value)
+{
+    char buffer[32];
+    char *ptr = buffer + sizeof(buffer);
+
+    do {
+        *--ptr = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    return cbuf_write(buf, ptr, buffer + sizeof(buffer) - ptr);
+}
+
+/* Add count samples to a stack. Return -1 on error. */
+static int
+collapsed_add(collapsed_t *prof, const char *stack, size_t size,
+              unsigned PY_LONG_LONG count)
+{
+    PyObject *key, *index;
+    stack_count_t *counts;
+    size_t alloc;
+    int res;
+
+    key = PyBytes_FromStringAndSize(stack, size);
+    if (key == NULL)
+        return -1;
+    index = PyDict_GetItem(prof->index, key);
+    if (index != NULL) {
+        Py_DECREF(key);
+        prof->counts[PYINT_ASSSIZE_T(index)].count += count;
+        return 0;
+    }
+
+    if (prof->ncount == prof->alloc) {
+        alloc = prof->alloc * 2 + 64;
+        counts = PyMem_Realloc(prof->counts, alloc * sizeof(stack_count_t));
+        if (counts == NULL) {
+            Py_DECREF(key);
+            PyErr_NoMemory();
+            return -1;
+        }
+        prof->counts = counts;
+        prof->alloc = alloc;
+    }
+
+    index = PYINT_FROMSSIZE_T(prof->ncount);
+    if (index == NULL) {
+        Py_DECREF(key);
+        return -1;
+    }
+    res = PyDict_SetItem(prof->index, key, index);
+    Py_DECREF(index);
+    if (res < 0) {
+        Py_DECREF(key);
+        return -1;
+    }
+    prof->counts[prof->ncount].stack = key;
+    prof->counts[prof->ncount].count = count;
+    prof->ncount++;
+    return 0;
+}
+
+static int
+collapsed_init(collapsed_t *prof)
+{
+    memset(prof, 0, sizeof(*prof));
+    prof->index = PyDict_New();
+    return (prof->index != NULL) ? 0 : -1;
+}
+
+static void
+collapsed_clear(collapsed_t *prof)
+{
+    size_t i;
+
+    for (i=0; i < prof->ncount; i++)
+        Py_DECREF(prof->counts[i].stack);
+    PyMem_Free(prof->counts);
+    Py_CLEAR(prof->index);
+    PyMem_Free(prof->line.data);
+    memset(prof, 0, sizeof(*prof));
+}
+
+/* Sort by number of samples, and then by stack */
+static int
+stack_count_cmp(const void *a, const void *b)
+{
+    const stack_count_t *sa = a, *sb = b;
+    if (sa->count != sb->count)
+        return (sa->count < sb->count) ? 1 : -1;
+    return strcmp(PyBytes_AS_STRING(sa->stack), PyBytes_AS_STRING(sb->stack));
+}
+
+/* Format the stacks, most samples first: return a str */
+static PyObject*
+collapsed_format(collapsed_t *prof)
+{
+    cbuf_t out;
+    stack_count_t *item;
+    PyObject *result;
+    size_t i;
+
+    if (prof->ncount != 0)
+        qsort(prof->counts, prof->ncount, sizeof(stack_count_t),
+              stack_count_cmp);
+
+    memset(&out, 0, sizeof(out));
+    for (i=0; i < prof->ncount; i++) {
+        item = &prof->counts[i];
+        if (cbuf_write(&out, PyBytes_AS_STRING(item->stack),
+                       PyBytes_GET_SIZE(item->stack)) < 0
+            || cbuf_puts(&out, " ") < 0
+            || cbuf_decimal(&out, item->count) < 0
+            || cbuf_puts(&out, "\n") < 0) {
+            PyMem_Free(out.data);
+            return NULL;
+        }
+    }
+#if PY_MAJOR_VERSION >= 3
+    result = PyUnicode_DecodeUTF8(out.data, out.len, "surrogateescape");
+#else
+    result = PyString_FromStringAndSize(out.data, out.len);
+#endif
+    PyMem_Free(out.data);
+    return result;
+}
+
+/* Write a frame: "name (filename:firstlineno):lineno" or "[C] name" */
+static int
+collapsed_frame(cbuf_t *line, const _Py_SampleFrame *frame)
+{
+    PyCodeObject *code;
+    PyObject *name;
+    const char *str;
+    int res;
+
+    if (!PyCode_Check(frame->code)) {
+        name = _Py_CFunctionName(frame->code);
+        if (name == NULL)
+            return -1;
+        str = PYSTRING_ASSTRING(name);
+        res = (str != NULL
+               && cbuf_puts(line, "[C] ") == 0
+               && cbuf_name(line, str) == 0) ? 0 : -1;
+        Py_DECREF(name);
+        return res;
+    }
+
+    code = (PyCodeObject *)frame->code;
+    str = PYSTRING_ASSTRING(code->co_name);
+    if (str == NULL || cbuf_name(line, str) < 0)
+        return -1;
+    if (cbuf_puts(line, " (") < 0)
+        return -1;
+    str = PYSTRING_ASSTRING(code->co_filename);
+    if (str == NULL || cbuf_name(line, str) < 0)
+        return -1;
+    if (cbuf_puts(line, ":") < 0
+        || cbuf_decimal(line, code->co_firstlineno) < 0
+        || cbuf_puts(line, "):") < 0
+        || cbuf_decimal(line, frame->lineno) < 0)
+        return -1;
+    return 0;
+}
+
+/* Visitor of _Py_SamplerVisit(): add a stack, oldest frame first, after the
+   state and the label of the thread */
+static int
+collapsed_sample(const _Py_SampleFrame *frames, int nframe, int state,
+                 int label, size_t count, void *arg)
+{
+    collapsed_t *prof = arg;
+    cbuf_t *line = &prof->line;
+    int i;
+
+    line->len = 0;
+    if (cbuf_puts(line, "[") < 0
+        || cbuf_puts(line, _Py_SampleStateName(state)) < 0
+        || cbuf_puts(line, "]") < 0)
+        return -1;
+    if (label != 0) {
+        if (cbuf_puts(line, ";[label ") < 0
+            || cbuf_name(line, _Py_SampleLabelName(label)) < 0
+            || cbuf_puts(line, "]") < 0)
+            return -1;
+    }
+    for (i=nframe - 1; i >= 0; i--) {
+        if (cbuf_puts(line, ";") < 0)
+            return -1;
+        if (collapsed_frame(line, &frames[i]) < 0)
+            return -1;
+    }
+    return collapsed_add(prof, line->data, line->len, count);
+}
+
+/* Export the samples of the sampler in the collapsed stack format: return a
+   str, or None if the sampler is not running.
+
+   Must be called with the GIL held. Raise an exception and return NULL on
+   error. */
+PyObject*
+_Py_SamplesCollapsed(void)
+{
+    collapsed_t prof;
+    PY_LONG_LONG period, oldest, newest;
+    PyObject *result;
+    int res;
+
+    if (collapsed_init(&prof) < 0)
+        return NULL;
+    res = _Py_SamplerVisit(collapsed_sample, &prof, &period, &oldest, &newest);
+    if (res < 0)
+        result = NULL;
+    else if (res == 1) {
+        /* the sampler is not running */
+        result = Py_None;
+        Py_INCREF(result);
+    }
+    else
+        result = collapsed_format(&prof);
+    collapsed_clear(&prof);
+    return result;
+}
+
+/* Read a line of fp into prof->line without the newline. Return 1 if a line
+   was read, 0 at the end of the file, -1 on error. */
+static int
+collapsed_read_line(collapsed_t *prof, FILE *fp)
+{
+    char chunk[4096];
+    size_t size;
+
+    prof->line.len = 0;
+    while (fgets(chunk, sizeof(chunk), fp) != NULL) {
+        size = strlen(chunk);
+        if (cbuf_write(&prof->line, chunk, size) < 0)
+            return -1;
+        if (size != 0 && chunk[size - 1] == '\n')
+            break;
+    }
+    if (ferror(fp)) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    if (prof->line.len == 0)
+        return 0;
+    while (prof->line.len != 0
+           && (prof->line.data[prof->line.len - 1] == '\n'
+               || prof->line.data[prof->line.len - 1] == '\r'))
+        prof->line.len--;
+    return 1;
+}
+
+/* Add the stacks of a collapsed profile file. Empty lines and lines starting
+   with "#" are ignored. */
+static int
+collapsed_read(collapsed_t *prof, const char *filename)
+{
+    FILE *fp;
+    char *data;
+    size_t len, space, i;
+    unsigned PY_LONG_LONG count;
+    unsigned long lineno;
+    int res;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)filename);
+        return -1;
+    }
+
+    lineno = 0;
+    while ((res = collapsed_read_line(prof, fp)) == 1) {
+        lineno++;
+        data = prof->line.data;
+        len = prof->line.len;
+        if (len == 0 || data[0] == '#')
+            continue;
+
+        /* "stack count": the count is after the last space */
+        for (space = len; space > 0 && data[space - 1] != ' '; space--)
+            ;
+        count = 0;
+        for (i=space; i < len && '0' <= data[i] && data[i] <= '9'; i++)
+            count = count * 10 + (data[i] - '0');
+        if (space <= 1 || i == space || i != len) {
+            PyErr_Format(PyExc_ValueError, "%s:%lu: invalid line",
+                         filename, lineno);
+            res = -1;
+            break;
+        }
+        if (collapsed_add(prof, data, space - 1, count) < 0) {
+            res = -1;
+            break;
+        }
+    }
+    fclose(fp);
+    return res;
+}
+
+/* Merge collapsed profile files: sum the samples of identical stacks.
+   filenames is a sequence of str. Return the merged profile as a str, most
+   samples first.
+
+   Must be called with the GIL held. Raise an exception and return NULL on
+   error. */
+PyObject*
+_Py_MergeCollapsed(PyObject *filenames)
+{
+    collapsed_t prof;
+    PyObject *seq, *result;
+    const char *filename;
+    Py_ssize_t i;
+
+    seq = PySequence_Fast(filenames, "filenames must be a sequence");
+    if (seq == NULL)
+        return NULL;
+    if (collapsed_init(&prof) < 0) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    result = NULL;
+    for (i=0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        filename = PYSTRING_ASSTRING(PySequence_Fast_GET_ITEM(seq, i));
+        if (filename == NULL)
+            goto done;
+        if (collapsed_read(&prof, filename) < 0)
+            goto done;
+    }
+    result = collapsed_format(&prof);
+
+done:
+    collapsed_clear(&prof);
+    Py_DECREF(seq);
+    return result;
+}
+
+static const char merge_usage[] =
+    "usage: faulthandler-merge [-o OUTPUT] PROFILE [PROFILE ...]\n"
+    "\n"
+    "Merge collapsed profiles written by faulthandler.samples_collapsed():\n"
+    "sum the samples of identical stacks. Write the merged profile into\n"
+    "OUTPUT, or into stdout.\n";
+
+/* Command line: faulthandler-merge [-o OUTPUT] PROFILE [PROFILE ...].
+   Return the exit code. */
+PyObject*
+_Py_MergeMain(void)
+{
+    PyObject *argv, *filenames, *arg, *output, *merged, *file, *builtins;
+    const char *str;
+    Py_ssize_t i;
+    int exitcode;
+
+    argv = PySys_GetObject("argv");
+    if (argv == NULL || !PyList_Check(argv)) {
+        PyErr_SetString(PyExc_RuntimeError, "sys.argv is not a list");
+        return NULL;
+    }
+    filenames = PyList_New(0);
+    if (filenames == NULL)
+        return NULL;
+
+    output = NULL;
+    exitcode = 0;
+    for (i=1; i < PyList_GET_SIZE(argv); i++) {
+        arg = PyList_GET_ITEM(argv, i);
+        str = PYSTRING_CHECK(arg) ? PYSTRING_ASSTRING(arg) : NULL;
+        if (str == NULL) {
+            PyErr_Clear();
+            exitcode = 2;
+            break;
+        }
+        if (strcmp(str, "-h") == 0 || strcmp(str, "--help") == 0) {
+            PySys_WriteStdout("%s", merge_usage);
+            Py_DECREF(filenames);
+            return PYINT_FROMSSIZE_T(0);
+        }
+        if (strcmp(str, "-o") == 0) {
+            if (i + 1 == PyList_GET_SIZE(argv)) {
+                exitcode = 2;
+                break;
+            }
+            i++;
+            output = PyList_GET_ITEM(argv, i);
+        }
+        else if (PyList_Append(filenames, arg) < 0) {
+            Py_DECREF(filenames);
+            return NULL;
+        }
+    }
+    if (exitcode == 0 && PyList_GET_SIZE(filenames) == 0)
+        exitcode = 2;
+    if (exitcode != 0) {
+        Py_DECREF(filenames);
+        PySys_WriteStderr("%s", merge_usage);
+        return PYINT_FROMSSIZE_T(exitcode);
+    }
+
+    merged = _Py_MergeCollapsed(filenames);
+    Py_DECREF(filenames);
+    if (merged == NULL)
+        return NULL;
+
+    if (output != NULL) {
+        builtins = PyImport_ImportModule(BUILTINS_MODULE);
+        if (builtins == NULL) {
+            Py_DECREF(merged);
+            return NULL;
+        }
+        file = PyObject_CallMethod(builtins, "open", "Os", output, "w");
+        Py_DECREF(builtins);
+    }
+    else {
+        file = PySys_GetObject("stdout");
+        Py_XINCREF(file);
+    }
+    if (file == NULL) {
+        Py_DECREF(merged);
+        return NULL;
+    }
+    arg = PyObject_CallMethod(file, "write", "O", merged);
+    Py_DECREF(merged);
+    if (arg == NULL) {
+        Py_DECREF(file);
+        return NULL;
+    }
+    Py_DECREF(arg);
+    if (output != NULL) {
+        arg = PyObject_CallMethod(file, "close", "");
+        Py_DECREF(file);
+        if (arg == NULL)
+            return NULL;
+        Py_DECREF(arg);
+    }
+    else
+        Py_DECREF(file);
+    return PYINT_FROMSSIZE_T(0);
+}
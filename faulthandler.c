@@ -6,9 +6,12 @@
 
 #include "Python.h"
 #include "pythread.h"
+#include "faulthandler.h"
 #include <signal.h>
 #ifdef MS_WINDOWS
 #  include <windows.h>
+#else
+#  include <time.h>
 #endif
 #ifdef HAVE_SYS_RESOURCE_H
 #  include <sys/resource.h>
@@ -41,9 +44,6 @@
 #  define PYINT_ASLONG PyInt_AsLong
 #endif
 
-/* defined in traceback.c */
-extern Py_ssize_t _Py_write_noraise(int fd, const char *buf, size_t count);
-
 /* cast size_t to int because write() takes an int on Windows
    (anyway, the length is smaller than 30 characters) */
 #define PUTS(fd, str) _Py_write_noraise(fd, str, (int)strlen(str))
@@ -67,7 +67,9 @@ static struct {
     PyObject *file;
     int fd;
     int all_threads;
+    int flags;
     PyInterpreterState *interp;
+    int signature;
 } fatal_error = {0, NULL, -1, 0};
 
 #ifdef FAULTHANDLER_LATER
@@ -76,6 +78,7 @@ static struct {
     int fd;
     int timeout;
     int repeat;
+    int flags;
     PyInterpreterState *interp;
     int exit;
     char *header;
@@ -89,6 +92,7 @@ typedef struct {
     PyObject *file;
     int fd;
     int all_threads;
+    int flags;
     int chain;
     _Py_sighandler_t previous;
     PyInterpreterState *interp;
@@ -139,13 +143,6 @@ static stack_t stack;
 /* Forward */
 static void faulthandler_unload(void);
 
-/* from traceback.c */
-extern void _Py_DumpTraceback(int fd, PyThreadState *tstate);
-extern const char* _Py_DumpTracebackThreads(
-    int fd,
-    PyInterpreterState *interp,
-    PyThreadState *current_thread);
-
 /* Get the file descriptor of a file by calling its fileno() method and then
    call its flush() method.
 
@@ -230,18 +227,206 @@ get_thread_state(void)
     return tstate;
 }
 
+/* Breadcrumbs: short messages recorded by the application using breadcrumb()
+   and written after the traceback by the fatal error handler and by the
+   dump_traceback_later() handler.
+
+   The ring is preallocated and written without lock: a writer reserves a slot
+   with an atomic increment of breadcrumbs_count and only sets the sequence
+   number of the slot once the message is copied, so a reader skips slots
+   which are being written or which were overwritten. */
+
+#define BREADCRUMB_RING_SIZE 32
+#define BREADCRUMB_MAX_LENGTH 120
+
+#ifdef _MSC_VER
+#  define ATOMIC_INCREMENT(ptr) InterlockedIncrement(ptr)
+#  define MEMORY_BARRIER() MemoryBarrier()
+#else
+#  define ATOMIC_INCREMENT(ptr) __sync_add_and_fetch(ptr, 1)
+#  define MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+typedef struct {
+    volatile long seq;
+    PY_LONG_LONG timestamp;
+    long thread_id;
+    char msg[BREADCRUMB_MAX_LENGTH];
+} breadcrumb_t;
+
+static breadcrumb_t breadcrumbs[BREADCRUMB_RING_SIZE];
+static volatile long breadcrumbs_count = 0;
+
+/* Get the system clock in microseconds since the Epoch.
+
+   This function is signal safe. */
+
+PY_LONG_LONG
+_Py_gettime(void)
+{
+#ifdef MS_WINDOWS
+    FILETIME system_time;
+    ULARGE_INTEGER large;
+
+    GetSystemTimeAsFileTime(&system_time);
+    large.u.LowPart = system_time.dwLowDateTime;
+    large.u.HighPart = system_time.dwHighDateTime;
+    /* 11,644,473,600,000,000: number of microseconds between
+       the 1st january 1601 and the 1st january 1970 (369 years + 89 leap
+       days). */
+    return (PY_LONG_LONG)(large.QuadPart / 10) - 11644473600000000;
+#else
+    struct timeval tv;
+
+#ifdef GETTIMEOFDAY_NO_TZ
+    gettimeofday(&tv);
+#else
+    gettimeofday(&tv, NULL);
+#endif
+    return (PY_LONG_LONG)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* Get a monotonic clock in microseconds, with an unspecified reference point:
+   used to measure intervals and durations, it is not affected by updates of
+   the system clock. Fall back to the system clock if the platform has no
+   monotonic clock.
+
+   This function is signal safe. */
+
+PY_LONG_LONG
+_Py_monotonic(void)
+{
+#ifdef MS_WINDOWS
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    /* split the conversion to not overflow */
+    return (PY_LONG_LONG)(counter.QuadPart / frequency.QuadPart) * 1000000
+           + (PY_LONG_LONG)(counter.QuadPart % frequency.QuadPart) * 1000000
+             / frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (PY_LONG_LONG)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    return _Py_gettime();
+#else
+    return _Py_gettime();
+#endif
+}
+
+/* Record a breadcrumb: copy the message (truncated to BREADCRUMB_MAX_LENGTH-1
+   bytes, non-printable characters replaced with "?") with the current time and
+   the current thread identifier into the ring, overwriting the oldest entry.
+
+   The function doesn't allocate memory and doesn't need the GIL. It is
+   exported to C extensions by the faulthandler.breadcrumb_CAPI capsule. */
+
 static void
-faulthandler_dump_traceback(int fd, int all_threads,
-                            PyInterpreterState *interp)
+faulthandler_breadcrumb(const char *msg)
 {
-    static volatile int reentrant = 0;
-    PyThreadState *tstate;
+    long seq;
+    breadcrumb_t *crumb;
+    size_t i;
+    char ch;
+
+    seq = ATOMIC_INCREMENT(&breadcrumbs_count);
+    crumb = &breadcrumbs[(unsigned long)(seq - 1) % BREADCRUMB_RING_SIZE];
+    crumb->seq = 0;
+    MEMORY_BARRIER();
+
+    crumb->timestamp = _Py_gettime();
+    crumb->thread_id = PyThread_get_thread_ident();
+    for (i=0; i < BREADCRUMB_MAX_LENGTH - 1 && msg[i] != '\0'; i++) {
+        ch = msg[i];
+        if (' ' <= ch && ch <= 126)
+            crumb->msg[i] = ch;
+        else
+            crumb->msg[i] = '?';
+    }
+    crumb->msg[i] = '\0';
 
-    if (reentrant)
+    MEMORY_BARRIER();
+    crumb->seq = seq;
+}
+
+/* Write the breadcrumbs into fd, oldest first. Do nothing if no breadcrumb
+   was recorded.
+
+   This function is signal safe. */
+
+static void
+faulthandler_dump_breadcrumbs(int fd)
+{
+    long count, seq;
+    breadcrumb_t *crumb;
+    char msg[BREADCRUMB_MAX_LENGTH];
+    PY_LONG_LONG timestamp;
+    unsigned long usec, width;
+    long thread_id;
+
+    count = breadcrumbs_count;
+    if (count <= 0)
         return;
 
-    reentrant = 1;
+    PUTS(fd, "\nBreadcrumbs (most recent last):\n");
+    if (count > BREADCRUMB_RING_SIZE)
+        seq = count - BREADCRUMB_RING_SIZE + 1;
+    else
+        seq = 1;
+    for (; seq <= count; seq++) {
+        crumb = &breadcrumbs[(unsigned long)(seq - 1) % BREADCRUMB_RING_SIZE];
+        if (crumb->seq != seq)
+            continue;
+        timestamp = crumb->timestamp;
+        thread_id = crumb->thread_id;
+        memcpy(msg, crumb->msg, sizeof(msg));
+        MEMORY_BARRIER();
+        /* skip the entry if it was overwritten while being copied */
+        if (crumb->seq != seq)
+            continue;
+        msg[BREADCRUMB_MAX_LENGTH - 1] = '\0';
+
+        PUTS(fd, "  [");
+        _Py_dump_decimal(fd, (unsigned long)(timestamp / 1000000));
+        PUTS(fd, ".");
+        usec = (unsigned long)(timestamp % 1000000);
+        for (width = 100000; width > 1 && usec < width; width /= 10)
+            PUTS(fd, "0");
+        _Py_dump_decimal(fd, usec);
+        PUTS(fd, "] Thread 0x");
+        _Py_dump_hexadecimal(fd, (unsigned long)thread_id,
+                             sizeof(unsigned long));
+        PUTS(fd, ": ");
+        PUTS(fd, msg);
+        PUTS(fd, "\n");
+    }
+}
+
+static PyObject*
+faulthandler_breadcrumb_py(PyObject *self, PyObject *args)
+{
+    const char *msg;
+
+    if (!PyArg_ParseTuple(args, "s:breadcrumb", &msg))
+        return NULL;
+
+    faulthandler_breadcrumb(msg);
+    Py_RETURN_NONE;
+}
+
+/* Get the Python thread state of the current thread, even if it doesn't hold
+   the GIL.
+
+   This function is signal safe. */
 
+static PyThreadState*
+faulthandler_thread_state(void)
+{
 #ifdef WITH_THREAD
     /* SIGSEGV, SIGFPE, SIGABRT, SIGBUS and SIGILL are synchronous signals and
        are thus delivered to the thread that caused the fault. Get the Python
@@ -251,35 +436,160 @@ faulthandler_dump_traceback(int fd, int all_threads,
        fault if the thread released the GIL, and so this function cannot be
        used. Read the thread local storage (TLS) instead: call
        PyGILState_GetThisThreadState(). */
-    tstate = PyGILState_GetThisThreadState();
+    return PyGILState_GetThisThreadState();
 #else
-    tstate = PyThreadState_Get();
+    return PyThreadState_Get();
 #endif
+}
+
+/* Write a 64-bit signature as 16 hexadecimal digits.
+
+   This function is signal safe. */
+
+static void
+dump_signature(int fd, unsigned PY_LONG_LONG signature)
+{
+    _Py_dump_hexadecimal(fd, (unsigned long)(signature >> 32), 4);
+    _Py_dump_hexadecimal(fd, (unsigned long)(signature & 0xffffffffUL), 4);
+}
+
+/* Write the stack signatures of the current thread, with and without line
+   numbers: " (stack signature XXX, without lines XXX)". Do nothing if the
+   current thread has no Python thread state.
+
+   This function is signal safe. */
+
+static void
+faulthandler_dump_signature(int fd)
+{
+    PyThreadState *tstate;
+
+    tstate = faulthandler_thread_state();
+    if (tstate == NULL)
+        return;
+
+    PUTS(fd, " (stack signature ");
+    dump_signature(fd, _Py_StackSignature(tstate, 1));
+    PUTS(fd, ", without lines ");
+    dump_signature(fd, _Py_StackSignature(tstate, 0));
+    PUTS(fd, ")");
+}
+
+static void
+faulthandler_dump_traceback(int fd, int all_threads, int flags,
+                            PyInterpreterState *interp)
+{
+    static volatile int reentrant = 0;
+    PyThreadState *tstate;
+
+    if (reentrant)
+        return;
+
+    reentrant = 1;
+
+    tstate = faulthandler_thread_state();
 
-    if (all_threads)
-        _Py_DumpTracebackThreads(fd, interp, tstate);
+    if (flags & _Py_DUMP_SNAPSHOT) {
+        if (_Py_TakeSnapshot(interp, tstate, all_threads) == NULL)
+            _Py_DumpSnapshot(fd, all_threads, flags);
+    }
+    else if (all_threads)
+        _Py_DumpTracebackThreads(fd, interp, tstate, flags);
     else {
         if (tstate != NULL)
-            _Py_DumpTraceback(fd, tstate);
+            _Py_DumpTraceback(fd, tstate, flags);
     }
 
     reentrant = 0;
 }
 
+/* Convert the options of the Python functions to _Py_DUMP_xxx flags.
+   Raise an exception and return -1 on error. */
+static int
+faulthandler_dump_flags(int all_threads, int exceptions, int opcodes,
+                        int locals, int generators, int greenlets,
+                        int all_interpreters)
+{
+    int flags = 0;
+    if (all_interpreters && !all_threads) {
+        PyErr_SetString(PyExc_ValueError,
+                        "all_interpreters requires all_threads");
+        return -1;
+    }
+    if (exceptions)
+        flags |= _Py_DUMP_EXCEPTIONS;
+    if (opcodes)
+        flags |= _Py_DUMP_OPCODES;
+    if (generators)
+        flags |= _Py_DUMP_GENERATORS;
+    if (all_interpreters)
+        flags |= _Py_DUMP_ALL_INTERPRETERS;
+    if (greenlets) {
+#ifdef HAVE_GREENLET_H
+        flags |= _Py_DUMP_GREENLETS;
+#else
+        PyErr_SetString(PyExc_RuntimeError,
+                        "faulthandler was built without greenlet support");
+        return -1;
+#endif
+    }
+    if (locals < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "locals must be greater than or equal to 0");
+        return -1;
+    }
+    if (locals > _Py_DUMP_LOCALS_MAX)
+        locals = _Py_DUMP_LOCALS_MAX;
+    flags |= _Py_DUMP_LOCALS(locals);
+    return flags;
+}
+
+/* Add the _Py_DUMP_SNAPSHOT flag to flags. A snapshot only contains the code
+   object and the bytecode offset of frames: raise ValueError and return -1 if
+   an option requires more. */
+static int
+faulthandler_snapshot_flags(int flags)
+{
+    if ((flags & (_Py_DUMP_EXCEPTIONS | _Py_DUMP_ALL_INTERPRETERS))
+        || _Py_DUMP_LOCALS_LENGTH(flags) != 0)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "snapshot cannot be combined with exceptions, "
+                        "locals or all_interpreters");
+        return -1;
+    }
+    return flags | _Py_DUMP_SNAPSHOT;
+}
+
 static PyObject*
 faulthandler_dump_traceback_py(PyObject *self,
                                PyObject *args, PyObject *kwargs)
 {
-    static char *kwlist[] = {"file", "all_threads", NULL};
+    static char *kwlist[] = {"file", "all_threads", "exceptions", "opcodes",
+                             "locals", "generators", "greenlets",
+                             "all_interpreters", NULL};
     PyObject *file = NULL;
     int all_threads = 1;
+    int exceptions = 0;
+    int opcodes = 0;
+    int locals = 0;
+    int generators = 0;
+    int greenlets = 0;
+    int all_interpreters = 0;
+    int flags;
     PyThreadState *tstate;
     const char *errmsg;
     int fd;
 
     if (!PyArg_ParseTupleAndKeywords(args, kwargs,
-        "|Oi:dump_traceback", kwlist,
-        &file, &all_threads))
+        "|Oiiiiiii:dump_traceback", kwlist,
+        &file, &all_threads, &exceptions, &opcodes, &locals, &generators,
+        &greenlets, &all_interpreters))
+        return NULL;
+    flags = faulthandler_dump_flags(all_threads, exceptions, opcodes,
+                                    locals, generators, greenlets,
+                                    all_interpreters);
+    if (flags < 0)
         return NULL;
 
     fd = faulthandler_get_fileno(&file);
@@ -291,14 +601,14 @@ faulthandler_dump_traceback_py(PyObject *self,
         return NULL;
 
     if (all_threads) {
-        errmsg = _Py_DumpTracebackThreads(fd, tstate->interp, tstate);
+        errmsg = _Py_DumpTracebackThreads(fd, tstate->interp, tstate, flags);
         if (errmsg != NULL) {
             PyErr_SetString(PyExc_RuntimeError, errmsg);
             return NULL;
         }
     }
     else {
-        _Py_DumpTraceback(fd, tstate);
+        _Py_DumpTraceback(fd, tstate, flags);
     }
 
     if (PyErr_CheckSignals())
@@ -307,6 +617,65 @@ faulthandler_dump_traceback_py(PyObject *self,
     Py_RETURN_NONE;
 }
 
+static PyObject*
+faulthandler_stack_signature(PyObject *self,
+                             PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"lines", NULL};
+    int lines = 1;
+    PyThreadState *tstate;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+        "|i:stack_signature", kwlist, &lines))
+        return NULL;
+
+    tstate = get_thread_state();
+    if (tstate == NULL)
+        return NULL;
+
+    return PyLong_FromUnsignedLongLong(_Py_StackSignature(tstate, lines));
+}
+
+static PyObject*
+faulthandler_stack_depths(PyObject *self)
+{
+    PyThreadState *tstate;
+    PyObject *depths, *key, *value;
+    int err;
+
+    tstate = get_thread_state();
+    if (tstate == NULL)
+        return NULL;
+
+    depths = PyDict_New();
+    if (depths == NULL)
+        return NULL;
+
+    for (tstate = PyInterpreterState_ThreadHead(tstate->interp);
+         tstate != NULL;
+         tstate = PyThreadState_Next(tstate))
+    {
+        key = PyLong_FromLong(tstate->thread_id);
+        if (key == NULL)
+            goto error;
+        value = PyLong_FromUnsignedLong(_Py_CountFrames(tstate->frame, 0));
+        if (value == NULL) {
+            Py_DECREF(key);
+            goto error;
+        }
+        err = PyDict_SetItem(depths, key, value);
+        Py_DECREF(key);
+        Py_DECREF(value);
+        if (err < 0)
+            goto error;
+    }
+    return depths;
+
+error:
+    Py_DECREF(depths);
+    return NULL;
+}
+
 static void
 faulthandler_disable_fatal_handler(fault_handler_t *handler)
 {
@@ -360,10 +729,14 @@ faulthandler_fatal_error(int signum)
 
     PUTS(fd, "Fatal Python error: ");
     PUTS(fd, handler->name);
+    if (fatal_error.signature)
+        faulthandler_dump_signature(fd);
     PUTS(fd, "\n\n");
 
     faulthandler_dump_traceback(fd, fatal_error.all_threads,
-                                fatal_error.interp);
+                                fatal_error.flags, fatal_error.interp);
+    faulthandler_dump_breadcrumbs(fd);
+    _Py_DumpSamples(fd);
 
     errno = save_errno;
 #ifdef MS_WINDOWS
@@ -379,8 +752,6 @@ faulthandler_fatal_error(int signum)
 }
 
 #ifdef MS_WINDOWS
-extern void _Py_dump_hexadecimal(int fd, unsigned long value, size_t bytes);
-
 static int
 faulthandler_ignore_exception(DWORD code)
 {
@@ -423,6 +794,8 @@ faulthandler_exc_handler(struct _EXCEPTION_POINTERS *exc_info)
         PUTS(fd, "code 0x");
         _Py_dump_hexadecimal(fd, code, sizeof(DWORD));
     }
+    if (fatal_error.signature)
+        faulthandler_dump_signature(fd);
     PUTS(fd, "\n\n");
 
     if (code == EXCEPTION_ACCESS_VIOLATION) {
@@ -439,7 +812,9 @@ faulthandler_exc_handler(struct _EXCEPTION_POINTERS *exc_info)
     }
 
     faulthandler_dump_traceback(fd, fatal_error.all_threads,
-                                fatal_error.interp);
+                                fatal_error.flags, fatal_error.interp);
+    faulthandler_dump_breadcrumbs(fd);
+    _Py_DumpSamples(fd);
 
     /* call the next exception handler */
     return EXCEPTION_CONTINUE_SEARCH;
@@ -452,9 +827,20 @@ faulthandler_exc_handler(struct _EXCEPTION_POINTERS *exc_info)
 static PyObject*
 faulthandler_enable(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    static char *kwlist[] = {"file", "all_threads", NULL};
+    static char *kwlist[] = {"file", "all_threads", "signature",
+                             "exceptions", "opcodes", "locals",
+                             "generators", "greenlets",
+                             "all_interpreters", NULL};
     PyObject *file = NULL;
     int all_threads = 1;
+    int signature = 0;
+    int exceptions = 0;
+    int opcodes = 0;
+    int locals = 0;
+    int generators = 0;
+    int greenlets = 0;
+    int all_interpreters = 0;
+    int flags;
     unsigned int i;
     fault_handler_t *handler;
 #ifdef HAVE_SIGACTION
@@ -465,7 +851,14 @@ faulthandler_enable(PyObject *self, PyObject *args, PyObject *kwargs)
     PyThreadState *tstate;
 
     if (!PyArg_ParseTupleAndKeywords(args, kwargs,
-        "|Oi:enable", kwlist, &file, &all_threads))
+        "|Oiiiiiiii:enable", kwlist, &file, &all_threads, &signature,
+        &exceptions, &opcodes, &locals, &generators, &greenlets,
+        &all_interpreters))
+        return NULL;
+    flags = faulthandler_dump_flags(all_threads, exceptions, opcodes,
+                                    locals, generators, greenlets,
+                                    all_interpreters);
+    if (flags < 0)
         return NULL;
 
     fd = faulthandler_get_fileno(&file);
@@ -481,7 +874,9 @@ faulthandler_enable(PyObject *self, PyObject *args, PyObject *kwargs)
     fatal_error.file = file;
     fatal_error.fd = fd;
     fatal_error.all_threads = all_threads;
+    fatal_error.flags = flags;
     fatal_error.interp = tstate->interp;
+    fatal_error.signature = signature;
 
     if (!fatal_error.enabled) {
         fatal_error.enabled = 1;
@@ -571,16 +966,27 @@ faulthandler_alarm(int signum)
     const char* errmsg;
     int ok;
 
-    _Py_write_noraise(fault_alarm.fd,
-                      fault_alarm.header, fault_alarm.header_len);
-
     /* PyThreadState_Get() doesn't give the state of the current thread if
        the thread doesn't hold the GIL. Read the thread local storage (TLS)
        instead: call PyGILState_GetThisThreadState(). */
     tstate = PyGILState_GetThisThreadState();
 
-    errmsg = _Py_DumpTracebackThreads(fault_alarm.fd, fault_alarm.interp, tstate);
+    if (fault_alarm.flags & _Py_DUMP_SNAPSHOT) {
+        /* take the snapshot before writing anything */
+        errmsg = _Py_TakeSnapshot(fault_alarm.interp, tstate, 1);
+        _Py_write_noraise(fault_alarm.fd,
+                          fault_alarm.header, fault_alarm.header_len);
+        if (errmsg == NULL)
+            _Py_DumpSnapshot(fault_alarm.fd, 1, fault_alarm.flags);
+    }
+    else {
+        _Py_write_noraise(fault_alarm.fd,
+                          fault_alarm.header, fault_alarm.header_len);
+        errmsg = _Py_DumpTracebackThreads(fault_alarm.fd, fault_alarm.interp,
+                                          tstate, fault_alarm.flags);
+    }
     ok = (errmsg == NULL);
+    faulthandler_dump_breadcrumbs(fault_alarm.fd);
 
     if (ok && fault_alarm.repeat)
         alarm(fault_alarm.timeout);
@@ -624,25 +1030,47 @@ static PyObject*
 faulthandler_dump_traceback_later(PyObject *self,
                                   PyObject *args, PyObject *kwargs)
 {
-    static char *kwlist[] = {"timeout", "repeat", "file", "exit", NULL};
+    static char *kwlist[] = {"timeout", "repeat", "file", "exit",
+                             "exceptions", "opcodes", "locals",
+                             "generators", "greenlets",
+                             "all_interpreters", "snapshot", NULL};
     int timeout;
     PyOS_sighandler_t previous;
     int repeat = 0;
     PyObject *file = NULL;
     int exit = 0;
+    int exceptions = 0;
+    int opcodes = 0;
+    int locals = 0;
+    int generators = 0;
+    int greenlets = 0;
+    int all_interpreters = 0;
+    int snapshot = 0;
+    int flags;
     PyThreadState *tstate;
     int fd;
     char *header;
     size_t header_len;
 
     if (!PyArg_ParseTupleAndKeywords(args, kwargs,
-        "i|iOi:dump_traceback_later", kwlist,
-        &timeout, &repeat, &file, &exit))
+        "i|iOiiiiiiii:dump_traceback_later", kwlist,
+        &timeout, &repeat, &file, &exit, &exceptions, &opcodes, &locals,
+        &generators, &greenlets, &all_interpreters, &snapshot))
         return NULL;
     if (timeout <= 0) {
         PyErr_SetString(PyExc_ValueError, "timeout must be greater than 0");
         return NULL;
     }
+    flags = faulthandler_dump_flags(1, exceptions, opcodes,
+                                    locals, generators, greenlets,
+                                    all_interpreters);
+    if (flags < 0)
+        return NULL;
+    if (snapshot) {
+        flags = faulthandler_snapshot_flags(flags);
+        if (flags < 0)
+            return NULL;
+    }
 
     tstate = get_thread_state();
     if (tstate == NULL)
@@ -671,6 +1099,7 @@ faulthandler_dump_traceback_later(PyObject *self,
     fault_alarm.fd = fd;
     fault_alarm.timeout = timeout;
     fault_alarm.repeat = repeat;
+    fault_alarm.flags = flags;
     fault_alarm.interp = tstate->interp;
     fault_alarm.exit = exit;
     fault_alarm.header = header;
@@ -692,6 +1121,508 @@ faulthandler_cancel_dump_traceback_later_py(PyObject *self)
 }
 #endif /* FAULTHANDLER_LATER */
 
+static PyObject*
+faulthandler_stop_sampler_py(PyObject *self)
+{
+    /* stopping the sampler would silently stop the sampling of the scopes */
+    if (_Py_SamplerHasScopes()) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot stop the sampler while a sampling scope "
+                        "is active");
+        return NULL;
+    }
+    _Py_SamplerStop();
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+faulthandler_stop_sampler_atexit(PyObject *self)
+{
+    _Py_SamplerStop();
+    Py_RETURN_NONE;
+}
+
+/* Stop the sampler thread at exit, before Python is finalized, even if
+   scopes of daemon threads are still active */
+static int
+faulthandler_register_atexit(void)
+{
+    static int registered = 0;
+    static PyMethodDef stop_def = {
+        "stop_sampler", (PyCFunction)faulthandler_stop_sampler_atexit,
+        METH_NOARGS, NULL};
+    PyObject *atexit, *func, *res;
+
+    if (registered)
+        return 0;
+
+    func = PyCFunction_New(&stop_def, NULL);
+    if (func == NULL)
+        return -1;
+    atexit = PyImport_ImportModule("atexit");
+    if (atexit == NULL) {
+        Py_DECREF(func);
+        return -1;
+    }
+    res = PyObject_CallMethod(atexit, "register", "O", func);
+    Py_DECREF(atexit);
+    Py_DECREF(func);
+    if (res == NULL)
+        return -1;
+    Py_DECREF(res);
+    registered = 1;
+    return 0;
+}
+
+static PyObject*
+faulthandler_start_sampler(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"interval", "duration", "trie_size", "mode",
+                             "backend", NULL};
+    double interval = 0.1;
+    double duration = 30.0;
+    int trie_size = 0;
+    const char *mode = NULL;
+    const char *backend = "thread";
+    int wall, perf;
+    PyThreadState *tstate;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+        "|ddizs:start_sampler", kwlist,
+        &interval, &duration, &trie_size, &mode, &backend))
+        return NULL;
+    if (interval <= 0) {
+        PyErr_SetString(PyExc_ValueError, "interval must be greater than 0");
+        return NULL;
+    }
+    if (duration < interval) {
+        PyErr_SetString(PyExc_ValueError,
+                        "duration must be greater than or equal to interval");
+        return NULL;
+    }
+    if (trie_size < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "trie_size must be greater than or equal to 0");
+        return NULL;
+    }
+    if (strcmp(backend, "thread") == 0)
+        perf = 0;
+    else if (strcmp(backend, "perf") == 0)
+        perf = 1;
+    else {
+        PyErr_SetString(PyExc_ValueError,
+                        "backend must be 'thread' or 'perf'");
+        return NULL;
+    }
+    if (mode == NULL)
+        wall = !perf;
+    else if (strcmp(mode, "wall") == 0)
+        wall = 1;
+    else if (strcmp(mode, "cpu") == 0)
+        wall = 0;
+    else {
+        PyErr_SetString(PyExc_ValueError, "mode must be 'wall' or 'cpu'");
+        return NULL;
+    }
+    if (perf && wall) {
+        PyErr_SetString(PyExc_ValueError,
+                        "the perf backend only supports the 'cpu' mode");
+        return NULL;
+    }
+
+    tstate = get_thread_state();
+    if (tstate == NULL)
+        return NULL;
+
+    if (faulthandler_register_atexit() < 0)
+        return NULL;
+
+    if (_Py_SamplerStart(tstate->interp, interval, duration,
+                         (unsigned int)trie_size, wall, perf) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+faulthandler_sampling(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"interval", "threads", NULL};
+    double interval = 0.01;
+    const char *threads = "current";
+    int all_threads;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+        "|ds:sampling", kwlist, &interval, &threads))
+        return NULL;
+    if (interval <= 0) {
+        PyErr_SetString(PyExc_ValueError, "interval must be greater than 0");
+        return NULL;
+    }
+    if (strcmp(threads, "current") == 0)
+        all_threads = 0;
+    else if (strcmp(threads, "all") == 0)
+        all_threads = 1;
+    else {
+        PyErr_SetString(PyExc_ValueError,
+                        "threads must be 'current' or 'all'");
+        return NULL;
+    }
+
+    /* the sampler started by the scope is stopped at exit */
+    if (faulthandler_register_atexit() < 0)
+        return NULL;
+
+    return _Py_SamplingNew(interval, all_threads);
+}
+
+static PyObject*
+faulthandler_dump_samples_py(PyObject *self,
+                             PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"file", NULL};
+    PyObject *file = NULL;
+    int fd;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+        "|O:dump_samples", kwlist, &file))
+        return NULL;
+
+    fd = faulthandler_get_fileno(&file);
+    if (fd < 0)
+        return NULL;
+
+    _Py_DumpSamples(fd);
+
+    if (PyErr_CheckSignals())
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+faulthandler_sample_trie_stats(PyObject *self)
+{
+    size_t nnode, capacity, overflow;
+
+    if (_Py_SamplerTrieStats(&nnode, &capacity, &overflow) != 0)
+        Py_RETURN_NONE;
+    return Py_BuildValue("(nnn)", (Py_ssize_t)nnode, (Py_ssize_t)capacity,
+                         (Py_ssize_t)overflow);
+}
+
+static PyObject*
+faulthandler_sample_thread_stats(PyObject *self)
+{
+    size_t nthread, nuntracked, untracked_samples;
+
+    if (_Py_SamplerThreadStats(&nthread, &nuntracked,
+                               &untracked_samples) != 0)
+        Py_RETURN_NONE;
+    return Py_BuildValue("(nnn)", (Py_ssize_t)nthread,
+                         (Py_ssize_t)nuntracked,
+                         (Py_ssize_t)untracked_samples);
+}
+
+static PyObject*
+faulthandler_samples_pprof(PyObject *self,
+                           PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"compress", NULL};
+    int compress = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+        "|i:samples_pprof", kwlist, &compress))
+        return NULL;
+
+    return _Py_SamplesPprof(compress);
+}
+
+static PyObject*
+faulthandler_samples_chrome_trace(PyObject *self)
+{
+    return _Py_SamplesChromeTrace();
+}
+
+static PyObject*
+faulthandler_set_sample_label(PyObject *self,
+                              PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"label", NULL};
+    char *label;
+    PyThreadState *tstate;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+        "z:set_sample_label", kwlist, &label))
+        return NULL;
+
+    tstate = get_thread_state();
+    if (tstate == NULL)
+        return NULL;
+
+    if (_Py_SetSampleLabel(tstate, label) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+faulthandler_get_sample_label(PyObject *self)
+{
+    PyThreadState *tstate;
+    const char *label;
+
+    tstate = get_thread_state();
+    if (tstate == NULL)
+        return NULL;
+
+    label = _Py_SampleLabelName(_Py_GetThreadLabel(tstate));
+    if (label == NULL)
+        Py_RETURN_NONE;
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FromString(label);
+#else
+    return PyString_FromString(label);
+#endif
+}
+
+static PyObject*
+faulthandler_samples_collapsed(PyObject *self)
+{
+    return _Py_SamplesCollapsed();
+}
+
+static PyObject*
+faulthandler_merge_collapsed(PyObject *self,
+                             PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"filenames", NULL};
+    PyObject *filenames;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+        "O:merge_collapsed", kwlist, &filenames))
+        return NULL;
+
+    return _Py_MergeCollapsed(filenames);
+}
+
+static PyObject*
+faulthandler_merge_main(PyObject *self)
+{
+    return _Py_MergeMain();
+}
+
+static PyObject*
+faulthandler_sample_lines(PyObject *self,
+                          PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"label", NULL};
+    char *label = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+        "|z:sample_lines", kwlist, &label))
+        return NULL;
+
+    return _Py_SamplesLines(label);
+}
+
+static PyObject*
+faulthandler_dump_hot_lines_py(PyObject *self,
+                               PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"file", "top", "label", NULL};
+    PyObject *file = NULL;
+    int top = 10;
+    char *label = NULL;
+    int fd;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+        "|Oiz:dump_hot_lines", kwlist, &file, &top, &label))
+        return NULL;
+    if (top < 1) {
+        PyErr_SetString(PyExc_ValueError, "top must be greater than 0");
+        return NULL;
+    }
+
+    fd = faulthandler_get_fileno(&file);
+    if (fd < 0)
+        return NULL;
+
+    if (_Py_DumpHotLines(fd, top, label) < 0)
+        return NULL;
+
+    if (PyErr_CheckSignals())
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+faulthandler_enable_shadow_stack(PyObject *self)
+{
+    PyThreadState *tstate;
+
+    tstate = get_thread_state();
+    if (tstate == NULL)
+        return NULL;
+
+    if (_Py_ShadowStackEnable(tstate->interp) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+faulthandler_disable_shadow_stack(PyObject *self)
+{
+    if (_Py_ShadowStackDisable() < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+faulthandler_shadow_stack(PyObject *self)
+{
+    PyThreadState *tstate;
+    _Py_ShadowEntry *entries;
+    unsigned int depth, i;
+    PY_LONG_LONG offset;
+    PyObject *list, *item;
+
+    tstate = get_thread_state();
+    if (tstate == NULL)
+        return NULL;
+
+    depth = _Py_GetShadowStack(tstate, &entries);
+    if (depth == 0)
+        Py_RETURN_NONE;
+
+    list = PyList_New(depth);
+    if (list == NULL)
+        return NULL;
+    /* entries are timestamped with the monotonic clock: convert them to the
+       system clock */
+    offset = _Py_gettime() - _Py_monotonic();
+    /* most recent call first */
+    for (i=0; i < depth; i++) {
+        item = Py_BuildValue("(Od)",
+                             (PyObject *)entries[depth - 1 - i].code,
+                             (entries[depth - 1 - i].timestamp + offset)
+                             * 1e-6);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
+static PyObject*
+faulthandler_watch_slow_calls(PyObject *self,
+                              PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"threshold", "file", "filter", "interval", NULL};
+    double threshold;
+    PyObject *file = NULL;
+    PyObject *filter = Py_None;
+    double interval = 1.0;
+    PyThreadState *tstate;
+    int fd;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+        "d|OOd:watch_slow_calls", kwlist,
+        &threshold, &file, &filter, &interval))
+        return NULL;
+    if (threshold <= 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must be greater than 0");
+        return NULL;
+    }
+    if (interval < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "interval must be greater than or equal to 0");
+        return NULL;
+    }
+    if (filter == Py_None)
+        filter = NULL;
+    else if (!PyCallable_Check(filter)) {
+        PyErr_SetString(PyExc_TypeError, "filter must be callable or None");
+        return NULL;
+    }
+
+    tstate = get_thread_state();
+    if (tstate == NULL)
+        return NULL;
+
+    fd = faulthandler_get_fileno(&file);
+    if (fd < 0)
+        return NULL;
+
+    Py_XINCREF(file);
+    Py_XINCREF(filter);
+    if (_Py_WatchSlowCalls(tstate->interp, file, fd,
+                           (PY_LONG_LONG)(threshold * 1e6),
+                           (PY_LONG_LONG)(interval * 1e6),
+                           filter) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+faulthandler_unwatch_slow_calls(PyObject *self)
+{
+    if (_Py_UnwatchSlowCalls() < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+faulthandler_enable_latency_histograms(PyObject *self)
+{
+    PyThreadState *tstate;
+
+    tstate = get_thread_state();
+    if (tstate == NULL)
+        return NULL;
+
+    if (_Py_HistogramsEnable(tstate->interp) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+faulthandler_disable_latency_histograms(PyObject *self)
+{
+    if (_Py_HistogramsDisable() < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+faulthandler_latency_histograms(PyObject *self,
+                                PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"top", "sort", NULL};
+    Py_ssize_t top = 10;
+    const char *sort = "total";
+    int by_p99;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+        "|ns:latency_histograms", kwlist,
+        &top, &sort))
+        return NULL;
+    if (top < 1) {
+        PyErr_SetString(PyExc_ValueError, "top must be greater than 0");
+        return NULL;
+    }
+    if (strcmp(sort, "total") == 0)
+        by_p99 = 0;
+    else if (strcmp(sort, "p99") == 0)
+        by_p99 = 1;
+    else {
+        PyErr_SetString(PyExc_ValueError, "sort must be 'total' or 'p99'");
+        return NULL;
+    }
+    return _Py_GetHistograms(top, by_p99);
+}
+
 #ifdef FAULTHANDLER_USER
 static int
 faulthandler_register(int signum, int chain, _Py_sighandler_t *p_previous)
@@ -743,7 +1674,8 @@ faulthandler_user(int signum)
     if (!user->enabled)
         return;
 
-    faulthandler_dump_traceback(user->fd, user->all_threads, user->interp);
+    faulthandler_dump_traceback(user->fd, user->all_threads, user->flags,
+                                user->interp);
 
 #ifdef HAVE_SIGACTION
     if (user->chain) {
@@ -791,11 +1723,22 @@ static PyObject*
 faulthandler_register_py(PyObject *self,
                          PyObject *args, PyObject *kwargs)
 {
-    static char *kwlist[] = {"signum", "file", "all_threads", "chain", NULL};
+    static char *kwlist[] = {"signum", "file", "all_threads", "chain",
+                             "exceptions", "opcodes", "locals",
+                             "generators", "greenlets",
+                             "all_interpreters", "snapshot", NULL};
     int signum;
     PyObject *file = NULL;
     int all_threads = 1;
     int chain = 0;
+    int exceptions = 0;
+    int opcodes = 0;
+    int locals = 0;
+    int generators = 0;
+    int greenlets = 0;
+    int all_interpreters = 0;
+    int snapshot = 0;
+    int flags;
     int fd;
     user_signal_t *user;
     _Py_sighandler_t previous;
@@ -803,9 +1746,20 @@ faulthandler_register_py(PyObject *self,
     int err;
 
     if (!PyArg_ParseTupleAndKeywords(args, kwargs,
-        "i|Oii:register", kwlist,
-        &signum, &file, &all_threads, &chain))
+        "i|Oiiiiiiiii:register", kwlist,
+        &signum, &file, &all_threads, &chain, &exceptions, &opcodes,
+        &locals, &generators, &greenlets, &all_interpreters, &snapshot))
+        return NULL;
+    flags = faulthandler_dump_flags(all_threads, exceptions, opcodes,
+                                    locals, generators, greenlets,
+                                    all_interpreters);
+    if (flags < 0)
         return NULL;
+    if (snapshot) {
+        flags = faulthandler_snapshot_flags(flags);
+        if (flags < 0)
+            return NULL;
+    }
 
     if (!check_signum(signum))
         return NULL;
@@ -841,6 +1795,7 @@ faulthandler_register_py(PyObject *self,
     user->file = file;
     user->fd = fd;
     user->all_threads = all_threads;
+    user->flags = flags;
     user->chain = chain;
     user->interp = tstate->interp;
     user->enabled = 1;
@@ -1118,7 +2073,10 @@ PyDoc_STRVAR(module_doc,
 static PyMethodDef module_methods[] = {
     {"enable",
      (PyCFunction)faulthandler_enable, METH_VARARGS|METH_KEYWORDS,
-     PyDoc_STR("enable(file=sys.stderr, all_threads=True): "
+     PyDoc_STR("enable(file=sys.stderr, all_threads=True, signature=False, "
+               "exceptions=False, opcodes=False, locals=0, "
+               "generators=False, greenlets=False, "
+               "all_interpreters=False): "
                "enable the fault handler")},
     {"disable", (PyCFunction)faulthandler_disable_py, METH_NOARGS,
      PyDoc_STR("disable(): disable the fault handler")},
@@ -1126,13 +2084,27 @@ static PyMethodDef module_methods[] = {
      PyDoc_STR("is_enabled()->bool: check if the handler is enabled")},
     {"dump_traceback",
      (PyCFunction)faulthandler_dump_traceback_py, METH_VARARGS|METH_KEYWORDS,
-     PyDoc_STR("dump_traceback(file=sys.stderr, all_threads=True): "
+     PyDoc_STR("dump_traceback(file=sys.stderr, all_threads=True, "
+               "exceptions=False, opcodes=False, locals=0, "
+               "generators=False, greenlets=False, "
+               "all_interpreters=False): "
                "dump the traceback of the current thread, or of all threads "
                "if all_threads is True, into file")},
+    {"stack_signature",
+     (PyCFunction)faulthandler_stack_signature, METH_VARARGS|METH_KEYWORDS,
+     PyDoc_STR("stack_signature(lines=True): 64-bit signature of the stack "
+               "of the current thread, as written by the fault handler")},
+    {"stack_depths",
+     (PyCFunction)faulthandler_stack_depths, METH_NOARGS,
+     PyDoc_STR("stack_depths()->dict: number of frames of each thread, "
+               "indexed by thread identifier")},
 #ifdef FAULTHANDLER_LATER
     {"dump_traceback_later",
      (PyCFunction)faulthandler_dump_traceback_later, METH_VARARGS|METH_KEYWORDS,
-     PyDoc_STR("dump_traceback_later(timeout, repeat=False, file=sys.stderrn, exit=False):\n"
+     PyDoc_STR("dump_traceback_later(timeout, repeat=False, file=sys.stderrn, exit=False, "
+               "exceptions=False, opcodes=False, locals=0, "
+               "generators=False, greenlets=False, "
+               "all_interpreters=False, snapshot=False):\n"
                "dump the traceback of all threads in timeout seconds,\n"
                "or each timeout seconds if repeat is True. If exit is True, "
                "call _exit(1) which is not safe.")},
@@ -1145,7 +2117,10 @@ static PyMethodDef module_methods[] = {
 #ifdef FAULTHANDLER_USER
     {"register",
      (PyCFunction)faulthandler_register_py, METH_VARARGS|METH_KEYWORDS,
-     PyDoc_STR("register(signum, file=sys.stderr, all_threads=True, chain=False): "
+     PyDoc_STR("register(signum, file=sys.stderr, all_threads=True, chain=False, "
+               "exceptions=False, opcodes=False, locals=0, "
+               "generators=False, greenlets=False, "
+               "all_interpreters=False, snapshot=False): "
                "register an handler for the signal 'signum': dump the "
                "traceback of the current thread, or of all threads if "
                "all_threads is True, into file")},
@@ -1155,6 +2130,107 @@ static PyMethodDef module_methods[] = {
                 "'signum' registered by register()")},
 #endif
 
+    {"start_sampler",
+     (PyCFunction)faulthandler_start_sampler, METH_VARARGS|METH_KEYWORDS,
+     PyDoc_STR("start_sampler(interval=0.1, duration=30.0, trie_size=0, "
+               "mode='wall', backend='thread'): take a sample of the stack "
+               "of all threads, or only of running threads in the 'cpu' "
+               "mode, every interval seconds and keep the samples of the "
+               "last duration seconds")},
+    {"sampling",
+     (PyCFunction)faulthandler_sampling, METH_VARARGS|METH_KEYWORDS,
+     PyDoc_STR("sampling(interval=0.01, threads='current'): context "
+               "manager counting the samples of the current thread, or of "
+               "all threads, taken during the block")},
+    {"stop_sampler", (PyCFunction)faulthandler_stop_sampler_py, METH_NOARGS,
+     PyDoc_STR("stop_sampler(): stop the sampler and drop its samples")},
+    {"dump_samples",
+     (PyCFunction)faulthandler_dump_samples_py, METH_VARARGS|METH_KEYWORDS,
+     PyDoc_STR("dump_samples(file=sys.stderr): dump the samples taken "
+               "by the sampler into file, most frequent stack first")},
+    {"sample_trie_stats",
+     (PyCFunction)faulthandler_sample_trie_stats, METH_NOARGS,
+     PyDoc_STR("sample_trie_stats()->tuple: (nodes, capacity, overflow) "
+               "of the trie of the sampler, or None")},
+    {"sample_thread_stats",
+     (PyCFunction)faulthandler_sample_thread_stats, METH_NOARGS,
+     PyDoc_STR("sample_thread_stats()->tuple: (threads, untracked, "
+               "untracked_samples) of the sampler, or None")},
+    {"samples_pprof",
+     (PyCFunction)faulthandler_samples_pprof, METH_VARARGS|METH_KEYWORDS,
+     PyDoc_STR("samples_pprof(compress=True)->bytes: samples taken by "
+               "the sampler in the pprof format, compressed with gzip")},
+    {"samples_chrome_trace",
+     (PyCFunction)faulthandler_samples_chrome_trace, METH_NOARGS,
+     PyDoc_STR("samples_chrome_trace()->str: timeline of the samples taken "
+               "by the sampler in the Chrome trace event format (JSON)")},
+    {"samples_collapsed",
+     (PyCFunction)faulthandler_samples_collapsed, METH_NOARGS,
+     PyDoc_STR("samples_collapsed()->str: samples taken by the sampler in "
+               "the collapsed stack format, mergeable across processes")},
+    {"merge_collapsed",
+     (PyCFunction)faulthandler_merge_collapsed, METH_VARARGS|METH_KEYWORDS,
+     PyDoc_STR("merge_collapsed(filenames)->str: merge collapsed profile "
+               "files, sum the samples of identical stacks")},
+    {"merge_main",
+     (PyCFunction)faulthandler_merge_main, METH_NOARGS,
+     PyDoc_STR("merge_main()->int: faulthandler-merge command line, "
+               "read sys.argv")},
+    {"set_sample_label",
+     (PyCFunction)faulthandler_set_sample_label, METH_VARARGS|METH_KEYWORDS,
+     PyDoc_STR("set_sample_label(label): copy the label into the next "
+               "samples of the current thread, None removes the label")},
+    {"get_sample_label",
+     (PyCFunction)faulthandler_get_sample_label, METH_NOARGS,
+     PyDoc_STR("get_sample_label()->str: label of the current thread, "
+               "or None")},
+    {"sample_lines",
+     (PyCFunction)faulthandler_sample_lines, METH_VARARGS|METH_KEYWORDS,
+     PyDoc_STR("sample_lines(label=None)->list: (code, lineno, self, "
+               "inclusive) sample counts of each line, most self samples "
+               "first, only of the samples with the label if it is set")},
+    {"dump_hot_lines",
+     (PyCFunction)faulthandler_dump_hot_lines_py, METH_VARARGS|METH_KEYWORDS,
+     PyDoc_STR("dump_hot_lines(file=sys.stderr, top=10, label=None): write "
+               "the source code of the hottest functions annotated with the "
+               "sample percentages of each line")},
+    {"enable_shadow_stack",
+     (PyCFunction)faulthandler_enable_shadow_stack, METH_NOARGS,
+     PyDoc_STR("enable_shadow_stack(): maintain the stack of each thread "
+               "with a C profile function")},
+    {"disable_shadow_stack",
+     (PyCFunction)faulthandler_disable_shadow_stack, METH_NOARGS,
+     PyDoc_STR("disable_shadow_stack(): remove the profile function "
+               "installed by enable_shadow_stack()")},
+    {"shadow_stack",
+     (PyCFunction)faulthandler_shadow_stack, METH_NOARGS,
+     PyDoc_STR("shadow_stack()->list: (code, entry time) of the frames of "
+               "the current thread, most recent call first, or None")},
+    {"watch_slow_calls",
+     (PyCFunction)faulthandler_watch_slow_calls, METH_VARARGS|METH_KEYWORDS,
+     PyDoc_STR("watch_slow_calls(threshold, file=sys.stderr, filter=None, "
+               "interval=1.0): write the traceback of calls longer than "
+               "threshold seconds, at most one call per interval seconds")},
+    {"unwatch_slow_calls",
+     (PyCFunction)faulthandler_unwatch_slow_calls, METH_NOARGS,
+     PyDoc_STR("unwatch_slow_calls(): stop watching slow calls")},
+    {"enable_latency_histograms",
+     (PyCFunction)faulthandler_enable_latency_histograms, METH_NOARGS,
+     PyDoc_STR("enable_latency_histograms(): record the duration of calls "
+               "in a histogram per code object")},
+    {"disable_latency_histograms",
+     (PyCFunction)faulthandler_disable_latency_histograms, METH_NOARGS,
+     PyDoc_STR("disable_latency_histograms(): stop recording histograms "
+               "and clear them")},
+    {"latency_histograms",
+     (PyCFunction)faulthandler_latency_histograms,
+     METH_VARARGS|METH_KEYWORDS,
+     PyDoc_STR("latency_histograms(top=10, sort='total')->list: "
+               "(code, calls, total, p99) of the slowest functions")},
+    {"breadcrumb", faulthandler_breadcrumb_py, METH_VARARGS,
+     PyDoc_STR("breadcrumb(msg): record a message written after the traceback "
+               "on a fatal error or by dump_traceback_later()")},
+
     {"_read_null", faulthandler_read_null, METH_NOARGS,
      PyDoc_STR("_read_null(): read from NULL, raise "
                "a SIGSEGV or SIGBUS signal depending on the platform")},
@@ -1199,7 +2275,7 @@ PyInit_faulthandler(void)
 initfaulthandler(void)
 #endif
 {
-    PyObject *m, *version;
+    PyObject *m, *version, *capi;
 #ifdef HAVE_SIGALTSTACK
     int err;
 #endif
@@ -1264,6 +2340,12 @@ initfaulthandler(void)
         goto error;
     PyModule_AddObject(m, "__version__", version);
 
+    capi = PyCapsule_New((void *)faulthandler_breadcrumb,
+                         "faulthandler.breadcrumb_CAPI", NULL);
+    if (capi == NULL)
+        goto error;
+    PyModule_AddObject(m, "breadcrumb_CAPI", capi);
+
 #if PY_MAJOR_VERSION >= 3
     return m;
 #else
@@ -1310,6 +2392,8 @@ faulthandler_unload(void)
     }
 #endif
 
+    _Py_SamplerUnload();
+
     /* don't release file: faulthandler_unload_fatal_error()
        is called too late */
     fatal_error.file = NULL;
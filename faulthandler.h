@@ -0,0 +1,178 @@
+/*
+ * Private declarations shared by faulthandler.c, traceback.c, sampler.c,
+ * shadowstack.c, pprof.c, chrometrace.c and hotlines.c.
+ */
+
+#ifndef FAULTHANDLER_H
+#define FAULTHANDLER_H
+
+#include <frameobject.h>
+
+/* Flags of _Py_DumpTraceback() and _Py_DumpTracebackThreads() */
+
+/* Write the current and the handled exception of each thread */
+#define _Py_DUMP_EXCEPTIONS 0x01
+/* Write the code object and the bytecode instruction of each frame */
+#define _Py_DUMP_OPCODES 0x02
+/* Write the suspended generators and coroutines of each thread */
+#define _Py_DUMP_GENERATORS 0x04
+/* Write the suspended greenlets grouped by stack */
+#define _Py_DUMP_GREENLETS 0x08
+/* Write the threads of all interpreters, not only of the given interpreter */
+#define _Py_DUMP_ALL_INTERPRETERS 0x10
+/* Take a snapshot of the stacks before formatting them */
+#define _Py_DUMP_SNAPSHOT 0x20
+/* Write the local variables of each frame: the maximum length of string
+   values is stored in the bits above _Py_DUMP_LOCALS_SHIFT */
+#define _Py_DUMP_LOCALS_SHIFT 16
+#define _Py_DUMP_LOCALS_MAX 0x7fff
+#define _Py_DUMP_LOCALS(length) ((length) << _Py_DUMP_LOCALS_SHIFT)
+#define _Py_DUMP_LOCALS_LENGTH(flags) ((flags) >> _Py_DUMP_LOCALS_SHIFT)
+
+/* traceback.c */
+extern Py_ssize_t _Py_write_noraise(int fd, const char *buf, size_t count);
+extern void _Py_dump_decimal(int fd, unsigned long value);
+extern void _Py_dump_hexadecimal(int fd, unsigned long value, size_t bytes);
+extern void _Py_DumpCodeLocation(int fd, PyCodeObject *code, int lineno);
+extern void _Py_DumpCFunction(int fd, PyObject *func);
+extern int _Py_GetFrameLineNumber(PyFrameObject *frame);
+extern unsigned PY_LONG_LONG _Py_StackSignature(PyThreadState *tstate,
+                                                int with_lines);
+extern unsigned int _Py_CountFrames(PyFrameObject *frame, unsigned int depth);
+extern void _Py_DumpTraceback(int fd, PyThreadState *tstate, int flags);
+extern const char* _Py_DumpTracebackThreads(
+    int fd,
+    PyInterpreterState *interp,
+    PyThreadState *current_thread,
+    int flags);
+extern const char* _Py_TakeSnapshot(PyInterpreterState *interp,
+                                    PyThreadState *current_thread,
+                                    int all_threads);
+extern void _Py_DumpSnapshot(int fd, int all_threads, int flags);
+
+/* sampler.c */
+extern int _Py_SamplerStart(PyInterpreterState *interp,
+                            double interval, double duration,
+                            unsigned int trie_size, int wall, int perf);
+extern void _Py_SamplerStop(void);
+extern void _Py_SamplerUnload(void);
+extern void _Py_DumpSamples(int fd);
+
+/* Maximum number of frames stored per sample */
+#define _Py_SAMPLE_MAX_DEPTH 32
+
+typedef struct {
+    /* strong reference to a code object, or to a builtin function for a
+       C function (lineno is 0) */
+    PyObject *code;
+    int lineno;
+} _Py_SampleFrame;
+
+extern PyObject* _Py_SampleCodeKey(PyObject *code);
+
+/* State of a thread when it was sampled */
+#define _Py_SAMPLE_RUNNING 0    /* the thread used the CPU */
+#define _Py_SAMPLE_GIL 1        /* waiting for the GIL to run Python code */
+#define _Py_SAMPLE_SYSCALL 2    /* calling a builtin function */
+#define _Py_SAMPLE_NSTATE 3
+
+extern const char* _Py_SampleStateName(int state);
+
+/* Label of the samples of a thread, 0 means no label */
+extern int _Py_SetSampleLabel(PyThreadState *tstate, const char *name);
+extern int _Py_GetThreadLabel(PyThreadState *tstate);
+extern const char* _Py_SampleLabelName(int label);
+
+typedef int (*_Py_SampleVisitor) (const _Py_SampleFrame *frames, int nframe,
+                                  int state, int label, size_t count,
+                                  void *arg);
+
+extern int _Py_SamplerVisit(_Py_SampleVisitor visit, void *arg,
+                            PY_LONG_LONG *period,
+                            PY_LONG_LONG *oldest, PY_LONG_LONG *newest);
+extern int _Py_SamplerWall(void);
+
+typedef int (*_Py_SampleTimelineVisitor) (long thread_id,
+                                          PY_LONG_LONG timestamp,
+                                          int state, int label,
+                                          const _Py_SampleFrame *frames,
+                                          int nframe, void *arg);
+
+extern int _Py_SamplerTimeline(_Py_SampleTimelineVisitor visit, void *arg,
+                               PY_LONG_LONG *period);
+extern int _Py_SamplerTrieStats(size_t *nnode, size_t *capacity,
+                                size_t *overflow);
+extern int _Py_SamplerThreadStats(size_t *nthread, size_t *nuntracked,
+                                  size_t *untracked_samples);
+extern int _Py_SamplerAddScope(PyInterpreterState *interp, double *interval,
+                               long thread_id, _Py_SampleVisitor visit,
+                               void *arg);
+extern void _Py_SamplerRemoveScope(void *arg);
+extern int _Py_SamplerHasScopes(void);
+
+/* perf.c */
+#if defined(__linux__) && defined(WITH_THREAD)
+#  define HAVE_PERF_SAMPLER
+
+typedef void (*_Py_PerfVisitor) (long thread_id, PY_LONG_LONG timestamp,
+                                 int label, const _Py_SampleFrame *frames,
+                                 int nframe, int depth, void *arg);
+
+extern int _Py_PerfStart(PyInterpreterState *interp, PY_LONG_LONG interval);
+extern void _Py_PerfStop(void);
+extern void _Py_PerfAfterFork(void);
+extern void _Py_PerfSetManager(void);
+extern size_t _Py_PerfUpdate(PyInterpreterState *interp,
+                             _Py_PerfVisitor visit, void *arg);
+#endif
+
+/* pprof.c */
+extern PyObject* _Py_SamplesPprof(int compress);
+
+/* chrometrace.c */
+extern PyObject* _Py_SamplesChromeTrace(void);
+
+/* collapsed.c */
+extern PyObject* _Py_SamplesCollapsed(void);
+extern PyObject* _Py_MergeCollapsed(PyObject *filenames);
+extern PyObject* _Py_MergeMain(void);
+
+/* sampling.c */
+extern PyObject* _Py_SamplingNew(double interval, int all_threads);
+
+/* hotlines.c */
+extern PyObject* _Py_SamplesLines(const char *label);
+extern int _Py_DumpHotLines(int fd, int top, const char *label);
+
+/* shadowstack.c */
+
+/* Maximum number of frames stored in a shadow stack */
+#define _Py_SHADOW_STACK_SIZE 128
+
+typedef struct {
+    PyFrameObject *frame;
+    PyCodeObject *code;
+    /* time when the frame was entered in microseconds, see _Py_monotonic() */
+    PY_LONG_LONG timestamp;
+} _Py_ShadowEntry;
+
+extern int _Py_ShadowStackEnable(PyInterpreterState *interp);
+extern int _Py_ShadowStackDisable(void);
+extern unsigned int _Py_GetShadowStack(PyThreadState *tstate,
+                                       _Py_ShadowEntry **entries);
+extern PyObject* _Py_GetShadowCFunction(PyThreadState *tstate);
+extern PyObject* _Py_CFunctionName(PyObject *func);
+extern int _Py_WatchSlowCalls(PyInterpreterState *interp,
+                              PyObject *file, int fd,
+                              PY_LONG_LONG threshold, PY_LONG_LONG interval,
+                              PyObject *filter);
+extern int _Py_UnwatchSlowCalls(void);
+extern int _Py_HistogramsEnable(PyInterpreterState *interp);
+extern int _Py_HistogramsDisable(void);
+extern PyObject* _Py_GetHistograms(Py_ssize_t top, int by_p99);
+
+/* faulthandler.c */
+extern PY_LONG_LONG _Py_gettime(void);
+extern PY_LONG_LONG _Py_monotonic(void);
+
+#endif /* !FAULTHANDLER_H */
@@ -0,0 +1,384 @@
+/*
+ * Line-level hot spots: aggregate the samples of the sampler by (code object,
+ * line number).
+ *
+ * The self count of a line is the number of samples where it is the most
+ * recent frame, the inclusive count is the number of samples where it is in
+ * the stack. Builtin functions have no line: the self count of a sample in a
+ * builtin function goes to its caller. The samples can be filtered by label.
+ * The source code is only read by linecache when the report is written.
+ */
+
+#include "Python.h"
+#include "frameobject.h"
+#include "faulthandler.h"
+
+#if PY_MAJOR_VERSION >= 3
+#  define PYINT_FROMSSIZE_T PyLong_FromSsize_t
+#  define PYINT_ASSSIZE_T PyLong_AsSsize_t
+#else
+#  define PYINT_FROMSSIZE_T PyInt_FromSsize_t
+#  define PYINT_ASSSIZE_T PyInt_AsSsize_t
+#endif
+
+#define PUTS(fd, str) _Py_write_noraise(fd, str, (int)strlen(str))
+
+typedef struct {
+    PyCodeObject *code;   /* borrowed reference, kept alive by the ring */
+    int lineno;
+    size_t self;
+    size_t inclusive;
+} line_stat_t;
+
+typedef struct {
+    /* (code address, lineno) => index in stats */
+    PyObject *index;
+    line_stat_t *stats;
+    size_t nstat;
+    size_t alloc;
+    /* total number of samples */
+    size_t total;
+    /* only aggregate the samples with this label if it is not NULL */
+    const char *label;
+} line_stats_t;
+
+/* Get the statistics of a line, create them if needed. Return NULL on
+   error. */
+static line_stat_t*
+line_stats_get(line_stats_t *lines, PyCodeObject *code, int lineno)
+{
+    PyObject *code_key, *key, *index;
+    line_stat_t *stat;
+    size_t alloc;
+    int res;
+
+    code_key = _Py_SampleCodeKey((PyObject *)code);
+    if (code_key == NULL)
+        return NULL;
+    key = Py_BuildValue("(Ni)", code_key, lineno);
+    if (key == NULL)
+        return NULL;
+    index = PyDict_GetItem(lines->index, key);
+    if (index != NULL) {
+        Py_DECREF(key);
+        return &lines->stats[PYINT_ASSSIZE_T(index)];
+    }
+
+    if (lines->nstat == lines->alloc) {
+        alloc = lines->alloc * 2 + 64;
+        stat = PyMem_Realloc(lines->stats, alloc * sizeof(line_stat_t));
+        if (stat == NULL) {
+            Py_DECREF(key);
+            PyErr_NoMemory();
+            return NULL;
+        }
+        lines->stats = stat;
+        lines->alloc = alloc;
+    }
+
+    index = PYINT_FROMSSIZE_T(lines->nstat);
+    if (index == NULL) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    res = PyDict_SetItem(lines->index, key, index);
+    Py_DECREF(key);
+    Py_DECREF(index);
+    if (res < 0)
+        return NULL;
+
+    stat = &lines->stats[lines->nstat];
+    lines->nstat++;
+    stat->code = code;
+    stat->lineno = lineno;
+    stat->self = 0;
+    stat->inclusive = 0;
+    return stat;
+}
+
+/* Visitor of _Py_SamplerVisit() */
+static int
+line_stats_visit(const _Py_SampleFrame *frames, int nframe, int state,
+                 int label, size_t count, void *arg)
+{
+    line_stats_t *lines = arg;
+    line_stat_t *stat;
+    PyCodeObject *code;
+    const char *name;
+    int i, j, leaf;
+
+    if (lines->label != NULL) {
+        name = _Py_SampleLabelName(label);
+        if (name == NULL || strcmp(name, lines->label) != 0)
+            return 0;
+    }
+
+    leaf = 1;
+    for (i=0; i < nframe; i++) {
+        if (!PyCode_Check(frames[i].code))
+            continue;
+        code = (PyCodeObject *)frames[i].code;
+
+        /* count a line once per sample in recursive calls */
+        for (j=0; j < i; j++) {
+            if (frames[j].code == frames[i].code
+                && frames[j].lineno == frames[i].lineno)
+                break;
+        }
+        if (j < i)
+            continue;
+
+        stat = line_stats_get(lines, code, frames[i].lineno);
+        if (stat == NULL)
+            return -1;
+        if (leaf)
+            stat->self += count;
+        leaf = 0;
+        stat->inclusive += count;
+    }
+    lines->total += count;
+    return 0;
+}
+
+/* Aggregate the samples of the sampler by line, only the samples with the
+   label 'label' if it is not NULL. Return 0 on success, 1 if the sampler is
+   not running, raise an exception and return -1 on error. */
+static int
+line_stats_collect(line_stats_t *lines, const char *label)
+{
+    PY_LONG_LONG period, oldest, newest;
+
+    memset(lines, 0, sizeof(*lines));
+    lines->label = label;
+    lines->index = PyDict_New();
+    if (lines->index == NULL)
+        return -1;
+    return _Py_SamplerVisit(line_stats_visit, lines,
+                            &period, &oldest, &newest);
+}
+
+static void
+line_stats_clear(line_stats_t *lines)
+{
+    Py_CLEAR(lines->index);
+    PyMem_Free(lines->stats);
+    lines->stats = NULL;
+}
+
+/* Sort by self count, inclusive count and then line number */
+static int
+line_stat_cmp_self(const void *a, const void *b)
+{
+    const line_stat_t *sa = a, *sb = b;
+    if (sa->self != sb->self)
+        return (sa->self < sb->self) ? 1 : -1;
+    if (sa->inclusive != sb->inclusive)
+        return (sa->inclusive < sb->inclusive) ? 1 : -1;
+    return sa->lineno - sb->lineno;
+}
+
+/* Sort by code object and then line number */
+static int
+line_stat_cmp_code(const void *a, const void *b)
+{
+    const line_stat_t *sa = a, *sb = b;
+    if (sa->code != sb->code)
+        return ((Py_uintptr_t)sa->code < (Py_uintptr_t)sb->code) ? -1 : 1;
+    return sa->lineno - sb->lineno;
+}
+
+/* Get the lines of the samples of the sampler: list of (code, lineno, self,
+   inclusive) tuples, most self samples first. Only count the samples with the
+   label 'label' if it is not NULL. Return None if the sampler is not
+   running.
+
+   Must be called with the GIL held. Raise an exception and return NULL on
+   error. */
+PyObject*
+_Py_SamplesLines(const char *label)
+{
+    line_stats_t lines;
+    line_stat_t *stat;
+    PyObject *list, *item;
+    size_t i;
+    int res;
+
+    res = line_stats_collect(&lines, label);
+    if (res != 0) {
+        line_stats_clear(&lines);
+        if (res < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    if (lines.nstat != 0)
+        qsort(lines.stats, lines.nstat, sizeof(line_stat_t),
+              line_stat_cmp_self);
+
+    list = PyList_New(lines.nstat);
+    if (list == NULL)
+        goto error;
+    for (i=0; i < lines.nstat; i++) {
+        stat = &lines.stats[i];
+        item = Py_BuildValue("(Oinn)", (PyObject *)stat->code, stat->lineno,
+                             (Py_ssize_t)stat->self,
+                             (Py_ssize_t)stat->inclusive);
+        if (item == NULL) {
+            Py_DECREF(list);
+            goto error;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    line_stats_clear(&lines);
+    return list;
+
+error:
+    line_stats_clear(&lines);
+    return NULL;
+}
+
+/* Write a percentage with one digit after the dot, right aligned on 6
+   characters: " 12.5%" */
+static void
+dump_percent(int fd, size_t count, size_t total)
+{
+    char buffer[16];
+    size_t tenths;
+
+    tenths = (total != 0) ? (count * 1000 + total / 2) / total : 0;
+    PyOS_snprintf(buffer, sizeof(buffer), "%3u.%u%%",
+                  (unsigned int)(tenths / 10), (unsigned int)(tenths % 10));
+    PUTS(fd, buffer);
+}
+
+/* Write a line of the source code, read by linecache */
+static int
+dump_source_line(int fd, PyObject *linecache, PyCodeObject *code, int lineno)
+{
+    PyObject *line, *bytes;
+    Py_ssize_t size;
+    char *text;
+
+    line = PyObject_CallMethod(linecache, "getline", "Oi",
+                               code->co_filename, lineno);
+    if (line == NULL)
+        return -1;
+    if (PyUnicode_Check(line)) {
+        bytes = PyUnicode_AsEncodedString(line, "utf-8", "backslashreplace");
+        Py_DECREF(line);
+        if (bytes == NULL)
+            return -1;
+    }
+    else
+        bytes = line;
+
+    text = PyBytes_AS_STRING(bytes);
+    size = PyBytes_GET_SIZE(bytes);
+    while (size > 0 && (text[size - 1] == '\n' || text[size - 1] == '\r'))
+        size--;
+    _Py_write_noraise(fd, text, (int)size);
+    Py_DECREF(bytes);
+    return 0;
+}
+
+/* Write the lines of the samples of the sampler into fd: the source code of
+   the 'top' functions with the most self samples, annotated with the self
+   and inclusive percentages of each sampled line. Only count the samples with
+   the label 'label' if it is not NULL. Do nothing if the sampler is not
+   running.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+int
+_Py_DumpHotLines(int fd, int top, const char *label)
+{
+    line_stats_t lines;
+    line_stat_t *stat;
+    PyObject *linecache;
+    size_t *func_self;
+    size_t i, j, end, best;
+    int res, nfunc;
+    char buffer[32];
+
+    res = line_stats_collect(&lines, label);
+    if (res != 0) {
+        line_stats_clear(&lines);
+        return (res < 0) ? -1 : 0;
+    }
+
+    linecache = PyImport_ImportModule("linecache");
+    func_self = PyMem_Malloc((lines.nstat + 1) * sizeof(size_t));
+    if (linecache == NULL || func_self == NULL) {
+        if (func_self == NULL && linecache != NULL)
+            PyErr_NoMemory();
+        Py_XDECREF(linecache);
+        PyMem_Free(func_self);
+        line_stats_clear(&lines);
+        return -1;
+    }
+
+    /* group the lines of each function, func_self[i] is the number of self
+       samples of the function if i is its first line, 0 otherwise */
+    if (lines.nstat != 0)
+        qsort(lines.stats, lines.nstat, sizeof(line_stat_t),
+              line_stat_cmp_code);
+    for (i=0; i < lines.nstat; i = end) {
+        func_self[i] = 0;
+        for (end=i; end < lines.nstat; end++) {
+            if (lines.stats[end].code != lines.stats[i].code)
+                break;
+            func_self[i] += lines.stats[end].self;
+            if (end != i)
+                func_self[end] = 0;
+        }
+    }
+
+    PUTS(fd, "Hot lines: ");
+    _Py_dump_decimal(fd, (unsigned long)lines.total);
+    PUTS(fd, " samples");
+    if (label != NULL) {
+        PUTS(fd, " with the label ");
+        PUTS(fd, label);
+    }
+    PUTS(fd, " (most self samples first):\n");
+
+    res = 0;
+    for (nfunc=0; nfunc < top; nfunc++) {
+        best = lines.nstat;
+        for (i=0; i < lines.nstat; i++) {
+            if (func_self[i] != 0
+                && (best == lines.nstat || func_self[i] > func_self[best]))
+                best = i;
+        }
+        if (best == lines.nstat)
+            break;
+        func_self[best] = 0;
+
+        stat = &lines.stats[best];
+        PUTS(fd, "\n");
+        _Py_DumpCodeLocation(fd, stat->code, stat->code->co_firstlineno);
+        PUTS(fd, "    self  total   line\n");
+        for (j=best; j < lines.nstat && lines.stats[j].code == stat->code; j++) {
+            PUTS(fd, "  ");
+            dump_percent(fd, lines.stats[j].self, lines.total);
+            PUTS(fd, " ");
+            dump_percent(fd, lines.stats[j].inclusive, lines.total);
+            PyOS_snprintf(buffer, sizeof(buffer), " %6i  ",
+                          lines.stats[j].lineno);
+            PUTS(fd, buffer);
+            if (dump_source_line(fd, linecache, lines.stats[j].code,
+                                 lines.stats[j].lineno) < 0) {
+                res = -1;
+                break;
+            }
+            PUTS(fd, "\n");
+        }
+        if (res < 0)
+            break;
+    }
+
+    Py_DECREF(linecache);
+    PyMem_Free(func_self);
+    line_stats_clear(&lines);
+    return res;
+}
@@ -0,0 +1,521 @@
+/*
+ * perf backend of the sampler (Linux): per-thread sampling on the CPU time.
+ *
+ * A perf_event_open() software event PERF_COUNT_SW_TASK_CLOCK is opened for
+ * each thread of the process. When a thread used 'interval' of CPU time, the
+ * kernel sends a signal to this thread (F_SETOWN_EX) and the signal handler
+ * records its Python stack into a preallocated buffer. The signal is a
+ * realtime signal without handler (F_SETSIG), SIGPROF if there is none; other
+ * signals received by the handler are passed to the previous handler.
+ *
+ * The signal handler cannot modify reference counts: it only records code
+ * objects of a registry which keeps a strong reference to them. The stack is
+ * truncated at the first frame of another code object, as if it was deeper
+ * than _Py_SAMPLE_MAX_DEPTH: omitting the frame would create a call between
+ * its caller and its callee. The sampler thread (the manager) holds the
+ * GIL to register the code objects of the stacks of all threads, to open
+ * events for new threads and to copy the recorded samples into the ring of
+ * the sampler.
+ */
+
+#include "Python.h"
+#include "frameobject.h"
+#include "faulthandler.h"
+
+#ifdef HAVE_PERF_SAMPLER
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* Maximum number of threads sampled */
+#define PERF_MAX_THREADS 256
+
+/* Number of samples recorded by the signal handler and not copied yet */
+#define PERF_BUFFER_SIZE 512
+
+/* Size of the registry of code objects: at most 3/4 are used */
+#define PERF_CODE_TABLE_SIZE 8192
+#define PERF_MAX_CODES (PERF_CODE_TABLE_SIZE / 4 * 3)
+
+#define MEMORY_BARRIER() __sync_synchronize()
+
+typedef struct {
+    /* non-zero when the sample is written */
+    volatile int ready;
+    long thread_id;
+    PY_LONG_LONG timestamp;
+    int label;
+    int depth;
+    int nframe;
+    _Py_SampleFrame frames[_Py_SAMPLE_MAX_DEPTH];
+} perf_sample_t;
+
+static struct {
+    volatile int running;
+    /* number of signal handlers being executed */
+    volatile int busy;
+    int handler_installed;
+    /* signal sent by the events, and its previous action */
+    int signum;
+    struct sigaction previous;
+    PY_LONG_LONG interval;
+    /* thread identifier (TID) of the manager, not sampled */
+    pid_t manager;
+
+    /* events of the threads, sorted by TID */
+    struct {
+        pid_t tid;
+        int fd;
+    } events[PERF_MAX_THREADS];
+    int nevent;
+
+    /* registry of code objects: open-addressed hash table of strong
+       references, NULL means empty. Only modified with the GIL held. */
+    PyCodeObject **codes;
+    size_t ncode;
+
+    /* samples written by the signal handlers: buffer[write % size] is the
+       next sample to write, buffer[read % size] the next sample to copy */
+    perf_sample_t *buffer;
+    volatile size_t write;
+    volatile size_t read;
+    /* number of samples dropped because the buffer was full or because the
+       code object of the current frame was not registered */
+    volatile size_t dropped;
+} perf;
+
+static size_t
+perf_code_hash(PyCodeObject *code)
+{
+    return (((size_t)code >> 4) * 2654435761u) & (PERF_CODE_TABLE_SIZE - 1);
+}
+
+/* Check if a code object is registered.
+
+   This function is signal safe. */
+static int
+perf_code_registered(PyCodeObject *code)
+{
+    size_t index;
+    PyCodeObject *entry;
+
+    index = perf_code_hash(code);
+    while (1) {
+        entry = perf.codes[index];
+        if (entry == code)
+            return 1;
+        if (entry == NULL)
+            return 0;
+        index = (index + 1) & (PERF_CODE_TABLE_SIZE - 1);
+    }
+}
+
+/* Register a code object: keep a strong reference to it until the sampler
+   is stopped. Must be called with the GIL held. */
+static void
+perf_code_register(PyCodeObject *code)
+{
+    size_t index;
+
+    index = perf_code_hash(code);
+    while (perf.codes[index] != NULL) {
+        if (perf.codes[index] == code)
+            return;
+        index = (index + 1) & (PERF_CODE_TABLE_SIZE - 1);
+    }
+    if (perf.ncode >= PERF_MAX_CODES)
+        return;
+    Py_INCREF(code);
+    perf.codes[index] = code;
+    perf.ncode++;
+}
+
+/* Record the Python stack of the current thread into the buffer.
+
+   This function is signal safe. */
+static void
+perf_record(void)
+{
+    PyThreadState *tstate;
+    PyFrameObject *frame;
+    perf_sample_t *sample;
+    size_t index;
+    int depth, nframe;
+
+    /* read the thread local storage: the thread may not hold the GIL */
+    tstate = PyGILState_GetThisThreadState();
+    if (tstate == NULL || tstate->frame == NULL)
+        return;
+
+    do {
+        index = perf.write;
+        if (index - perf.read >= PERF_BUFFER_SIZE) {
+            __sync_fetch_and_add(&perf.dropped, 1);
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&perf.write, index, index + 1));
+
+    sample = &perf.buffer[index % PERF_BUFFER_SIZE];
+    sample->thread_id = tstate->thread_id;
+    sample->timestamp = _Py_gettime();
+    sample->label = _Py_GetThreadLabel(tstate);
+    nframe = depth = 0;
+    /* the thread is interrupted: its frames cannot change. Stop recording
+       frames at the first frame of a code object which is not registered,
+       but count the depth of the whole stack. */
+    for (frame = tstate->frame; frame != NULL; frame = frame->f_back) {
+        if (nframe == depth && nframe < _Py_SAMPLE_MAX_DEPTH
+            && perf_code_registered(frame->f_code)) {
+            sample->frames[nframe].code = (PyObject *)frame->f_code;
+            sample->frames[nframe].lineno = _Py_GetFrameLineNumber(frame);
+            nframe++;
+        }
+        depth++;
+    }
+    sample->nframe = nframe;
+    sample->depth = depth;
+
+    MEMORY_BARRIER();
+    sample->ready = 1;
+}
+
+/* Pass a signal which was not sent by an event to the previous handler. The
+   default action is applied by restoring the previous action and raising
+   the signal again: it is delivered when the handler returns.
+
+   This function is signal safe. */
+static void
+perf_chain(int signum, siginfo_t *info, void *context)
+{
+    if (perf.previous.sa_flags & SA_SIGINFO) {
+        perf.previous.sa_sigaction(signum, info, context);
+    }
+    else if (perf.previous.sa_handler == SIG_DFL) {
+        (void)sigaction(signum, &perf.previous, NULL);
+        perf.handler_installed = 0;
+        (void)raise(signum);
+    }
+    else if (perf.previous.sa_handler != SIG_IGN) {
+        perf.previous.sa_handler(signum);
+    }
+}
+
+static void
+perf_handler(int signum, siginfo_t *info, void *context)
+{
+    int save_errno = errno;
+
+    if (info->si_code != POLL_IN && info->si_code != POLL_HUP) {
+        /* not sent by an event: kill(), timer, etc. */
+        perf_chain(signum, info, context);
+        errno = save_errno;
+        return;
+    }
+
+    /* signal the handler is being executed before checking if the sampler
+       is running: _Py_PerfStop() waits until busy is zero */
+    __sync_fetch_and_add(&perf.busy, 1);
+    if (perf.running) {
+        perf_record();
+        /* enable the event for the next overflow */
+        (void)ioctl(info->si_fd, PERF_EVENT_IOC_REFRESH, 1);
+    }
+    __sync_fetch_and_sub(&perf.busy, 1);
+
+    errno = save_errno;
+}
+
+/* Choose the signal of the events: the first realtime signal without
+   handler, or SIGPROF if all realtime signals are used */
+static int
+perf_choose_signal(void)
+{
+#ifdef SIGRTMIN
+    struct sigaction action;
+    int signum;
+
+    for (signum = SIGRTMIN; signum <= SIGRTMAX; signum++) {
+        if (sigaction(signum, NULL, &action) == 0
+            && !(action.sa_flags & SA_SIGINFO)
+            && action.sa_handler == SIG_DFL)
+            return signum;
+    }
+#endif
+    return SIGPROF;
+}
+
+/* Open the event of a thread. Return the file descriptor, or -1 on error
+   (errno is set). */
+static int
+perf_open(pid_t tid)
+{
+    struct perf_event_attr attr;
+    struct f_owner_ex owner;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    /* nanoseconds */
+    attr.sample_period = (unsigned PY_LONG_LONG)perf.interval * 1000;
+    attr.disabled = 1;
+    /* allowed by perf_event_paranoid=2 */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = (int)syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
+    if (fd < 0)
+        return -1;
+
+    owner.type = F_OWNER_TID;
+    owner.pid = tid;
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0
+        || fcntl(fd, F_SETFL, O_ASYNC) < 0
+        || fcntl(fd, F_SETSIG, perf.signum) < 0
+        || fcntl(fd, F_SETOWN_EX, &owner) < 0
+        || ioctl(fd, PERF_EVENT_IOC_REFRESH, 1) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static int
+perf_tid_cmp(const void *a, const void *b)
+{
+    pid_t ta = *(const pid_t *)a, tb = *(const pid_t *)b;
+    return (ta > tb) - (ta < tb);
+}
+
+/* Open the events of new threads and close the events of exited threads.
+   Return 0 on success, -1 on error (errno is set). */
+static int
+perf_update_events(void)
+{
+    pid_t tids[PERF_MAX_THREADS];
+    int ntid, i, j, nevent, fd;
+    DIR *dir;
+    struct dirent *entry;
+    pid_t tid;
+
+    dir = opendir("/proc/self/task");
+    if (dir == NULL)
+        return -1;
+    ntid = 0;
+    while (ntid < PERF_MAX_THREADS && (entry = readdir(dir)) != NULL) {
+        tid = (pid_t)atoi(entry->d_name);
+        if (tid > 0 && tid != perf.manager)
+            tids[ntid++] = tid;
+    }
+    closedir(dir);
+    qsort(tids, ntid, sizeof(pid_t), perf_tid_cmp);
+
+    /* merge the sorted lists of events and threads */
+    nevent = 0;
+    i = j = 0;
+    while (i < perf.nevent || j < ntid) {
+        if (j == ntid
+            || (i < perf.nevent && perf.events[i].tid < tids[j])) {
+            /* the thread exited */
+            close(perf.events[i].fd);
+            i++;
+        }
+        else if (i == perf.nevent || tids[j] < perf.events[i].tid) {
+            /* new thread */
+            fd = perf_open(tids[j]);
+            if (fd < 0) {
+                /* the thread may have exited in the meanwhile */
+                if (errno != ESRCH) {
+                    int err = errno;
+                    for (; i < perf.nevent; i++)
+                        close(perf.events[i].fd);
+                    perf.nevent = nevent;
+                    errno = err;
+                    return -1;
+                }
+            }
+            else {
+                perf.events[nevent].tid = tids[j];
+                perf.events[nevent].fd = fd;
+                nevent++;
+            }
+            j++;
+        }
+        else {
+            perf.events[nevent] = perf.events[i];
+            nevent++;
+            i++;
+            j++;
+        }
+    }
+    perf.nevent = nevent;
+    return 0;
+}
+
+/* Register the code objects of the stacks of all threads of interp. */
+static void
+perf_register_stacks(PyInterpreterState *interp)
+{
+    PyThreadState *tstate;
+    PyFrameObject *frame;
+
+    tstate = PyInterpreterState_ThreadHead(interp);
+    for (; tstate != NULL; tstate = PyThreadState_Next(tstate)) {
+        for (frame = tstate->frame; frame != NULL; frame = frame->f_back)
+            perf_code_register(frame->f_code);
+    }
+}
+
+static void
+perf_close_events(void)
+{
+    int i;
+
+    for (i=0; i < perf.nevent; i++)
+        close(perf.events[i].fd);
+    perf.nevent = 0;
+}
+
+/* Stop sampling: close the events and release the registry. The signal
+   handler is left installed and ignores the signals of the events once the
+   sampler is stopped, since a signal may still be pending in a thread.
+
+   Must be called with the GIL held. */
+void
+_Py_PerfStop(void)
+{
+    size_t index;
+
+    if (perf.codes == NULL)
+        return;
+    perf.running = 0;
+    MEMORY_BARRIER();
+    perf_close_events();
+    /* wait until signal handlers don't read the registry anymore */
+    while (perf.busy != 0)
+        sched_yield();
+
+    for (index=0; index < PERF_CODE_TABLE_SIZE; index++)
+        Py_CLEAR(perf.codes[index]);
+    PyMem_Free(perf.codes);
+    perf.codes = NULL;
+    perf.ncode = 0;
+    PyMem_Free(perf.buffer);
+    perf.buffer = NULL;
+}
+
+/* Called in a forked child process before _Py_PerfStop(): the threads which
+   were running the signal handler don't exist in the child process */
+void
+_Py_PerfAfterFork(void)
+{
+    perf.busy = 0;
+}
+
+/* Start sampling all threads every 'interval' microseconds of CPU time.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+int
+_Py_PerfStart(PyInterpreterState *interp, PY_LONG_LONG interval)
+{
+    struct sigaction action;
+
+    _Py_PerfStop();
+
+    perf.codes = PyMem_Malloc(PERF_CODE_TABLE_SIZE * sizeof(PyCodeObject *));
+    perf.buffer = PyMem_Malloc(PERF_BUFFER_SIZE * sizeof(perf_sample_t));
+    if (perf.codes == NULL || perf.buffer == NULL) {
+        PyMem_Free(perf.codes);
+        perf.codes = NULL;
+        PyMem_Free(perf.buffer);
+        perf.buffer = NULL;
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(perf.codes, 0, PERF_CODE_TABLE_SIZE * sizeof(PyCodeObject *));
+    memset(perf.buffer, 0, PERF_BUFFER_SIZE * sizeof(perf_sample_t));
+    perf.ncode = 0;
+    perf.write = perf.read = 0;
+    perf.dropped = 0;
+    perf.interval = interval;
+    perf.manager = 0;
+    perf_register_stacks(interp);
+
+    if (!perf.handler_installed) {
+        perf.signum = perf_choose_signal();
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = perf_handler;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        if (sigaction(perf.signum, &action, &perf.previous) < 0)
+            goto error;
+        perf.handler_installed = 1;
+    }
+
+    perf.running = 1;
+    if (perf_update_events() < 0)
+        goto error;
+    return 0;
+
+error:
+    PyErr_SetFromErrno(PyExc_OSError);
+    _Py_PerfStop();
+    return -1;
+}
+
+/* Set the thread identifier of the manager: the calling thread is not
+   sampled. */
+void
+_Py_PerfSetManager(void)
+{
+    perf.manager = (pid_t)syscall(SYS_gettid);
+}
+
+/* Update the events and the registry, and call visit(thread_id, timestamp,
+   label, frames, nframe, depth, arg) on each sample recorded by the signal handler
+   since the previous call. Return the number of dropped samples since the
+   start.
+
+   Must be called with the GIL held by the manager. */
+size_t
+_Py_PerfUpdate(PyInterpreterState *interp, _Py_PerfVisitor visit, void *arg)
+{
+    perf_sample_t *sample;
+
+    if (!perf.running)
+        return 0;
+    /* errors are ignored: threads which cannot be sampled are skipped */
+    (void)perf_update_events();
+
+    while (perf.read != perf.write) {
+        sample = &perf.buffer[perf.read % PERF_BUFFER_SIZE];
+        if (!sample->ready)
+            break;
+        if (sample->nframe != 0)
+            visit(sample->thread_id, sample->timestamp, sample->label,
+                  sample->frames, sample->nframe, sample->depth, arg);
+        else
+            __sync_fetch_and_add(&perf.dropped, 1);
+        sample->ready = 0;
+        MEMORY_BARRIER();
+        perf.read++;
+    }
+
+    /* register code objects after reading the buffer: the next samples of
+       these stacks are kept */
+    perf_register_stacks(interp);
+    return perf.dropped;
+}
+
+#endif   /* HAVE_PERF_SAMPLER */
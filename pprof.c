@@ -0,0 +1,597 @@
+/*
+ * Export the samples of the sampler in the pprof format: profile.proto
+ * message of https://github.com/google/pprof/blob/master/proto/profile.proto
+ *
+ * The protocol buffer encoder only implements what is needed by the Profile
+ * message: varints and length-delimited fields. Nested messages are encoded
+ * in a temporary buffer and then copied into their parent.
+ */
+
+#include "Python.h"
+#include "frameobject.h"
+#include "faulthandler.h"
+
+#if PY_MAJOR_VERSION >= 3
+#  define PYINT_FROMSSIZE_T PyLong_FromSsize_t
+#  define PYINT_ASSSIZE_T PyLong_AsSsize_t
+#  define PYINT_ASLONG PyLong_AsLong
+#else
+#  define PYINT_FROMSSIZE_T PyInt_FromSsize_t
+#  define PYINT_ASSSIZE_T PyInt_AsSsize_t
+#  define PYINT_ASLONG PyInt_AsLong
+#endif
+
+/* Wire types */
+#define WIRE_VARINT 0
+#define WIRE_BYTES 2
+
+/* Fields of the Profile message */
+#define PROFILE_SAMPLE_TYPE 1
+#define PROFILE_SAMPLE 2
+#define PROFILE_LOCATION 4
+#define PROFILE_FUNCTION 5
+#define PROFILE_STRING_TABLE 6
+#define PROFILE_TIME_NANOS 9
+#define PROFILE_DURATION_NANOS 10
+#define PROFILE_PERIOD_TYPE 11
+#define PROFILE_PERIOD 12
+
+/* Fields of the ValueType message */
+#define VALUE_TYPE_TYPE 1
+#define VALUE_TYPE_UNIT 2
+
+/* Fields of the Sample message */
+#define SAMPLE_LOCATION_ID 1
+#define SAMPLE_VALUE 2
+#define SAMPLE_LABEL 3
+
+/* Fields of the Label message */
+#define LABEL_KEY 1
+#define LABEL_STR 2
+
+/* Fields of the Location message */
+#define LOCATION_ID 1
+#define LOCATION_LINE 4
+
+/* Fields of the Line message */
+#define LINE_FUNCTION_ID 1
+#define LINE_LINE 2
+
+/* Fields of the Function message */
+#define FUNCTION_ID 1
+#define FUNCTION_NAME 2
+#define FUNCTION_SYSTEM_NAME 3
+#define FUNCTION_FILENAME 4
+#define FUNCTION_START_LINE 5
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t alloc;
+} pbuf_t;
+
+typedef struct {
+    /* encoded Profile message */
+    pbuf_t out;
+    /* temporary buffers of nested messages */
+    pbuf_t msg;
+    pbuf_t sub;
+    /* string => index in the string table */
+    PyObject *strings;
+    PyObject *string_list;
+    /* key of the code object => function identifier; the list contains
+       the code objects */
+    PyObject *functions;
+    PyObject *function_list;
+    /* (key of the code object, line number) => location identifier; the
+       list contains (code object, line number) tuples */
+    PyObject *locations;
+    PyObject *location_list;
+    /* sampling interval in microseconds */
+    PY_LONG_LONG period;
+} pprof_t;
+
+static int
+pbuf_write(pbuf_t *buf, const void *data, size_t size)
+{
+    size_t alloc;
+    char *ptr;
+
+    if (size > buf->alloc - buf->len) {
+        alloc = buf->alloc * 2;
+        if (alloc < buf->len + size)
+            alloc = buf->len + size;
+        if (alloc < 256)
+            alloc = 256;
+        ptr = PyMem_Realloc(buf->data, alloc);
+        if (ptr == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        buf->data = ptr;
+        buf->alloc = alloc;
+    }
+    memcpy(buf->data + buf->len, data, size);
+    buf->len += size;
+    return 0;
+}
+
+static int
+pbuf_varint(pbuf_t *buf, unsigned PY_LONG_LONG value)
+{
+    unsigned char data[10];
+    size_t size;
+
+    size = 0;
+    do {
+        data[size] = (unsigned char)(value & 0x7f);
+        value >>= 7;
+        if (value != 0)
+            data[size] |= 0x80;
+        size++;
+    } while (value != 0);
+    return pbuf_write(buf, data, size);
+}
+
+/* Write a varint field. Zero is the default value and is not written. */
+static int
+pbuf_uint(pbuf_t *buf, int field, unsigned PY_LONG_LONG value)
+{
+    if (value == 0)
+        return 0;
+    if (pbuf_varint(buf, (field << 3) | WIRE_VARINT) < 0)
+        return -1;
+    return pbuf_varint(buf, value);
+}
+
+/* Write a length-delimited field */
+static int
+pbuf_bytes(pbuf_t *buf, int field, const void *data, size_t size)
+{
+    if (pbuf_varint(buf, (field << 3) | WIRE_BYTES) < 0)
+        return -1;
+    if (pbuf_varint(buf, size) < 0)
+        return -1;
+    return pbuf_write(buf, data, size);
+}
+
+/* Write the nested message msg as a field of buf and clear msg */
+static int
+pbuf_message(pbuf_t *buf, int field, pbuf_t *msg)
+{
+    int res;
+
+    res = pbuf_bytes(buf, field, msg->data, msg->len);
+    msg->len = 0;
+    return res;
+}
+
+/* Get the index of a string in the string table, add it if needed.
+   Return -1 on error. */
+static Py_ssize_t
+pprof_string(pprof_t *pprof, PyObject *str)
+{
+    PyObject *index;
+    Py_ssize_t len;
+
+    index = PyDict_GetItem(pprof->strings, str);
+    if (index != NULL)
+        return PYINT_ASSSIZE_T(index);
+
+    len = PyList_GET_SIZE(pprof->string_list);
+    index = PYINT_FROMSSIZE_T(len);
+    if (index == NULL)
+        return -1;
+    if (PyDict_SetItem(pprof->strings, str, index) < 0) {
+        Py_DECREF(index);
+        return -1;
+    }
+    Py_DECREF(index);
+    if (PyList_Append(pprof->string_list, str) < 0)
+        return -1;
+    return len;
+}
+
+static Py_ssize_t
+pprof_cstring(pprof_t *pprof, const char *str)
+{
+    PyObject *obj;
+    Py_ssize_t index;
+
+#if PY_MAJOR_VERSION >= 3
+    obj = PyUnicode_FromString(str);
+#else
+    obj = PyString_FromString(str);
+#endif
+    if (obj == NULL)
+        return -1;
+    index = pprof_string(pprof, obj);
+    Py_DECREF(obj);
+    return index;
+}
+
+/* Get the identifier of a key of a table (identifiers start at 1), add the
+   key to the table and item to the list if needed. Return 0 on error. */
+static Py_ssize_t
+pprof_id(PyObject *dict, PyObject *list, PyObject *key, PyObject *item)
+{
+    PyObject *id;
+    Py_ssize_t len;
+
+    id = PyDict_GetItem(dict, key);
+    if (id != NULL)
+        return PYINT_ASSSIZE_T(id);
+
+    len = PyList_GET_SIZE(list) + 1;
+    id = PYINT_FROMSSIZE_T(len);
+    if (id == NULL)
+        return 0;
+    if (PyDict_SetItem(dict, key, id) < 0) {
+        Py_DECREF(id);
+        return 0;
+    }
+    Py_DECREF(id);
+    if (PyList_Append(list, item) < 0)
+        return 0;
+    return len;
+}
+
+/* Write a ValueType message into buf */
+static int
+pprof_value_type(pprof_t *pprof, pbuf_t *buf, int field,
+                 const char *type, const char *unit)
+{
+    Py_ssize_t type_index, unit_index;
+
+    type_index = pprof_cstring(pprof, type);
+    if (type_index < 0)
+        return -1;
+    unit_index = pprof_cstring(pprof, unit);
+    if (unit_index < 0)
+        return -1;
+    if (pbuf_uint(&pprof->msg, VALUE_TYPE_TYPE, type_index) < 0)
+        return -1;
+    if (pbuf_uint(&pprof->msg, VALUE_TYPE_UNIT, unit_index) < 0)
+        return -1;
+    return pbuf_message(buf, field, &pprof->msg);
+}
+
+/* Write a Label message of the Sample message: key=str */
+static int
+pprof_label(pprof_t *pprof, const char *key, const char *str)
+{
+    Py_ssize_t label_key, label_str;
+
+    label_key = pprof_cstring(pprof, key);
+    if (label_key < 0)
+        return -1;
+    label_str = pprof_cstring(pprof, str);
+    if (label_str < 0)
+        return -1;
+    if (pbuf_uint(&pprof->sub, LABEL_KEY, label_key) < 0)
+        return -1;
+    if (pbuf_uint(&pprof->sub, LABEL_STR, label_str) < 0)
+        return -1;
+    return pbuf_message(&pprof->msg, SAMPLE_LABEL, &pprof->sub);
+}
+
+/* Write a Sample message: visitor of _Py_SamplerVisit() */
+static int
+pprof_sample(const _Py_SampleFrame *frames, int nframe, int state, int label,
+             size_t count, void *arg)
+{
+    pprof_t *pprof = arg;
+    PyObject *code_key, *key, *item;
+    Py_ssize_t id;
+    int i;
+
+    /* packed location identifiers, most recent call first */
+    for (i=0; i < nframe; i++) {
+        code_key = _Py_SampleCodeKey(frames[i].code);
+        if (code_key == NULL)
+            return -1;
+        key = Py_BuildValue("(Ni)", code_key, frames[i].lineno);
+        if (key == NULL)
+            return -1;
+        item = Py_BuildValue("(Oi)", frames[i].code, frames[i].lineno);
+        if (item == NULL) {
+            Py_DECREF(key);
+            return -1;
+        }
+        id = pprof_id(pprof->locations, pprof->location_list, key, item);
+        Py_DECREF(key);
+        Py_DECREF(item);
+        if (id == 0)
+            return -1;
+        if (pbuf_varint(&pprof->sub, id) < 0)
+            return -1;
+    }
+    if (pbuf_message(&pprof->msg, SAMPLE_LOCATION_ID, &pprof->sub) < 0)
+        return -1;
+
+    /* packed values: number of samples and wall time */
+    if (pbuf_varint(&pprof->sub, count) < 0)
+        return -1;
+    if (pbuf_varint(&pprof->sub, count * pprof->period * 1000) < 0)
+        return -1;
+    if (pbuf_message(&pprof->msg, SAMPLE_VALUE, &pprof->sub) < 0)
+        return -1;
+
+    /* labels: thread_state=running, gil or syscall, and label=name if the
+       thread has a label */
+    if (pprof_label(pprof, "thread_state", _Py_SampleStateName(state)) < 0)
+        return -1;
+    if (label != 0
+        && pprof_label(pprof, "label", _Py_SampleLabelName(label)) < 0)
+        return -1;
+
+    return pbuf_message(&pprof->out, PROFILE_SAMPLE, &pprof->msg);
+}
+
+/* Write the Location messages */
+static int
+pprof_write_locations(pprof_t *pprof)
+{
+    PyObject *item, *code, *code_key;
+    Py_ssize_t i, function_id;
+    long lineno;
+
+    for (i=0; i < PyList_GET_SIZE(pprof->location_list); i++) {
+        item = PyList_GET_ITEM(pprof->location_list, i);
+        code = PyTuple_GET_ITEM(item, 0);
+        lineno = PYINT_ASLONG(PyTuple_GET_ITEM(item, 1));
+
+        code_key = _Py_SampleCodeKey(code);
+        if (code_key == NULL)
+            return -1;
+        function_id = pprof_id(pprof->functions, pprof->function_list,
+                               code_key, code);
+        Py_DECREF(code_key);
+        if (function_id == 0)
+            return -1;
+
+        /* Line message */
+        if (pbuf_uint(&pprof->sub, LINE_FUNCTION_ID, function_id) < 0)
+            return -1;
+        if (lineno > 0 && pbuf_uint(&pprof->sub, LINE_LINE, lineno) < 0)
+            return -1;
+
+        if (pbuf_uint(&pprof->msg, LOCATION_ID, i + 1) < 0)
+            return -1;
+        if (pbuf_message(&pprof->msg, LOCATION_LINE, &pprof->sub) < 0)
+            return -1;
+        if (pbuf_message(&pprof->out, PROFILE_LOCATION, &pprof->msg) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Write the Function message of a builtin function: "[C] module.function",
+   without filename */
+static int
+pprof_write_cfunction(pprof_t *pprof, PyObject *func)
+{
+    PyObject *obj;
+    Py_ssize_t name;
+    char buffer[100];
+
+    obj = _Py_CFunctionName(func);
+    if (obj == NULL)
+        return -1;
+#if PY_MAJOR_VERSION >= 3
+    PyOS_snprintf(buffer, sizeof(buffer), "[C] %s", PyUnicode_AsUTF8(obj));
+#else
+    PyOS_snprintf(buffer, sizeof(buffer), "[C] %s", PyString_AsString(obj));
+#endif
+    Py_DECREF(obj);
+    name = pprof_cstring(pprof, buffer);
+    if (name < 0)
+        return -1;
+
+    if (pbuf_uint(&pprof->msg, FUNCTION_NAME, name) < 0)
+        return -1;
+    return pbuf_uint(&pprof->msg, FUNCTION_SYSTEM_NAME, name);
+}
+
+/* Write the Function messages */
+static int
+pprof_write_functions(pprof_t *pprof)
+{
+    PyObject *obj;
+    PyCodeObject *code;
+    Py_ssize_t i, name, filename;
+
+    for (i=0; i < PyList_GET_SIZE(pprof->function_list); i++) {
+        obj = PyList_GET_ITEM(pprof->function_list, i);
+        if (pbuf_uint(&pprof->msg, FUNCTION_ID, i + 1) < 0)
+            return -1;
+
+        if (!PyCode_Check(obj)) {
+            if (pprof_write_cfunction(pprof, obj) < 0)
+                return -1;
+        }
+        else {
+            code = (PyCodeObject *)obj;
+            name = pprof_string(pprof, code->co_name);
+            if (name < 0)
+                return -1;
+            filename = pprof_string(pprof, code->co_filename);
+            if (filename < 0)
+                return -1;
+
+            if (pbuf_uint(&pprof->msg, FUNCTION_NAME, name) < 0)
+                return -1;
+            if (pbuf_uint(&pprof->msg, FUNCTION_SYSTEM_NAME, name) < 0)
+                return -1;
+            if (pbuf_uint(&pprof->msg, FUNCTION_FILENAME, filename) < 0)
+                return -1;
+            if (pbuf_uint(&pprof->msg, FUNCTION_START_LINE,
+                          code->co_firstlineno) < 0)
+                return -1;
+        }
+        if (pbuf_message(&pprof->out, PROFILE_FUNCTION, &pprof->msg) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Write the string table, encoded to UTF-8 */
+static int
+pprof_write_strings(pprof_t *pprof)
+{
+    PyObject *str, *bytes;
+    Py_ssize_t i;
+    int res;
+
+    for (i=0; i < PyList_GET_SIZE(pprof->string_list); i++) {
+        str = PyList_GET_ITEM(pprof->string_list, i);
+        if (PyUnicode_Check(str)) {
+            bytes = PyUnicode_AsUTF8String(str);
+            if (bytes == NULL)
+                return -1;
+        }
+        else {
+            bytes = str;
+            Py_INCREF(bytes);
+        }
+        res = pbuf_bytes(&pprof->out, PROFILE_STRING_TABLE,
+                         PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes));
+        Py_DECREF(bytes);
+        if (res < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Compress data with gzip using the zlib module. Return data uncompressed if
+   the zlib module is missing. */
+static PyObject*
+pprof_compress(PyObject *data)
+{
+    PyObject *zlib, *compressor, *head, *tail, *result;
+
+    zlib = PyImport_ImportModule("zlib");
+    if (zlib == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_ImportError))
+            return NULL;
+        PyErr_Clear();
+        Py_INCREF(data);
+        return data;
+    }
+    /* wbits=31: gzip header and trailer */
+    compressor = PyObject_CallMethod(zlib, "compressobj", "iii", 9, 8, 31);
+    Py_DECREF(zlib);
+    if (compressor == NULL)
+        return NULL;
+
+    head = PyObject_CallMethod(compressor, "compress", "O", data);
+    if (head == NULL) {
+        Py_DECREF(compressor);
+        return NULL;
+    }
+    tail = PyObject_CallMethod(compressor, "flush", "");
+    Py_DECREF(compressor);
+    if (tail == NULL) {
+        Py_DECREF(head);
+        return NULL;
+    }
+    result = PySequence_Concat(head, tail);
+    Py_DECREF(head);
+    Py_DECREF(tail);
+    return result;
+}
+
+/* Encode the samples of the sampler as a pprof Profile message, compressed
+   with gzip if compress is non-zero. Return None if the sampler is not
+   running.
+
+   Must be called with the GIL held. Raise an exception and return NULL on
+   error. */
+PyObject*
+_Py_SamplesPprof(int compress)
+{
+    pprof_t pprof;
+    PY_LONG_LONG oldest, newest;
+    PyObject *result, *data;
+    const char *type;
+    int res;
+
+    memset(&pprof, 0, sizeof(pprof));
+    result = NULL;
+    pprof.strings = PyDict_New();
+    pprof.string_list = PyList_New(0);
+    pprof.functions = PyDict_New();
+    pprof.function_list = PyList_New(0);
+    pprof.locations = PyDict_New();
+    pprof.location_list = PyList_New(0);
+    if (pprof.strings == NULL || pprof.string_list == NULL
+        || pprof.functions == NULL || pprof.function_list == NULL
+        || pprof.locations == NULL || pprof.location_list == NULL)
+        goto done;
+
+    /* the first string of the table must be the empty string */
+    if (pprof_cstring(&pprof, "") < 0)
+        goto done;
+
+    if (pprof_value_type(&pprof, &pprof.out, PROFILE_SAMPLE_TYPE,
+                         "samples", "count") < 0)
+        goto done;
+    /* in the cpu mode, samples are only taken while the thread is running */
+    type = _Py_SamplerWall() ? "wall" : "cpu";
+    if (pprof_value_type(&pprof, &pprof.out, PROFILE_SAMPLE_TYPE,
+                         type, "nanoseconds") < 0)
+        goto done;
+    if (pprof_value_type(&pprof, &pprof.out, PROFILE_PERIOD_TYPE,
+                         type, "nanoseconds") < 0)
+        goto done;
+
+    res = _Py_SamplerVisit(pprof_sample, &pprof,
+                           &pprof.period, &oldest, &newest);
+    if (res < 0)
+        goto done;
+    if (res == 1) {
+        /* the sampler is not running */
+        result = Py_None;
+        Py_INCREF(result);
+        goto done;
+    }
+
+    if (pbuf_uint(&pprof.out, PROFILE_TIME_NANOS,
+                  (unsigned PY_LONG_LONG)oldest * 1000) < 0)
+        goto done;
+    if (pbuf_uint(&pprof.out, PROFILE_DURATION_NANOS,
+                  (unsigned PY_LONG_LONG)(newest - oldest) * 1000) < 0)
+        goto done;
+    if (pbuf_uint(&pprof.out, PROFILE_PERIOD,
+                  (unsigned PY_LONG_LONG)pprof.period * 1000) < 0)
+        goto done;
+
+    if (pprof_write_locations(&pprof) < 0)
+        goto done;
+    if (pprof_write_functions(&pprof) < 0)
+        goto done;
+    if (pprof_write_strings(&pprof) < 0)
+        goto done;
+
+    data = PyBytes_FromStringAndSize(pprof.out.data, pprof.out.len);
+    if (data == NULL)
+        goto done;
+    if (compress) {
+        result = pprof_compress(data);
+        Py_DECREF(data);
+    }
+    else
+        result = data;
+
+done:
+    PyMem_Free(pprof.out.data);
+    PyMem_Free(pprof.msg.data);
+    PyMem_Free(pprof.sub.data);
+    Py_XDECREF(pprof.strings);
+    Py_XDECREF(pprof.string_list);
+    Py_XDECREF(pprof.functions);
+    Py_XDECREF(pprof.function_list);
+    Py_XDECREF(pprof.locations);
+    Py_XDECREF(pprof.location_list);
+    return result;
+}
@@ -0,0 +1,1639 @@
+/*
+ * Sampler: flight recorder of the Python stacks.
+ *
+ * A background thread takes a sample of the Python stack of all threads at a
+ * fixed interval and writes it into a preallocated ring, overwriting the
+ * oldest samples. The ring keeps a strong reference to the code objects, so
+ * it can be written later by the fatal error handler or on request.
+ *
+ * Each sample is tagged with the state of its thread. The sampler holds the
+ * GIL while it takes samples, so the state is estimated: a thread which used
+ * at least 10% of a CPU since its previous sample is running; otherwise it is
+ * in a syscall if it is calling a builtin function, or waiting for the GIL
+ * to run Python code. The CPU time is only tracked for SAMPLER_MAX_THREADS
+ * threads: other threads are still sampled, as running or in a syscall.
+ *
+ * Each sample also copies the label of its thread, set by the application with
+ * a single store, to group the samples by request or by tenant.
+ *
+ * Scopes of sampling() receive the samples of their threads when they are
+ * taken. The first scope starts the sampler if it is not running, and the
+ * last scope stops it; in this case, only the threads of a scope are sampled.
+ *
+ * Optionally, samples are also counted in a prefix trie of frames to profile
+ * for a long time with a bounded memory: nodes are allocated in a fixed
+ * arena and indexed by a preallocated open-addressed hash table of
+ * (parent, code, line). The children of the root are the (thread state,
+ * label) pairs.
+ * Samples are only inserted by the sampler thread while it holds the GIL, so
+ * the trie needs no lock. When the arena is full, samples of new stacks are
+ * counted in an overflow counter.
+ */
+
+#include "Python.h"
+#include "pythread.h"
+#include "frameobject.h"
+#include "opcode.h"
+#include "faulthandler.h"
+#ifdef MS_WINDOWS
+#  include <windows.h>
+#else
+#  include <unistd.h>
+#  ifdef HAVE_PTHREAD_H
+#    include <pthread.h>
+#    include <time.h>
+#  endif
+#endif
+
+#define PUTS(fd, str) _Py_write_noraise(fd, str, (int)strlen(str))
+
+/* Maximum number of frames stored per sample */
+#define SAMPLER_MAX_DEPTH _Py_SAMPLE_MAX_DEPTH
+
+/* Maximum number of threads whose CPU time is tracked at each tick: the ring
+   is sized to keep 'duration' seconds of samples of SAMPLER_MAX_THREADS
+   threads */
+#define SAMPLER_MAX_THREADS 16
+
+/* Maximum number of distinct stacks written by _Py_DumpSamples() */
+#define SAMPLER_MAX_STACKS 20
+
+/* Maximum number of distinct labels, and of threads with a label */
+#define SAMPLER_MAX_LABELS 1024
+#define SAMPLER_MAX_LABELED_THREADS 256
+/* Size of the hash table of the labels of the threads (power of two) */
+#define SAMPLER_LABEL_TABLE_SIZE (SAMPLER_MAX_LABELED_THREADS * 2)
+/* Thread state of a removed entry of the hash table of labels */
+#define LABEL_REMOVED ((PyThreadState *)1)
+
+/* Maximum number of active scopes of sampling() */
+#define SAMPLER_MAX_SCOPES 64
+/* Duration of the ring, in number of intervals, when the sampler is started
+   by a scope: scopes aggregate the samples when they are taken */
+#define SAMPLER_SCOPE_RING 100
+
+/* Number of entries of the cache of line numbers (power of two) */
+#define SAMPLER_LINENO_CACHE 1024
+
+/* Key of the label capsule in the dictionary of the thread state */
+#define SAMPLER_LABEL_KEY "faulthandler.sample_label"
+
+/* Sleep by chunks of 100 ms to not delay stop_sampler() too much */
+#define SAMPLER_MAX_SLEEP 100000
+
+#ifdef _MSC_VER
+#  define MEMORY_BARRIER() MemoryBarrier()
+#  define COMPARE_AND_SWAP(ptr, old, new) \
+       (InterlockedCompareExchange((volatile LONG *)(ptr), (new), (old)) \
+        == (old))
+#else
+#  define MEMORY_BARRIER() __sync_synchronize()
+#  define COMPARE_AND_SWAP(ptr, old, new) \
+       __sync_bool_compare_and_swap(ptr, old, new)
+#endif
+
+typedef _Py_SampleFrame sample_frame_t;
+
+typedef struct {
+    PyObject *code;   /* strong reference, NULL for the root */
+    int lineno;
+    /* index of the parent node: the calling frame */
+    unsigned int parent;
+    /* number of samples ending at this node */
+    size_t count;
+} trie_node_t;
+
+typedef struct {
+    long thread_id;
+    /* time of the sample (monotonic clock), CPU time of the thread (-1 if
+       unknown) */
+    PY_LONG_LONG timestamp;
+    PY_LONG_LONG cpu_time;
+} cpu_time_t;
+
+typedef struct {
+    /* 0 while the sample is written, index of the sample plus one otherwise */
+    volatile size_t seq;
+    PY_LONG_LONG timestamp;
+    long thread_id;
+    int state;
+    int label;
+    /* number of frames of the thread, can be greater than nframe */
+    int depth;
+    int nframe;
+    sample_frame_t frames[SAMPLER_MAX_DEPTH];
+} sample_t;
+
+typedef struct {
+    /* only receive the samples of this thread, or of all threads if 0 */
+    long thread_id;
+    _Py_SampleVisitor visit;
+    void *arg;
+} sampler_scope_t;
+
+static struct {
+    int running;
+    volatile int cancel;
+    /* locked while the sampler thread is running */
+    PyThread_type_lock running_lock;
+    /* released by the sampler thread when it created its thread state */
+    PyThread_type_lock started_lock;
+#ifndef MS_WINDOWS
+    /* process which started the sampler thread: after fork(), the thread
+       doesn't exist in the child process */
+    pid_t pid;
+#endif
+    PyInterpreterState *interp;
+    PyThreadState *tstate;
+    PY_LONG_LONG interval;
+    /* if zero, only take samples of running threads */
+    int wall;
+    /* if non-zero, samples are taken by the perf backend */
+    int perf;
+
+    /* CPU time of the threads sampled by the previous tick */
+    cpu_time_t cpu_times[SAMPLER_MAX_THREADS];
+    unsigned int ncpu_time;
+    /* number of threads sampled by the previous tick, and number of these
+       threads whose CPU time was not tracked */
+    unsigned int nthread;
+    unsigned int nuntracked;
+    /* number of samples of threads whose CPU time was not tracked */
+    size_t untracked_samples;
+
+    sample_t *samples;
+    size_t capacity;
+    /* total number of samples written since start */
+    volatile size_t count;
+
+    /* preallocated memory for _Py_DumpSamples(): open-addressed hash table
+       of the first sample of each group (index plus one, 0 means empty),
+       number of samples of each group */
+    size_t *groups;
+    size_t groups_size;
+    size_t *group_counts;
+    /* non-zero while the ring is written by the sampler thread or read:
+       taken by sampler_acquire_ring() */
+    volatile int ring_busy;
+
+    /* prefix trie of frames, NULL if disabled. The node 0 is the root. */
+    struct {
+        trie_node_t *nodes;
+        unsigned int nnode;
+        unsigned int capacity;
+        /* open-addressed hash table of node indexes, 0 means empty */
+        unsigned int *table;
+        size_t table_size;
+        /* number of samples of each state not inserted because the arena is
+           full: their label is lost */
+        size_t overflow[_Py_SAMPLE_NSTATE];
+        PY_LONG_LONG oldest;
+        PY_LONG_LONG newest;
+    } trie;
+
+    /* direct-mapped cache of line numbers: decoding co_lnotab is linear in
+       the size of the code, whereas the frames calling the current frame
+       are mostly at the same instruction from a tick to the next one. The
+       code objects are strong references. Only used by the sampler
+       thread. */
+    struct {
+        PyCodeObject *code;
+        int lasti;
+        int lineno;
+    } lineno_cache[SAMPLER_LINENO_CACHE];
+
+    /* active scopes of sampling() */
+    sampler_scope_t scopes[SAMPLER_MAX_SCOPES];
+    int nscope;
+    /* non-zero if the sampler was started by a scope */
+    int scope_owner;
+} sampler;
+
+/* Labels of the samples, independent of the sampler: label 0 means no
+   label. The entry of a thread is removed by the destructor of a capsule
+   stored in the dictionary of its thread state, when the thread state is
+   cleared. */
+static struct {
+    /* names[label - 1] is the name of a label */
+    char *names[SAMPLER_MAX_LABELS];
+    int nlabel;
+    /* open-addressed hash table of the labels of the threads: tstate is
+       NULL for an empty entry, LABEL_REMOVED for a removed entry. Only
+       modified with the GIL held, read without lock by _Py_GetThreadLabel().
+       Removed entries are kept until the table is rebuilt, so readers don't
+       miss entries when a thread state is cleared. */
+    struct {
+        PyThreadState *volatile tstate;
+        volatile int label;
+    } threads[SAMPLER_LABEL_TABLE_SIZE];
+    /* number of threads with a label */
+    int nthread;
+    /* number of entries which are not empty, removed entries included */
+    int nused;
+} labels;
+
+static size_t
+label_hash(PyThreadState *tstate)
+{
+    return (((size_t)tstate >> 4) * 2654435761u)
+           & (SAMPLER_LABEL_TABLE_SIZE - 1);
+}
+
+/* Get the index of the entry of a thread in the hash table of labels, -1 if
+   the thread has no entry.
+
+   This function is signal safe. */
+static int
+label_lookup(PyThreadState *tstate)
+{
+    size_t index;
+    int n;
+    PyThreadState *entry;
+
+    index = label_hash(tstate);
+    for (n=0; n < SAMPLER_LABEL_TABLE_SIZE; n++) {
+        entry = labels.threads[index].tstate;
+        if (entry == tstate)
+            return (int)index;
+        if (entry == NULL)
+            return -1;
+        index = (index + 1) & (SAMPLER_LABEL_TABLE_SIZE - 1);
+    }
+    return -1;
+}
+
+/* Get the label of a thread, 0 if it has no label.
+
+   This function is signal safe. */
+int
+_Py_GetThreadLabel(PyThreadState *tstate)
+{
+    int index;
+
+    index = label_lookup(tstate);
+    if (index < 0)
+        return 0;
+    return labels.threads[index].label;
+}
+
+/* Add the entry of a thread to the hash table of labels: reuse the first
+   removed entry of the probe sequence. The thread must not have an entry.
+
+   Must be called with the GIL held. */
+static void
+label_insert(PyThreadState *tstate, int label)
+{
+    size_t index;
+
+    index = label_hash(tstate);
+    while (labels.threads[index].tstate != NULL
+           && labels.threads[index].tstate != LABEL_REMOVED)
+        index = (index + 1) & (SAMPLER_LABEL_TABLE_SIZE - 1);
+    if (labels.threads[index].tstate == NULL)
+        labels.nused++;
+    labels.threads[index].label = label;
+    MEMORY_BARRIER();
+    labels.threads[index].tstate = tstate;
+    labels.nthread++;
+}
+
+/* Rebuild the hash table of labels to drop the removed entries. A sample
+   taken by a signal handler during the rebuild can miss the label of its
+   thread.
+
+   Must be called with the GIL held. */
+static void
+label_rehash(void)
+{
+    struct {
+        PyThreadState *tstate;
+        int label;
+    } threads[SAMPLER_MAX_LABELED_THREADS];
+    int i, n;
+
+    n = 0;
+    for (i=0; i < SAMPLER_LABEL_TABLE_SIZE; i++) {
+        if (labels.threads[i].tstate != NULL
+            && labels.threads[i].tstate != LABEL_REMOVED) {
+            threads[n].tstate = labels.threads[i].tstate;
+            threads[n].label = labels.threads[i].label;
+            n++;
+        }
+        labels.threads[i].tstate = NULL;
+        labels.threads[i].label = 0;
+    }
+    labels.nthread = 0;
+    labels.nused = 0;
+    for (i=0; i < n; i++)
+        label_insert(threads[i].tstate, threads[i].label);
+}
+
+/* Get the name of a label, NULL for the label 0 */
+const char*
+_Py_SampleLabelName(int label)
+{
+    if (label <= 0 || label > labels.nlabel)
+        return NULL;
+    return labels.names[label - 1];
+}
+
+/* Destructor of the label capsule of a thread state */
+static void
+label_release(PyObject *capsule)
+{
+    PyThreadState *tstate;
+    int index;
+
+    tstate = PyCapsule_GetPointer(capsule, SAMPLER_LABEL_KEY);
+    index = label_lookup(tstate);
+    if (index < 0)
+        return;
+    labels.threads[index].label = 0;
+    MEMORY_BARRIER();
+    labels.threads[index].tstate = LABEL_REMOVED;
+    labels.nthread--;
+}
+
+/* Get the identifier of a label name, register it if needed. Return -1 on
+   error. */
+static int
+label_get_id(const char *name)
+{
+    char *copy;
+    int i;
+
+    for (i=0; i < labels.nlabel; i++) {
+        if (strcmp(labels.names[i], name) == 0)
+            return i + 1;
+    }
+    if (labels.nlabel >= SAMPLER_MAX_LABELS) {
+        PyErr_SetString(PyExc_RuntimeError, "too many sample labels");
+        return -1;
+    }
+    copy = PyMem_Malloc(strlen(name) + 1);
+    if (copy == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    strcpy(copy, name);
+    labels.names[labels.nlabel] = copy;
+    labels.nlabel++;
+    return labels.nlabel;
+}
+
+/* Set the label of the current thread: copied into its next samples. If name
+   is NULL, remove the label.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+int
+_Py_SetSampleLabel(PyThreadState *tstate, const char *name)
+{
+    PyObject *dict, *capsule;
+    int label, index;
+
+    label = 0;
+    if (name != NULL) {
+        label = label_get_id(name);
+        if (label < 0)
+            return -1;
+    }
+
+    index = label_lookup(tstate);
+    if (index >= 0) {
+        /* a single store */
+        labels.threads[index].label = label;
+        return 0;
+    }
+    if (label == 0)
+        return 0;
+    if (labels.nthread >= SAMPLER_MAX_LABELED_THREADS) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "too many threads with a sample label");
+        return -1;
+    }
+
+    /* remove the entry when the thread state is cleared */
+    dict = PyThreadState_GetDict();
+    if (dict == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "no thread state dictionary");
+        return -1;
+    }
+    capsule = PyCapsule_New(tstate, SAMPLER_LABEL_KEY, label_release);
+    if (capsule == NULL)
+        return -1;
+    /* keep empty entries to bound the probe sequences */
+    if (labels.nused >= SAMPLER_LABEL_TABLE_SIZE / 4 * 3)
+        label_rehash();
+    label_insert(tstate, label);
+    if (PyDict_SetItemString(dict, SAMPLER_LABEL_KEY, capsule) < 0) {
+        Py_DECREF(capsule);
+        return -1;
+    }
+    Py_DECREF(capsule);
+    return 0;
+}
+
+/* Sleep 'us' microseconds. Called without holding the GIL. */
+static void
+sampler_sleep(PY_LONG_LONG us)
+{
+#ifdef MS_WINDOWS
+    Sleep((DWORD)(us / 1000));
+#else
+    struct timeval tv;
+    tv.tv_sec = (long)(us / 1000000);
+    tv.tv_usec = (long)(us % 1000000);
+    (void)select(0, NULL, NULL, NULL, &tv);
+#endif
+}
+
+/* Get the child of the node parent for the frame (code, lineno): create it if
+   it doesn't exist. Return 0 if the arena is full. */
+static unsigned int
+trie_child(unsigned int parent, PyObject *code, int lineno)
+{
+    trie_node_t *node;
+    size_t mask, index;
+    unsigned int child;
+
+    mask = sampler.trie.table_size - 1;
+    index = (((size_t)code >> 4) ^ ((size_t)parent * 31 + lineno)) * 2654435761u;
+    index &= mask;
+    while (1) {
+        child = sampler.trie.table[index];
+        if (child == 0)
+            break;
+        node = &sampler.trie.nodes[child];
+        if (node->parent == parent && node->code == code
+            && node->lineno == lineno)
+            return child;
+        index = (index + 1) & mask;
+    }
+
+    if (sampler.trie.nnode >= sampler.trie.capacity)
+        return 0;
+    child = sampler.trie.nnode;
+    sampler.trie.nnode++;
+    node = &sampler.trie.nodes[child];
+    Py_XINCREF(code);
+    node->code = code;
+    node->lineno = lineno;
+    node->parent = parent;
+    node->count = 0;
+    sampler.trie.table[index] = child;
+    return child;
+}
+
+/* Count a sample in the trie */
+static void
+trie_insert(sample_t *sample)
+{
+    unsigned int node;
+    int i;
+
+    if (sampler.trie.oldest == 0)
+        sampler.trie.oldest = sample->timestamp;
+    sampler.trie.newest = sample->timestamp;
+
+    /* the node of the thread state and of the label has no code object */
+    node = trie_child(0, NULL,
+                      sample->state + sample->label * _Py_SAMPLE_NSTATE);
+    /* frames are stored most recent call first */
+    for (i=sample->nframe - 1; node != 0 && i >= 0; i--) {
+        node = trie_child(node, sample->frames[i].code,
+                          sample->frames[i].lineno);
+    }
+    if (node == 0) {
+        sampler.trie.overflow[sample->state]++;
+        return;
+    }
+    sampler.trie.nodes[node].count++;
+}
+
+/* Get the CPU time of a thread in microseconds, or -1 if it is unknown */
+static PY_LONG_LONG
+thread_cpu_time(long thread_id)
+{
+#ifdef MS_WINDOWS
+    HANDLE thread;
+    FILETIME creation, exit, kernel, user;
+    PY_LONG_LONG cpu_time;
+
+    thread = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE,
+                        (DWORD)thread_id);
+    if (thread == NULL)
+        return -1;
+    cpu_time = -1;
+    if (GetThreadTimes(thread, &creation, &exit, &kernel, &user)) {
+        /* FILETIME are in units of 100 ns */
+        cpu_time = ((PY_LONG_LONG)kernel.dwHighDateTime << 32)
+                   + kernel.dwLowDateTime
+                   + ((PY_LONG_LONG)user.dwHighDateTime << 32)
+                   + user.dwLowDateTime;
+        cpu_time /= 10;
+    }
+    CloseHandle(thread);
+    return cpu_time;
+#elif defined(HAVE_PTHREAD_H) && defined(_POSIX_THREAD_CPUTIME) \
+      && _POSIX_THREAD_CPUTIME >= 0
+    clockid_t clock;
+    struct timespec ts;
+
+    /* the identifier of a thread is its pthread_t */
+    if (pthread_getcpuclockid((pthread_t)thread_id, &clock) != 0)
+        return -1;
+    if (clock_gettime(clock, &ts) != 0)
+        return -1;
+    return (PY_LONG_LONG)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return -1;
+#endif
+}
+
+/* Check if the current instruction of the most recent frame of a thread is
+   a call: the called function is a builtin function, a Python function would
+   have its own frame */
+static int
+frame_in_call(PyFrameObject *frame)
+{
+    PyObject *bytecode;
+    int opcode;
+
+    bytecode = frame->f_code->co_code;
+    if (frame->f_lasti < 0 || !PyBytes_Check(bytecode)
+        || frame->f_lasti >= PyBytes_GET_SIZE(bytecode))
+        return 0;
+    opcode = (unsigned char)PyBytes_AS_STRING(bytecode)[frame->f_lasti];
+    switch (opcode) {
+    case CALL_FUNCTION:
+    case CALL_FUNCTION_KW:
+#ifdef CALL_FUNCTION_VAR
+    case CALL_FUNCTION_VAR:
+#endif
+#ifdef CALL_FUNCTION_VAR_KW
+    case CALL_FUNCTION_VAR_KW:
+#endif
+#ifdef CALL_FUNCTION_EX
+    case CALL_FUNCTION_EX:
+#endif
+#ifdef CALL_METHOD
+    case CALL_METHOD:
+#endif
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Get the state of a thread whose CPU time is unknown: in a syscall if it is
+   calling a builtin function, running otherwise.
+
+   Must be called with the GIL held. */
+static int
+sampler_untracked_state(PyThreadState *tstate)
+{
+    /* the builtin function is only known if the shadow stack is enabled */
+    if (_Py_GetShadowCFunction(tstate) != NULL
+        || frame_in_call(tstate->frame))
+        return _Py_SAMPLE_SYSCALL;
+    return _Py_SAMPLE_RUNNING;
+}
+
+/* Get the state of a thread and write its CPU time into cpu.
+
+   Must be called with the GIL held. */
+static int
+sampler_thread_state(PyThreadState *tstate, PY_LONG_LONG timestamp,
+                     cpu_time_t *cpu)
+{
+    cpu_time_t *previous;
+    unsigned int i;
+
+    cpu->thread_id = tstate->thread_id;
+    cpu->timestamp = timestamp;
+    cpu->cpu_time = thread_cpu_time(tstate->thread_id);
+
+    previous = NULL;
+    for (i=0; i < sampler.ncpu_time; i++) {
+        if (sampler.cpu_times[i].thread_id == tstate->thread_id) {
+            previous = &sampler.cpu_times[i];
+            break;
+        }
+    }
+    if (previous != NULL
+        && (cpu->cpu_time < 0 || previous->cpu_time < 0))
+        previous = NULL;
+    if (previous == NULL) {
+        /* unknown CPU time */
+        return sampler_untracked_state(tstate);
+    }
+
+    /* running if the thread used at least 10% of a CPU */
+    if ((cpu->cpu_time - previous->cpu_time) * 10
+        >= timestamp - previous->timestamp)
+        return _Py_SAMPLE_RUNNING;
+
+    if (sampler_untracked_state(tstate) == _Py_SAMPLE_SYSCALL)
+        return _Py_SAMPLE_SYSCALL;
+    return _Py_SAMPLE_GIL;
+}
+
+/* Get the name of a thread state: "running", "gil" or "syscall" */
+const char*
+_Py_SampleStateName(int state)
+{
+    switch (state) {
+    case _Py_SAMPLE_GIL: return "gil";
+    case _Py_SAMPLE_SYSCALL: return "syscall";
+    default: return "running";
+    }
+}
+
+/* Get a hashable key of the code of a sample frame: the address of the code
+   object or of the builtin function. On Python 2, equal code objects can
+   have different filenames, and a bound builtin method is not hashable if
+   its instance is not hashable (ex: list.sort). The address is unique while
+   the caller holds a reference to the code.
+
+   Must be called with the GIL held. Raise an exception and return NULL on
+   error. */
+PyObject*
+_Py_SampleCodeKey(PyObject *code)
+{
+    return PyLong_FromVoidPtr(code);
+}
+
+/* Get the next slot of the ring and clear the sample it contains: the slot is
+   written until sampler_commit() is called.
+
+   Must be called with the GIL held. */
+static sample_t*
+sampler_begin(long thread_id, PY_LONG_LONG timestamp, int state, int label)
+{
+    sample_t *sample;
+    int i;
+
+    sample = &sampler.samples[sampler.count % sampler.capacity];
+    sample->seq = 0;
+    MEMORY_BARRIER();
+
+    for (i=0; i < sample->nframe; i++)
+        Py_CLEAR(sample->frames[i].code);
+    sample->nframe = 0;
+
+    sample->timestamp = timestamp;
+    sample->thread_id = thread_id;
+    sample->state = state;
+    sample->label = label;
+    return sample;
+}
+
+/* Return non-zero if a scope receives the samples of a thread */
+static int
+sampler_in_scope(long thread_id)
+{
+    int i;
+
+    for (i=0; i < sampler.nscope; i++) {
+        if (sampler.scopes[i].thread_id == 0
+            || sampler.scopes[i].thread_id == thread_id)
+            return 1;
+    }
+    return 0;
+}
+
+/* Pass a sample to the scopes of its thread. Errors are written to stderr
+   and ignored. */
+static void
+sampler_notify_scopes(sample_t *sample)
+{
+    sampler_scope_t *scope;
+    int i;
+
+    for (i=0; i < sampler.nscope; i++) {
+        scope = &sampler.scopes[i];
+        if (scope->thread_id != 0 && scope->thread_id != sample->thread_id)
+            continue;
+        if (scope->visit(sample->frames, sample->nframe, sample->state,
+                         sample->label, 1, scope->arg) < 0)
+            PyErr_WriteUnraisable(NULL);
+    }
+}
+
+static void
+sampler_commit(sample_t *sample)
+{
+    size_t index = sampler.count;
+
+    MEMORY_BARRIER();
+    sample->seq = index + 1;
+    sampler.count = index + 1;
+
+    if (sampler.trie.nodes != NULL)
+        trie_insert(sample);
+    if (sampler.nscope != 0)
+        sampler_notify_scopes(sample);
+}
+
+/* Get the line number currently executed by a frame, use the cache of line
+   numbers.
+
+   Must be called with the GIL held. */
+static int
+sampler_lineno(PyFrameObject *frame)
+{
+    size_t index;
+    PyCodeObject *code = frame->f_code;
+
+    /* the line number of a traced frame is f_lineno */
+    if (frame->f_trace != NULL)
+        return _Py_GetFrameLineNumber(frame);
+
+    index = (((size_t)code >> 4) ^ (size_t)frame->f_lasti * 2654435761u)
+            & (SAMPLER_LINENO_CACHE - 1);
+    if (sampler.lineno_cache[index].code != code
+        || sampler.lineno_cache[index].lasti != frame->f_lasti) {
+        Py_INCREF(code);
+        Py_XDECREF(sampler.lineno_cache[index].code);
+        sampler.lineno_cache[index].code = code;
+        sampler.lineno_cache[index].lasti = frame->f_lasti;
+        sampler.lineno_cache[index].lineno = _Py_GetFrameLineNumber(frame);
+    }
+    return sampler.lineno_cache[index].lineno;
+}
+
+static void
+sampler_clear_lineno_cache(void)
+{
+    int index;
+
+    for (index=0; index < SAMPLER_LINENO_CACHE; index++)
+        Py_CLEAR(sampler.lineno_cache[index].code);
+}
+
+/* Write the stack of a thread into the next slot of the ring.
+
+   Must be called with the GIL held. */
+static void
+sampler_record(PyThreadState *tstate, PY_LONG_LONG timestamp, int state)
+{
+    sample_t *sample;
+    PyFrameObject *frame;
+    sample_frame_t *sframe;
+    _Py_ShadowEntry *entries, *entry;
+    PyObject *c_function;
+    int depth, first, i;
+
+    sample = sampler_begin(tstate->thread_id, timestamp, state,
+                           _Py_GetThreadLabel(tstate));
+
+    /* the builtin function called by the current frame is the most recent
+       frame */
+    first = 0;
+    c_function = _Py_GetShadowCFunction(tstate);
+    if (c_function != NULL) {
+        sframe = &sample->frames[0];
+        Py_INCREF(c_function);
+        sframe->code = c_function;
+        sframe->lineno = 0;
+        sample->nframe = 1;
+        first = 1;
+    }
+
+    depth = (int)_Py_GetShadowStack(tstate, &entries);
+    if (depth != 0) {
+        /* read the contiguous shadow stack, most recent call first */
+        for (i=0; i < depth && first + i < SAMPLER_MAX_DEPTH; i++) {
+            entry = &entries[depth - 1 - i];
+            sframe = &sample->frames[first + i];
+            Py_INCREF(entry->code);
+            sframe->code = (PyObject *)entry->code;
+            sframe->lineno = sampler_lineno(entry->frame);
+            sample->nframe = first + i + 1;
+        }
+    }
+    else {
+        for (frame = tstate->frame; frame != NULL; frame = frame->f_back) {
+            if (first + depth < SAMPLER_MAX_DEPTH) {
+                sframe = &sample->frames[first + depth];
+                Py_INCREF(frame->f_code);
+                sframe->code = (PyObject *)frame->f_code;
+                sframe->lineno = sampler_lineno(frame);
+                sample->nframe = first + depth + 1;
+            }
+            depth++;
+        }
+    }
+    sample->depth = first + depth;
+    sampler_commit(sample);
+}
+
+#ifdef HAVE_PERF_SAMPLER
+/* Copy a sample recorded by the perf backend into the ring: visitor of
+   _Py_PerfUpdate(). frames are borrowed references.
+
+   Must be called with the GIL held. */
+static void
+sampler_record_perf(long thread_id, PY_LONG_LONG timestamp,
+                    int label, const sample_frame_t *frames, int nframe,
+                    int depth, void *arg)
+{
+    sample_t *sample;
+    int i;
+
+    /* the thread used the CPU time */
+    sample = sampler_begin(thread_id, timestamp, _Py_SAMPLE_RUNNING, label);
+    for (i=0; i < nframe; i++) {
+        Py_INCREF(frames[i].code);
+        sample->frames[i] = frames[i];
+    }
+    sample->nframe = nframe;
+    sample->depth = depth;
+    sampler_commit(sample);
+}
+#endif
+
+/* Take the ring: return 1 on success, 0 if it is already used by another
+   thread or by a signal handler.
+
+   This function is signal safe. */
+static int
+sampler_acquire_ring(void)
+{
+    return COMPARE_AND_SWAP(&sampler.ring_busy, 0, 1);
+}
+
+static void
+sampler_release_ring(void)
+{
+    MEMORY_BARRIER();
+    sampler.ring_busy = 0;
+}
+
+/* Take a sample of all threads except of the sampler thread, or only of
+   running threads if the sampler doesn't measure the wall-clock time.
+
+   Must be called with the GIL held. */
+static void
+sampler_tick(void)
+{
+    PyThreadState *tstate;
+    PY_LONG_LONG timestamp, now;
+    cpu_time_t cpu_times[SAMPLER_MAX_THREADS];
+    unsigned int nthreads, nuntracked;
+    int state, tracked;
+
+    /* the timestamp of the samples is the system clock, the CPU usage is
+       measured with the monotonic clock */
+    timestamp = _Py_gettime();
+    now = _Py_monotonic();
+    nthreads = 0;
+    nuntracked = 0;
+    tstate = PyInterpreterState_ThreadHead(sampler.interp);
+    for (; tstate != NULL; tstate = PyThreadState_Next(tstate)) {
+        if (tstate == sampler.tstate || tstate->frame == NULL)
+            continue;
+        /* a sampler started by a scope only samples the threads of the
+           scopes */
+        if (sampler.scope_owner && !sampler_in_scope(tstate->thread_id))
+            continue;
+        /* the CPU time of threads past the limit is not tracked, but they
+           are still sampled */
+        tracked = (nthreads < SAMPLER_MAX_THREADS);
+        if (tracked) {
+            state = sampler_thread_state(tstate, now, &cpu_times[nthreads]);
+            nthreads++;
+        }
+        else {
+            state = sampler_untracked_state(tstate);
+            nuntracked++;
+        }
+        if (sampler.wall || state == _Py_SAMPLE_RUNNING) {
+            sampler_record(tstate, timestamp, state);
+            if (!tracked)
+                sampler.untracked_samples++;
+        }
+    }
+    memcpy(sampler.cpu_times, cpu_times, nthreads * sizeof(cpu_time_t));
+    sampler.ncpu_time = nthreads;
+    sampler.nthread = nthreads + nuntracked;
+    sampler.nuntracked = nuntracked;
+}
+
+static void
+sampler_thread(void *unused)
+{
+    PY_LONG_LONG deadline, now;
+
+    sampler.tstate = PyThreadState_New(sampler.interp);
+    /* _Py_SamplerStart() waits for the thread state, holding the GIL */
+    PyThread_release_lock(sampler.started_lock);
+    if (sampler.tstate == NULL) {
+        PyThread_release_lock(sampler.running_lock);
+        return;
+    }
+#ifdef HAVE_PERF_SAMPLER
+    if (sampler.perf)
+        _Py_PerfSetManager();
+#endif
+
+    while (!sampler.cancel) {
+        deadline = _Py_monotonic() + sampler.interval;
+        while (!sampler.cancel) {
+            now = _Py_monotonic();
+            if (now >= deadline)
+                break;
+            if (deadline - now > SAMPLER_MAX_SLEEP)
+                sampler_sleep(SAMPLER_MAX_SLEEP);
+            else
+                sampler_sleep(deadline - now);
+        }
+        if (sampler.cancel)
+            break;
+
+        PyEval_AcquireThread(sampler.tstate);
+        /* don't modify the ring while a signal handler is reading it */
+        if (!sampler.cancel && sampler_acquire_ring()) {
+#ifdef HAVE_PERF_SAMPLER
+            if (sampler.perf)
+                (void)_Py_PerfUpdate(sampler.interp,
+                                     sampler_record_perf, NULL);
+            else
+#endif
+                sampler_tick();
+            sampler_release_ring();
+        }
+        PyEval_ReleaseThread(sampler.tstate);
+    }
+
+    PyEval_AcquireThread(sampler.tstate);
+    PyThreadState_Clear(sampler.tstate);
+    sampler.tstate = NULL;
+    PyThreadState_DeleteCurrent();
+
+    PyThread_release_lock(sampler.running_lock);
+}
+
+static void
+trie_free(void)
+{
+    PyMem_Free(sampler.trie.nodes);
+    PyMem_Free(sampler.trie.table);
+    memset(&sampler.trie, 0, sizeof(sampler.trie));
+}
+
+/* Allocate the trie: arena of 'capacity' nodes. Return 0 on success, raise an
+   exception and return -1 on error. */
+static int
+trie_alloc(unsigned int capacity)
+{
+    size_t table_size;
+
+    /* the table is at least twice larger than the arena */
+    table_size = 1;
+    while (table_size < (size_t)capacity * 2)
+        table_size *= 2;
+
+    sampler.trie.nodes = PyMem_Malloc(capacity * sizeof(trie_node_t));
+    sampler.trie.table = PyMem_Malloc(table_size * sizeof(unsigned int));
+    if (sampler.trie.nodes == NULL || sampler.trie.table == NULL) {
+        trie_free();
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(sampler.trie.table, 0, table_size * sizeof(unsigned int));
+    memset(&sampler.trie.nodes[0], 0, sizeof(trie_node_t));
+    sampler.trie.nnode = 1;
+    sampler.trie.capacity = capacity;
+    sampler.trie.table_size = table_size;
+    return 0;
+}
+
+/* Stop the sampler thread and release the ring.
+
+   Must be called with the GIL held. */
+void
+_Py_SamplerStop(void)
+{
+    size_t index;
+    int i;
+
+    if (!sampler.running)
+        return;
+
+    sampler.cancel = 1;
+#ifndef MS_WINDOWS
+    if (sampler.pid != getpid()) {
+        /* forked child process: the lock is held by the sampler thread of
+           the parent process, don't wait for it. The thread may have
+           taken the ring. */
+        sampler.tstate = NULL;
+        sampler.ring_busy = 0;
+# ifdef HAVE_PERF_SAMPLER
+        if (sampler.perf)
+            _Py_PerfAfterFork();
+# endif
+    }
+    else
+#endif
+    {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(sampler.running_lock, 1);
+        Py_END_ALLOW_THREADS
+    }
+    PyThread_release_lock(sampler.running_lock);
+    PyThread_free_lock(sampler.running_lock);
+    sampler.running_lock = NULL;
+    PyThread_free_lock(sampler.started_lock);
+    sampler.started_lock = NULL;
+    sampler.running = 0;
+#ifdef HAVE_PERF_SAMPLER
+    if (sampler.perf)
+        _Py_PerfStop();
+#endif
+
+    for (index=0; index < sampler.capacity; index++) {
+        for (i=0; i < sampler.samples[index].nframe; i++)
+            Py_CLEAR(sampler.samples[index].frames[i].code);
+    }
+    sampler_clear_lineno_cache();
+    PyMem_Free(sampler.samples);
+    sampler.samples = NULL;
+    PyMem_Free(sampler.groups);
+    sampler.groups = NULL;
+    PyMem_Free(sampler.group_counts);
+    sampler.group_counts = NULL;
+    sampler.capacity = 0;
+    sampler.count = 0;
+
+    if (sampler.trie.nodes != NULL) {
+        for (index=1; index < sampler.trie.nnode; index++)
+            Py_CLEAR(sampler.trie.nodes[index].code);
+    }
+    trie_free();
+}
+
+/* Start the sampler thread: take a sample of all threads of interp every
+   'interval' seconds and keep samples of the last 'duration' seconds.
+   If wall is zero, only take samples of running threads. If perf is
+   non-zero, use the perf backend: take a sample of each thread every
+   'interval' seconds of CPU time of the thread. If trie_size is not zero,
+   count also all samples in a trie of at most trie_size nodes. Restart the
+   sampler if it is already running: the active scopes are kept, and the
+   sampler is no longer stopped by the last scope.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+int
+_Py_SamplerStart(PyInterpreterState *interp, double interval, double duration,
+                 unsigned int trie_size, int wall, int perf)
+{
+    size_t capacity;
+
+    _Py_SamplerStop();
+
+    /* the root uses a node */
+    if (trie_size != 0 && trie_alloc(trie_size + 1) < 0)
+        return -1;
+
+    capacity = (size_t)(duration / interval + 0.5);
+    if (capacity < 1)
+        capacity = 1;
+    if (capacity > PY_SSIZE_T_MAX / sizeof(sample_t) / SAMPLER_MAX_THREADS) {
+        trie_free();
+        PyErr_SetString(PyExc_ValueError, "duration is too long");
+        return -1;
+    }
+    capacity *= SAMPLER_MAX_THREADS;
+
+    /* the hash table is at least twice larger than the ring */
+    sampler.groups_size = 1;
+    while (sampler.groups_size < capacity * 2)
+        sampler.groups_size *= 2;
+
+    sampler.samples = PyMem_Malloc(capacity * sizeof(sample_t));
+    sampler.groups = PyMem_Malloc(sampler.groups_size * sizeof(size_t));
+    sampler.group_counts = PyMem_Malloc(capacity * sizeof(size_t));
+    if (sampler.samples == NULL || sampler.groups == NULL
+        || sampler.group_counts == NULL) {
+        PyMem_Free(sampler.samples);
+        sampler.samples = NULL;
+        PyMem_Free(sampler.groups);
+        sampler.groups = NULL;
+        PyMem_Free(sampler.group_counts);
+        sampler.group_counts = NULL;
+        trie_free();
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(sampler.samples, 0, capacity * sizeof(sample_t));
+    sampler.capacity = capacity;
+    sampler.count = 0;
+    sampler.interp = interp;
+    sampler.interval = (PY_LONG_LONG)(interval * 1e6);
+    sampler.wall = wall;
+    sampler.perf = perf;
+    sampler.ncpu_time = 0;
+    sampler.nthread = 0;
+    sampler.nuntracked = 0;
+    sampler.untracked_samples = 0;
+    sampler.cancel = 0;
+    sampler.scope_owner = 0;
+
+#ifdef HAVE_PERF_SAMPLER
+    if (perf && _Py_PerfStart(interp, sampler.interval) < 0)
+        goto error;
+#else
+    if (perf) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "the perf backend is not available on this platform");
+        goto error;
+    }
+#endif
+
+    sampler.running_lock = PyThread_allocate_lock();
+    sampler.started_lock = PyThread_allocate_lock();
+    if (sampler.running_lock == NULL || sampler.started_lock == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "could not allocate lock");
+        goto error_locks;
+    }
+    PyThread_acquire_lock(sampler.running_lock, 1);
+    PyThread_acquire_lock(sampler.started_lock, 1);
+
+    PyEval_InitThreads();
+    if (PyThread_start_new_thread(sampler_thread, NULL) == -1) {
+        PyThread_release_lock(sampler.running_lock);
+        PyThread_release_lock(sampler.started_lock);
+        PyErr_SetString(PyExc_RuntimeError, "unable to start sampler thread");
+        goto error_locks;
+    }
+    /* the thread doesn't need the GIL to create its thread state */
+    PyThread_acquire_lock(sampler.started_lock, 1);
+    PyThread_release_lock(sampler.started_lock);
+    if (sampler.tstate == NULL) {
+        /* wait until the thread exits */
+        PyThread_acquire_lock(sampler.running_lock, 1);
+        PyThread_release_lock(sampler.running_lock);
+        PyErr_SetString(PyExc_RuntimeError,
+                        "unable to create the thread state of the sampler "
+                        "thread");
+        goto error_locks;
+    }
+    sampler.running = 1;
+#ifndef MS_WINDOWS
+    sampler.pid = getpid();
+#endif
+    return 0;
+
+error_locks:
+    if (sampler.running_lock != NULL) {
+        PyThread_free_lock(sampler.running_lock);
+        sampler.running_lock = NULL;
+    }
+    if (sampler.started_lock != NULL) {
+        PyThread_free_lock(sampler.started_lock);
+        sampler.started_lock = NULL;
+    }
+error:
+#ifdef HAVE_PERF_SAMPLER
+    _Py_PerfStop();
+#endif
+    PyMem_Free(sampler.samples);
+    sampler.samples = NULL;
+    PyMem_Free(sampler.groups);
+    sampler.groups = NULL;
+    PyMem_Free(sampler.group_counts);
+    sampler.group_counts = NULL;
+    sampler.capacity = 0;
+    trie_free();
+    return -1;
+}
+
+/* Add a scope: call visit(frames, nframe, state, label, 1, arg) on each
+   sample of the thread thread_id, or of all threads if thread_id is 0, until
+   _Py_SamplerRemoveScope(arg) is called. Start the sampler in the wall mode
+   with the interval *interval if it is not running, otherwise set *interval
+   to the interval of the running sampler.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+int
+_Py_SamplerAddScope(PyInterpreterState *interp, double *interval,
+                    long thread_id, _Py_SampleVisitor visit, void *arg)
+{
+    sampler_scope_t *scope;
+
+    if (sampler.nscope >= SAMPLER_MAX_SCOPES) {
+        PyErr_SetString(PyExc_RuntimeError, "too many sampling scopes");
+        return -1;
+    }
+
+    if (!sampler.running) {
+        if (_Py_SamplerStart(interp, *interval,
+                             *interval * SAMPLER_SCOPE_RING, 0, 1, 0) < 0)
+            return -1;
+        sampler.scope_owner = 1;
+    }
+    else
+        *interval = (double)sampler.interval / 1e6;
+
+    scope = &sampler.scopes[sampler.nscope];
+    scope->thread_id = thread_id;
+    scope->visit = visit;
+    scope->arg = arg;
+    sampler.nscope++;
+    return 0;
+}
+
+/* Remove the scope added by _Py_SamplerAddScope(). Stop the sampler if it
+   was started by a scope and it was the last scope.
+
+   Must be called with the GIL held. */
+void
+_Py_SamplerRemoveScope(void *arg)
+{
+    int i;
+
+    for (i=0; i < sampler.nscope; i++) {
+        if (sampler.scopes[i].arg == arg)
+            break;
+    }
+    if (i == sampler.nscope)
+        return;
+    sampler.nscope--;
+    memmove(&sampler.scopes[i], &sampler.scopes[i + 1],
+            (sampler.nscope - i) * sizeof(sampler_scope_t));
+
+    if (sampler.nscope == 0 && sampler.scope_owner) {
+        sampler.scope_owner = 0;
+        _Py_SamplerStop();
+    }
+}
+
+/* Return non-zero if a scope added by _Py_SamplerAddScope() is active */
+int
+_Py_SamplerHasScopes(void)
+{
+    return (sampler.nscope != 0);
+}
+
+/* Don't wait for the sampler thread: called by Py_AtExit(), too late to
+   release the GIL */
+void
+_Py_SamplerUnload(void)
+{
+    sampler.cancel = 1;
+}
+
+static int
+same_stack(sample_t *sample1, sample_t *sample2)
+{
+    int i;
+
+    if (sample1->nframe != sample2->nframe
+        || sample1->depth != sample2->depth
+        || sample1->state != sample2->state
+        || sample1->label != sample2->label)
+        return 0;
+    for (i=0; i < sample1->nframe; i++) {
+        if (sample1->frames[i].code != sample2->frames[i].code
+            || sample1->frames[i].lineno != sample2->frames[i].lineno)
+            return 0;
+    }
+    return 1;
+}
+
+/* Hash the stack, the state and the label of a sample.
+
+   This function is signal safe. */
+static size_t
+sample_hash(sample_t *sample)
+{
+    size_t hash;
+    int i;
+
+    hash = (size_t)sample->state;
+    hash = hash * 1000003 ^ (size_t)sample->label;
+    hash = hash * 1000003 ^ (size_t)sample->depth;
+    for (i=0; i < sample->nframe; i++) {
+        hash = hash * 1000003 ^ (size_t)sample->frames[i].code;
+        hash = hash * 1000003 ^ (size_t)sample->frames[i].lineno;
+    }
+    return hash;
+}
+
+/* Group identical stacks of the ring: set sampler.group_counts[k] to the
+   number of samples of the group if the sample first + k is the first of its
+   group, to 0 otherwise. Identical stacks are found with a hash table, so
+   the cost is linear in the number of samples. Set *p_first to the index of the oldest sample,
+   *p_nsample to the number of samples of the ring, *oldest and *newest to the
+   time of the oldest and newest samples. Return the number of samples.
+
+   This function is signal safe. */
+static size_t
+sampler_group(size_t *p_first, size_t *p_nsample,
+              PY_LONG_LONG *oldest, PY_LONG_LONG *newest)
+{
+    size_t count, nsample, first, k, j, total, index, mask;
+    size_t *groups, *group_counts;
+    sample_t *sample;
+
+    groups = sampler.groups;
+    group_counts = sampler.group_counts;
+    mask = sampler.groups_size - 1;
+    for (index=0; index < sampler.groups_size; index++)
+        groups[index] = 0;
+
+    count = sampler.count;
+    nsample = count;
+    if (nsample > sampler.capacity)
+        nsample = sampler.capacity;
+    first = count - nsample;
+
+    /* group_counts[k] is the number of samples of the group if the sample k
+       is the first of its group */
+    total = 0;
+    *oldest = *newest = 0;
+    for (k=0; k < nsample; k++) {
+        sample = &sampler.samples[(first + k) % sampler.capacity];
+        group_counts[k] = 0;
+        if (sample->seq != first + k + 1) {
+            /* sample being written */
+            continue;
+        }
+        if (total == 0 || sample->timestamp < *oldest)
+            *oldest = sample->timestamp;
+        if (total == 0 || sample->timestamp > *newest)
+            *newest = sample->timestamp;
+        total++;
+
+        /* the table is never full: it is twice larger than the ring */
+        index = sample_hash(sample) & mask;
+        while ((j = groups[index]) != 0) {
+            if (same_stack(sample, &sampler.samples[(first + j - 1)
+                                                    % sampler.capacity]))
+                break;
+            index = (index + 1) & mask;
+        }
+        if (j == 0) {
+            j = k + 1;
+            groups[index] = j;
+        }
+        group_counts[j - 1]++;
+    }
+
+    *p_first = first;
+    *p_nsample = nsample;
+    return total;
+}
+
+/* Write the samples of the ring into fd: identical stacks are grouped, the
+   most frequent stacks are written first. Do nothing if the sampler is not
+   running.
+
+   This function is signal safe. */
+void
+_Py_DumpSamples(int fd)
+{
+    size_t nsample, first, k, best, total;
+    size_t *group_counts;
+    sample_t *sample;
+    PY_LONG_LONG oldest, newest, span;
+    int i, nstack;
+
+    if (sampler.samples == NULL || !sampler_acquire_ring())
+        return;
+    group_counts = sampler.group_counts;
+    total = sampler_group(&first, &nsample, &oldest, &newest);
+
+    PUTS(fd, "\nSampler: ");
+    _Py_dump_decimal(fd, (unsigned long)total);
+    PUTS(fd, " samples in the last ");
+    span = newest - oldest;
+    _Py_dump_decimal(fd, (unsigned long)(span / 1000000));
+    PUTS(fd, ".");
+    _Py_dump_decimal(fd, (unsigned long)(span / 100000 % 10));
+    PUTS(fd, " seconds (most frequent stack first):\n");
+
+    for (nstack=0; ; nstack++) {
+        best = nsample;
+        for (k=0; k < nsample; k++) {
+            if (group_counts[k] != 0
+                && (best == nsample || group_counts[k] > group_counts[best]))
+                best = k;
+        }
+        if (best == nsample)
+            break;
+
+        if (nstack >= SAMPLER_MAX_STACKS) {
+            PUTS(fd, "\n...\n");
+            break;
+        }
+
+        sample = &sampler.samples[(first + best) % sampler.capacity];
+        PUTS(fd, "\n");
+        _Py_dump_decimal(fd, (unsigned long)group_counts[best]);
+        PUTS(fd, " samples (");
+        _Py_dump_decimal(fd, (unsigned long)(group_counts[best] * 100 / total));
+        PUTS(fd, "%, ");
+        PUTS(fd, _Py_SampleStateName(sample->state));
+        if (sample->label != 0) {
+            PUTS(fd, ", label ");
+            PUTS(fd, _Py_SampleLabelName(sample->label));
+        }
+        PUTS(fd, "):\n");
+        for (i=0; i < sample->nframe; i++) {
+            if (PyCode_Check(sample->frames[i].code))
+                _Py_DumpCodeLocation(fd,
+                                     (PyCodeObject *)sample->frames[i].code,
+                                     sample->frames[i].lineno);
+            else
+                _Py_DumpCFunction(fd, sample->frames[i].code);
+        }
+        if (sample->depth > sample->nframe) {
+            PUTS(fd, "  ... (");
+            _Py_dump_decimal(fd, (unsigned long)sample->depth);
+            PUTS(fd, " frames in total)\n");
+        }
+        group_counts[best] = 0;
+    }
+
+    sampler_release_ring();
+}
+
+/* Call visit(frames, nframe, state, label, count, arg) on each stack of the
+   trie. Samples counted in the overflow counters are visited as empty stacks
+   without label. */
+static int
+trie_visit(_Py_SampleVisitor visit, void *arg)
+{
+    sample_frame_t frames[SAMPLER_MAX_DEPTH];
+    trie_node_t *node;
+    unsigned int index, parent;
+    int nframe, state, label;
+
+    for (index=1; index < sampler.trie.nnode; index++) {
+        node = &sampler.trie.nodes[index];
+        if (node->count == 0)
+            continue;
+        /* most recent call first, up to the node of the thread state and
+           of the label */
+        nframe = 0;
+        for (parent=index; sampler.trie.nodes[parent].code != NULL;
+             parent = sampler.trie.nodes[parent].parent) {
+            frames[nframe].code = sampler.trie.nodes[parent].code;
+            frames[nframe].lineno = sampler.trie.nodes[parent].lineno;
+            nframe++;
+        }
+        state = sampler.trie.nodes[parent].lineno % _Py_SAMPLE_NSTATE;
+        label = sampler.trie.nodes[parent].lineno / _Py_SAMPLE_NSTATE;
+        if (visit(frames, nframe, state, label, node->count, arg) < 0)
+            return -1;
+    }
+    for (state=0; state < _Py_SAMPLE_NSTATE; state++) {
+        if (sampler.trie.overflow[state] == 0)
+            continue;
+        if (visit(frames, 0, state, 0, sampler.trie.overflow[state],
+                  arg) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Return non-zero if the sampler samples all threads (wall mode), zero if it
+   only samples running threads (cpu mode or perf backend) */
+int
+_Py_SamplerWall(void)
+{
+    return sampler.wall;
+}
+
+/* Call visit(frames, nframe, state, label, count, arg) on each distinct
+   stack, most recent call first, where state is the state of the thread,
+   label is its label (0 if none) and count is the number of samples of the
+   stack. Visit the stacks of the trie if it is
+   enabled, the stacks of the ring otherwise. Set *period to the sampling
+   interval before visiting the stacks, *oldest and *newest to the time of
+   the oldest and newest samples, in microseconds.
+
+   Must be called with the GIL held. Return 0 on success, 1 if the sampler is
+   not running, -1 if visit failed. */
+int
+_Py_SamplerVisit(_Py_SampleVisitor visit, void *arg, PY_LONG_LONG *period,
+                 PY_LONG_LONG *oldest, PY_LONG_LONG *newest)
+{
+    size_t nsample, first, k;
+    sample_t *sample;
+    int res;
+
+    if (sampler.samples == NULL || !sampler_acquire_ring())
+        return 1;
+    *period = sampler.interval;
+
+    if (sampler.trie.nodes != NULL) {
+        *oldest = sampler.trie.oldest;
+        *newest = sampler.trie.newest;
+        res = trie_visit(visit, arg);
+        sampler_release_ring();
+        return res;
+    }
+
+    (void)sampler_group(&first, &nsample, oldest, newest);
+
+    res = 0;
+    for (k=0; k < nsample; k++) {
+        if (sampler.group_counts[k] == 0)
+            continue;
+        sample = &sampler.samples[(first + k) % sampler.capacity];
+        if (visit(sample->frames, sample->nframe, sample->state,
+                  sample->label, sampler.group_counts[k], arg) < 0) {
+            res = -1;
+            break;
+        }
+    }
+
+    sampler_release_ring();
+    return res;
+}
+
+/* Call visit(thread_id, timestamp, state, label, frames, nframe, arg) on each
+   sample of the ring, oldest sample first, where frames are the frames of
+   the sample, most recent call first. Set *period to the sampling interval
+   in microseconds before visiting the samples.
+
+   Must be called with the GIL held. Return 0 on success, 1 if the sampler is
+   not running, -1 if visit failed. */
+int
+_Py_SamplerTimeline(_Py_SampleTimelineVisitor visit, void *arg,
+                    PY_LONG_LONG *period)
+{
+    size_t count, nsample, first, k;
+    sample_t *sample;
+    int res;
+
+    if (sampler.samples == NULL || !sampler_acquire_ring())
+        return 1;
+    *period = sampler.interval;
+
+    count = sampler.count;
+    nsample = count;
+    if (nsample > sampler.capacity)
+        nsample = sampler.capacity;
+    first = count - nsample;
+
+    res = 0;
+    for (k=0; k < nsample; k++) {
+        sample = &sampler.samples[(first + k) % sampler.capacity];
+        if (sample->seq != first + k + 1) {
+            /* sample being written */
+            continue;
+        }
+        if (visit(sample->thread_id, sample->timestamp, sample->state,
+                  sample->label, sample->frames, sample->nframe, arg) < 0) {
+            res = -1;
+            break;
+        }
+    }
+
+    sampler_release_ring();
+    return res;
+}
+
+/* Get the statistics of the threads sampled by the sampler thread: number of
+   threads sampled by the previous tick, number of these threads whose CPU
+   time was not tracked, and total number of samples of untracked threads.
+   The perf backend doesn't track the CPU time: all counters are zero.
+
+   Return 0 on success, 1 if the sampler is not running. */
+int
+_Py_SamplerThreadStats(size_t *nthread, size_t *nuntracked,
+                       size_t *untracked_samples)
+{
+    if (!sampler.running)
+        return 1;
+    *nthread = sampler.nthread;
+    *nuntracked = sampler.nuntracked;
+    *untracked_samples = sampler.untracked_samples;
+    return 0;
+}
+
+/* Get the statistics of the trie: number of used nodes, capacity (number of
+   nodes) and number of samples counted in the overflow counter.
+
+   Return 0 on success, 1 if the trie is disabled. */
+int
+_Py_SamplerTrieStats(size_t *nnode, size_t *capacity, size_t *overflow)
+{
+    int state;
+
+    if (sampler.trie.nodes == NULL)
+        return 1;
+    /* don't count the root */
+    *nnode = sampler.trie.nnode - 1;
+    *capacity = sampler.trie.capacity - 1;
+    *overflow = 0;
+    for (state=0; state < _Py_SAMPLE_NSTATE; state++)
+        *overflow += sampler.trie.overflow[state];
+    return 0;
+}
@@ -0,0 +1,323 @@
+/*
+ * Scoped sampling: the sampling() context manager aggregates the samples of
+ * the calling thread, or of all threads, taken by the sampler during a block.
+ *
+ * Scopes are reference counted by the sampler: the first scope starts the
+ * sampler if it is not running, the last scope stops it. Nested and
+ * concurrent scopes share the sampler thread and its interval. Each scope
+ * counts the distinct (stack, state, label) in a dictionary when the samples
+ * are taken, so the ring of the sampler doesn't limit the duration of a
+ * scope. The stacks are keyed with _Py_SampleCodeKey(): equal code objects
+ * can have different filenames, and builtin methods are not always hashable.
+ */
+
+#include "Python.h"
+#include "structmember.h"
+#include "frameobject.h"
+#include "faulthandler.h"
+
+#if PY_MAJOR_VERSION >= 3
+#  define PYINT_FROMSSIZE_T PyLong_FromSsize_t
+#  define PYINT_ASSSIZE_T PyLong_AsSsize_t
+#  define PYINT_ASLONG PyLong_AsLong
+#else
+#  define PYINT_FROMSSIZE_T PyInt_FromSsize_t
+#  define PYINT_ASSSIZE_T PyInt_AsSsize_t
+#  define PYINT_ASLONG PyInt_AsLong
+#endif
+
+typedef struct {
+    PyObject_HEAD
+    /* interval of the sampler in seconds */
+    double interval;
+    int all_threads;
+    /* non-zero between __enter__() and __exit__() */
+    int active;
+    /* (key, state, label) => [stack, number of samples], where stack is a tuple
+       of (code, lineno) tuples, most recent call first, and key is the
+       tuple of the (_Py_SampleCodeKey(code), lineno) tuples of the stack */
+    PyObject *counts;
+    Py_ssize_t total;
+    /* number of samples which could not be counted (error when the sample
+       was counted, ex: memory error) */
+    Py_ssize_t lost;
+} sampling_t;
+
+typedef struct {
+    Py_ssize_t count;
+    PyObject *item;   /* borrowed reference */
+} sampling_stack_t;
+
+/* Visitor of _Py_SamplerAddScope(): count a sample */
+static int
+sampling_visit(const _Py_SampleFrame *frames, int nframe, int state,
+               int label, size_t count, void *arg)
+{
+    sampling_t *self = arg;
+    PyObject *key_stack, *stack, *frame, *code_key, *key, *entry, *value;
+    int i, res;
+
+    self->total += count;
+
+    key_stack = PyTuple_New(nframe);
+    if (key_stack == NULL)
+        goto error;
+    for (i=0; i < nframe; i++) {
+        code_key = _Py_SampleCodeKey(frames[i].code);
+        if (code_key == NULL) {
+            Py_DECREF(key_stack);
+            goto error;
+        }
+        frame = Py_BuildValue("(Ni)", code_key, frames[i].lineno);
+        if (frame == NULL) {
+            Py_DECREF(key_stack);
+            goto error;
+        }
+        PyTuple_SET_ITEM(key_stack, i, frame);
+    }
+    key = Py_BuildValue("(Nii)", key_stack, state, label);
+    if (key == NULL)
+        goto error;
+
+    entry = PyDict_GetItem(self->counts, key);
+    if (entry != NULL) {
+        Py_DECREF(key);
+        value = PYINT_FROMSSIZE_T(PYINT_ASSSIZE_T(PyList_GET_ITEM(entry, 1))
+                                  + count);
+        if (value == NULL)
+            goto error;
+        /* PyList_SetItem() steals the reference */
+        if (PyList_SetItem(entry, 1, value) < 0)
+            goto error;
+        return 0;
+    }
+
+    /* new stack: the entry keeps the functions alive, so the addresses of
+       the key stay unique */
+    stack = PyTuple_New(nframe);
+    if (stack == NULL) {
+        Py_DECREF(key);
+        goto error;
+    }
+    for (i=0; i < nframe; i++) {
+        frame = Py_BuildValue("(Oi)", frames[i].code, frames[i].lineno);
+        if (frame == NULL) {
+            Py_DECREF(stack);
+            Py_DECREF(key);
+            goto error;
+        }
+        PyTuple_SET_ITEM(stack, i, frame);
+    }
+    entry = Py_BuildValue("[Nn]", stack, (Py_ssize_t)count);
+    if (entry == NULL) {
+        Py_DECREF(key);
+        goto error;
+    }
+    res = PyDict_SetItem(self->counts, key, entry);
+    Py_DECREF(key);
+    Py_DECREF(entry);
+    if (res < 0)
+        goto error;
+    return 0;
+
+error:
+    /* don't write an error from the sampler thread for each sample */
+    PyErr_Clear();
+    self->lost += count;
+    return 0;
+}
+
+static PyObject*
+sampling_enter(sampling_t *self)
+{
+    PyThreadState *tstate;
+    PyObject *counts;
+    long thread_id;
+
+    if (self->active) {
+        PyErr_SetString(PyExc_RuntimeError, "the scope is already active");
+        return NULL;
+    }
+
+    tstate = PyThreadState_Get();
+    thread_id = self->all_threads ? 0 : tstate->thread_id;
+
+    /* entering the scope again drops the previous results */
+    counts = PyDict_New();
+    if (counts == NULL)
+        return NULL;
+    Py_XDECREF(self->counts);
+    self->counts = counts;
+    self->total = 0;
+    self->lost = 0;
+
+    if (_Py_SamplerAddScope(tstate->interp, &self->interval, thread_id,
+                            sampling_visit, self) < 0)
+        return NULL;
+    /* the sampler holds a reference to the scope until __exit__() */
+    Py_INCREF(self);
+    self->active = 1;
+
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject*
+sampling_exit(sampling_t *self, PyObject *args)
+{
+    if (self->active) {
+        _Py_SamplerRemoveScope(self);
+        self->active = 0;
+        Py_DECREF(self);
+    }
+    /* don't swallow the exception */
+    Py_RETURN_FALSE;
+}
+
+/* Sort by number of samples, most samples first */
+static int
+sampling_stack_cmp(const void *a, const void *b)
+{
+    const sampling_stack_t *sa = a, *sb = b;
+    if (sa->count != sb->count)
+        return (sa->count < sb->count) ? 1 : -1;
+    return 0;
+}
+
+static PyObject*
+sampling_stacks(sampling_t *self)
+{
+    PyObject *list, *key, *entry, *value, *item;
+    sampling_stack_t *stacks;
+    Py_ssize_t pos, nstack, i;
+
+    if (self->counts == NULL)
+        return PyList_New(0);
+
+    nstack = PyDict_Size(self->counts);
+    stacks = PyMem_Malloc((nstack + 1) * sizeof(sampling_stack_t));
+    if (stacks == NULL)
+        return PyErr_NoMemory();
+    list = PyList_New(nstack);
+    if (list == NULL) {
+        PyMem_Free(stacks);
+        return NULL;
+    }
+
+    pos = 0;
+    i = 0;
+    while (PyDict_Next(self->counts, &pos, &key, &entry)) {
+        value = PyList_GET_ITEM(entry, 1);
+        /* "z": None if the stack has no label */
+        item = Py_BuildValue("(OszO)",
+                             PyList_GET_ITEM(entry, 0),
+                             _Py_SampleStateName(
+                                 PYINT_ASLONG(PyTuple_GET_ITEM(key, 1))),
+                             _Py_SampleLabelName(
+                                 PYINT_ASLONG(PyTuple_GET_ITEM(key, 2))),
+                             value);
+        if (item == NULL) {
+            for (; i > 0; i--)
+                Py_DECREF(stacks[i - 1].item);
+            PyMem_Free(stacks);
+            Py_DECREF(list);
+            return NULL;
+        }
+        stacks[i].count = PYINT_ASSSIZE_T(value);
+        stacks[i].item = item;
+        i++;
+    }
+
+    if (nstack != 0)
+        qsort(stacks, nstack, sizeof(sampling_stack_t), sampling_stack_cmp);
+    for (i=0; i < nstack; i++)
+        PyList_SET_ITEM(list, i, stacks[i].item);
+    PyMem_Free(stacks);
+    return list;
+}
+
+static void
+sampling_dealloc(sampling_t *self)
+{
+    Py_XDECREF(self->counts);
+    PyObject_Del(self);
+}
+
+static PyMethodDef sampling_methods[] = {
+    {"__enter__", (PyCFunction)sampling_enter, METH_NOARGS,
+     PyDoc_STR("start to count the samples of the scope")},
+    {"__exit__", (PyCFunction)sampling_exit, METH_VARARGS,
+     PyDoc_STR("stop to count the samples of the scope")},
+    {"stacks", (PyCFunction)sampling_stacks, METH_NOARGS,
+     PyDoc_STR("stacks()->list: (stack, state, label, count) of each "
+               "distinct stack, most samples first")},
+    {NULL, NULL}
+};
+
+static PyMemberDef sampling_members[] = {
+    {"interval", T_DOUBLE, offsetof(sampling_t, interval), READONLY,
+     "interval of the sampler in seconds"},
+    {"total", T_PYSSIZET, offsetof(sampling_t, total), READONLY,
+     "number of samples of the scope"},
+    {"lost", T_PYSSIZET, offsetof(sampling_t, lost), READONLY,
+     "number of samples which could not be counted"},
+    {NULL}
+};
+
+static PyTypeObject Sampling_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "faulthandler.Sampling",         /* tp_name */
+    sizeof(sampling_t),              /* tp_basicsize */
+    0,                               /* tp_itemsize */
+    (destructor)sampling_dealloc,    /* tp_dealloc */
+    0,                               /* tp_print */
+    0,                               /* tp_getattr */
+    0,                               /* tp_setattr */
+    0,                               /* tp_compare */
+    0,                               /* tp_repr */
+    0,                               /* tp_as_number */
+    0,                               /* tp_as_sequence */
+    0,                               /* tp_as_mapping */
+    0,                               /* tp_hash */
+    0,                               /* tp_call */
+    0,                               /* tp_str */
+    0,                               /* tp_getattro */
+    0,                               /* tp_setattro */
+    0,                               /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,              /* tp_flags */
+    "Samples of a scope of sampling()", /* tp_doc */
+    0,                               /* tp_traverse */
+    0,                               /* tp_clear */
+    0,                               /* tp_richcompare */
+    0,                               /* tp_weaklistoffset */
+    0,                               /* tp_iter */
+    0,                               /* tp_iternext */
+    sampling_methods,                /* tp_methods */
+    sampling_members,                /* tp_members */
+};
+
+/* Create a scope of sampling(): sample the current thread, or all threads if
+   all_threads is non-zero, every interval seconds between __enter__() and
+   __exit__().
+
+   Must be called with the GIL held. Raise an exception and return NULL on
+   error. */
+PyObject*
+_Py_SamplingNew(double interval, int all_threads)
+{
+    sampling_t *self;
+
+    if (PyType_Ready(&Sampling_Type) < 0)
+        return NULL;
+
+    self = PyObject_New(sampling_t, &Sampling_Type);
+    if (self == NULL)
+        return NULL;
+    self->interval = interval;
+    self->all_threads = all_threads;
+    self->active = 0;
+    self->counts = NULL;
+    self->total = 0;
+    self->lost = 0;
+    return (PyObject *)self;
+}
@@ -43,7 +43,9 @@ import sys
 from os.path import join as path_join
 from os.path import basename
 from os.path import dirname
+from os.path import exists
 from distutils.command.build import build
+from distutils.sysconfig import get_python_inc
 from setuptools import Command
 from setuptools import Extension
 from setuptools import setup
@@ -53,7 +55,9 @@ from setuptools.command.easy_install import easy_install
 
 VERSION = "3.2"
 
-FILES = ['faulthandler.c', 'traceback.c']
+FILES = ['faulthandler.c', 'traceback.c', 'sampler.c', 'shadowstack.c',
+         'pprof.c', 'chrometrace.c', 'hotlines.c', 'perf.c', 'sampling.c',
+         'collapsed.c']
 
 CLASSIFIERS = [
     'Development Status :: 5 - Production/Stable',
@@ -131,6 +135,33 @@ class GeneratePTH(Command):
                 )
 
 
+def find_greenlet_h():
+    """Find the directory of the greenlet.h header.
+
+    Only the greenlet 1.x header which exposes the top frame of greenlets is
+    supported. Return None if the header is not found.
+    """
+    version = 'python%s.%s' % sys.version_info[:2]
+    for path in (
+        path_join(get_python_inc(), 'greenlet'),
+        path_join(sys.prefix, 'include', 'site', version, 'greenlet'),
+        path_join(sys.exec_prefix, 'include', 'site', version, 'greenlet'),
+    ):
+        filename = path_join(path, 'greenlet.h')
+        if not exists(filename):
+            continue
+        with open(filename) as fp:
+            if 'top_frame' in fp.read():
+                return path
+    return None
+
+
+extension_options = {}
+greenlet_include = find_greenlet_h()
+if greenlet_include is not None:
+    extension_options['include_dirs'] = [greenlet_include]
+    extension_options['define_macros'] = [('HAVE_GREENLET_H', 1)]
+
 with open('README.rst') as f:
     long_description = f.read().strip()
 
@@ -143,8 +174,13 @@ options = {
     'url': "https://faulthandler.readthedocs.io/",
     'author': 'Victor Stinner',
     'author_email': 'victor.stinner@gmail.com',
-    'ext_modules': [Extension('faulthandler', FILES)],
+    'ext_modules': [Extension('faulthandler', FILES, **extension_options)],
     'classifiers': CLASSIFIERS,
+    'entry_points': {
+        'console_scripts': [
+            'faulthandler-merge = faulthandler:merge_main',
+        ],
+    },
     'cmdclass': {
         'build': BuildWithPTH,
         'easy_install': EasyInstallWithPTH,
@@ -0,0 +1,767 @@
+/*
+ * Shadow call stack: a C profile function maintains a compact array of the
+ * frames of each thread with the time when they were entered.
+ *
+ * The array of a thread is the profile object of the thread
+ * (tstate->c_profileobj), so readers find it from the thread state without
+ * lock. Readers check that the most recent entry is the current frame of the
+ * thread, and fall back to the f_back chain otherwise.
+ *
+ * The profile function also detects slow calls: on a return, if the frame was
+ * entered more than a threshold ago, the traceback of the thread is written.
+ * It can also record the duration of calls in a log histogram per code
+ * object, stored in a preallocated hash table.
+ *
+ * The builtin function called by the current frame (PyTrace_C_CALL event) is
+ * also recorded, so tracebacks and samples show the C function as the most
+ * recent frame.
+ */
+
+#include "Python.h"
+#include "frameobject.h"
+#include "faulthandler.h"
+
+#define PUTS(fd, str) _Py_write_noraise(fd, str, (int)strlen(str))
+
+/* Number of entries of the hash table of histograms, must be a power of 2 */
+#define HISTOGRAM_TABLE_SIZE 4096
+/* Maximum number of code objects in the hash table: keep the probe sequences
+   short */
+#define HISTOGRAM_MAX_USED (HISTOGRAM_TABLE_SIZE / 4 * 3)
+/* Bucket i counts durations in [2^(i-1); 2^i[ microseconds, bucket 0 counts
+   durations shorter than 1 microsecond */
+#define HISTOGRAM_NBUCKET 32
+
+typedef struct {
+    PyObject_HEAD
+    /* number of frames of the thread, can be greater than
+       _Py_SHADOW_STACK_SIZE: only the oldest frames are stored in this case */
+    unsigned int depth;
+    _Py_ShadowEntry entries[_Py_SHADOW_STACK_SIZE];
+    /* builtin function being called by c_frame (borrowed reference: the
+       function is kept alive by the caller during the call), or NULL */
+    PyObject *c_function;
+    PyFrameObject *c_frame;
+} shadow_stack_t;
+
+static struct {
+    int enabled;
+    PyObject *file;
+    int fd;
+    /* durations in microseconds */
+    PY_LONG_LONG threshold;
+    PY_LONG_LONG interval;
+    PyObject *filter;
+    /* time of the last report (monotonic clock), 0 if no report was written
+       yet */
+    PY_LONG_LONG last_report;
+    /* number of slow calls not reported because of the interval */
+    unsigned long skipped;
+} slow_calls = {0, NULL, -1};
+
+typedef struct {
+    /* strong reference, NULL if the entry is unused */
+    PyCodeObject *code;
+    unsigned long count;
+    /* total duration in microseconds */
+    PY_LONG_LONG total;
+    unsigned long buckets[HISTOGRAM_NBUCKET];
+} histogram_t;
+
+static struct {
+    int enabled;
+    histogram_t *table;
+    unsigned int used;
+    /* number of calls not recorded because the table is full */
+    unsigned long dropped;
+} histograms = {0, NULL, 0, 0};
+
+/* The shadow stack was enabled by _Py_ShadowStackEnable(). Otherwise, it is
+   enabled as long as slow calls are watched or histograms are recorded. */
+static int shadow_stack_enabled = 0;
+
+static void
+shadow_stack_dealloc(shadow_stack_t *self)
+{
+    PyObject_Del(self);
+}
+
+static PyTypeObject ShadowStack_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "faulthandler.ShadowStack",      /* tp_name */
+    sizeof(shadow_stack_t),          /* tp_basicsize */
+    0,                               /* tp_itemsize */
+    (destructor)shadow_stack_dealloc, /* tp_dealloc */
+    0,                               /* tp_print */
+    0,                               /* tp_getattr */
+    0,                               /* tp_setattr */
+    0,                               /* tp_compare */
+    0,                               /* tp_repr */
+    0,                               /* tp_as_number */
+    0,                               /* tp_as_sequence */
+    0,                               /* tp_as_mapping */
+    0,                               /* tp_hash */
+    0,                               /* tp_call */
+    0,                               /* tp_str */
+    0,                               /* tp_getattro */
+    0,                               /* tp_setattro */
+    0,                               /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,              /* tp_flags */
+    "Shadow call stack of a thread", /* tp_doc */
+};
+
+/* Call the filter of slow calls with the code object: return 1 if the call
+   must be reported, 0 otherwise. Errors are written to stderr and ignored. */
+static int
+slow_call_filter(PyCodeObject *code)
+{
+    PyObject *filter, *res;
+    int report;
+
+    /* the filter can call unwatch_slow_calls() */
+    filter = slow_calls.filter;
+    Py_INCREF(filter);
+    res = PyObject_CallFunctionObjArgs(filter, (PyObject *)code, NULL);
+    if (res != NULL) {
+        report = PyObject_IsTrue(res);
+        Py_DECREF(res);
+    }
+    else
+        report = -1;
+    if (report < 0) {
+        PyErr_WriteUnraisable(filter);
+        report = 0;
+    }
+    Py_DECREF(filter);
+    return report;
+}
+
+/* Write a slow call: "Slow call (xxx ms)!" and the traceback of the thread,
+   the slow frame is the most recent frame. At most one call is written per
+   interval. */
+static void
+slow_call_report(PyThreadState *tstate, PyFrameObject *frame,
+                 PY_LONG_LONG now, PY_LONG_LONG duration)
+{
+    if (slow_calls.last_report != 0
+        && now - slow_calls.last_report < slow_calls.interval) {
+        slow_calls.skipped++;
+        return;
+    }
+
+    if (slow_calls.filter != NULL && !slow_call_filter(frame->f_code))
+        return;
+    /* the filter can call unwatch_slow_calls() */
+    if (!slow_calls.enabled)
+        return;
+
+    slow_calls.last_report = now;
+    PUTS(slow_calls.fd, "Slow call (");
+    _Py_dump_decimal(slow_calls.fd, (unsigned long)(duration / 1000));
+    PUTS(slow_calls.fd, " ms)!\n");
+    if (slow_calls.skipped != 0) {
+        _Py_dump_decimal(slow_calls.fd, slow_calls.skipped);
+        PUTS(slow_calls.fd, " slow calls skipped\n");
+        slow_calls.skipped = 0;
+    }
+    _Py_DumpTraceback(slow_calls.fd, tstate, 0);
+}
+
+/* Add a call of duration microseconds to the histogram of code.
+   Allocate no memory. */
+static void
+histogram_add(PyCodeObject *code, PY_LONG_LONG duration)
+{
+    histogram_t *hist;
+    size_t index;
+    unsigned int bucket;
+
+    index = ((size_t)code >> 4) & (HISTOGRAM_TABLE_SIZE - 1);
+    while (1) {
+        hist = &histograms.table[index];
+        if (hist->code == code)
+            break;
+        if (hist->code == NULL) {
+            if (histograms.used >= HISTOGRAM_MAX_USED) {
+                histograms.dropped++;
+                return;
+            }
+            Py_INCREF(code);
+            hist->code = code;
+            histograms.used++;
+            break;
+        }
+        index = (index + 1) & (HISTOGRAM_TABLE_SIZE - 1);
+    }
+
+    if (duration < 0)
+        duration = 0;
+    bucket = 0;
+    while (bucket < HISTOGRAM_NBUCKET - 1 && (duration >> bucket) != 0)
+        bucket++;
+    hist->count++;
+    hist->total += duration;
+    hist->buckets[bucket]++;
+}
+
+/* Stop recording histograms and clear them */
+static void
+histograms_clear(void)
+{
+    histogram_t *table;
+    size_t i;
+
+    if (!histograms.enabled)
+        return;
+    histograms.enabled = 0;
+
+    table = histograms.table;
+    histograms.table = NULL;
+    for (i=0; i < HISTOGRAM_TABLE_SIZE; i++)
+        Py_XDECREF(table[i].code);
+    PyMem_Free(table);
+}
+
+/* Profile function: push the frame on a call, pop it on a return. The builtin
+   function being called by the current frame is remembered until it returns:
+   see _Py_GetShadowCFunction(). */
+static int
+shadow_profile(PyObject *obj, PyFrameObject *frame, int what, PyObject *arg)
+{
+    shadow_stack_t *stack = (shadow_stack_t *)obj;
+    _Py_ShadowEntry *entry;
+    PY_LONG_LONG now;
+
+    switch (what) {
+    case PyTrace_CALL:
+        if (stack->depth < _Py_SHADOW_STACK_SIZE) {
+            entry = &stack->entries[stack->depth];
+            entry->frame = frame;
+            entry->code = frame->f_code;
+            entry->timestamp = _Py_monotonic();
+        }
+        stack->depth++;
+        break;
+
+    case PyTrace_RETURN:
+        /* frames entered before the shadow stack was installed are not
+           counted */
+        if (stack->depth == 0)
+            break;
+        if ((slow_calls.enabled || histograms.enabled)
+            && stack->depth <= _Py_SHADOW_STACK_SIZE) {
+            entry = &stack->entries[stack->depth - 1];
+            if (entry->frame == frame) {
+                now = _Py_monotonic();
+                if (histograms.enabled)
+                    histogram_add(entry->code, now - entry->timestamp);
+                if (slow_calls.enabled
+                    && now - entry->timestamp >= slow_calls.threshold) {
+                    /* the filter is Python code: it can uninstall the
+                       shadow stack (unwatch_slow_calls(),
+                       sys.setprofile(), etc.) which destroys it */
+                    Py_INCREF(stack);
+                    slow_call_report(PyThreadState_GET(), frame, now,
+                                     now - entry->timestamp);
+                    stack->depth--;
+                    Py_DECREF(stack);
+                    break;
+                }
+            }
+        }
+        stack->depth--;
+        break;
+
+    case PyTrace_C_CALL:
+        stack->c_function = arg;
+        stack->c_frame = frame;
+        break;
+
+    case PyTrace_C_RETURN:
+    case PyTrace_C_EXCEPTION:
+        if (stack->c_function == arg)
+            stack->c_function = NULL;
+        break;
+    }
+    return 0;
+}
+
+/* Install the profile function on a thread. The shadow stack is initialized
+   from the current frames of the thread: their entry time is unknown, the
+   current time is used.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+static int
+shadow_stack_install(PyThreadState *tstate)
+{
+    shadow_stack_t *stack;
+    _Py_ShadowEntry *entry;
+    PyFrameObject *frame;
+    PyObject *old;
+    PY_LONG_LONG now;
+    unsigned int depth, i;
+
+    if (tstate->c_profilefunc == shadow_profile)
+        return 0;
+
+    stack = PyObject_New(shadow_stack_t, &ShadowStack_Type);
+    if (stack == NULL)
+        return -1;
+
+    /* the frame chain starts at the most recent frame, whereas the entries
+       start at the oldest frame */
+    now = _Py_monotonic();
+    depth = _Py_CountFrames(tstate->frame, 0);
+    frame = tstate->frame;
+    for (i=depth; i != 0 && frame != NULL; i--) {
+        /* i - 1 is the index of frame in the stack */
+        if (i - 1 < _Py_SHADOW_STACK_SIZE) {
+            entry = &stack->entries[i - 1];
+            entry->frame = frame;
+            entry->code = frame->f_code;
+            entry->timestamp = now;
+        }
+        frame = frame->f_back;
+    }
+    stack->depth = depth;
+    stack->c_function = NULL;
+    stack->c_frame = NULL;
+
+    /* Code of PyEval_SetProfile() applied to any thread */
+    old = tstate->c_profileobj;
+    tstate->c_profilefunc = NULL;
+    tstate->c_profileobj = NULL;
+    /* Must make sure that profiling is not ignored if 'old' is freed */
+    tstate->use_tracing = (tstate->c_tracefunc != NULL);
+    Py_XDECREF(old);
+    tstate->c_profilefunc = shadow_profile;
+    tstate->c_profileobj = (PyObject *)stack;
+    tstate->use_tracing = 1;
+    return 0;
+}
+
+/* Uninstall the profile function from a thread.
+
+   Must be called with the GIL held. */
+static void
+shadow_stack_uninstall(PyThreadState *tstate)
+{
+    PyObject *old;
+
+    if (tstate->c_profilefunc != shadow_profile)
+        return;
+
+    old = tstate->c_profileobj;
+    tstate->c_profilefunc = NULL;
+    tstate->c_profileobj = NULL;
+    tstate->use_tracing = (tstate->c_tracefunc != NULL);
+    Py_XDECREF(old);
+}
+
+/* Profile function installed by threading.setprofile(): called once in each
+   new thread, it replaces itself with the C profile function. */
+static PyObject*
+shadow_stack_thread_hook(PyObject *self, PyObject *args)
+{
+    PyThreadState *tstate = PyThreadState_GET();
+
+    if (shadow_stack_install(tstate) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef shadow_stack_thread_hook_def = {
+    "_shadow_stack_thread_hook",
+    (PyCFunction)shadow_stack_thread_hook, METH_VARARGS, NULL};
+
+/* Call threading.setprofile(func). func can be None. */
+static int
+shadow_stack_set_thread_hook(PyObject *func)
+{
+    PyObject *threading, *res;
+
+    threading = PyImport_ImportModule("threading");
+    if (threading == NULL)
+        return -1;
+    res = PyObject_CallMethod(threading, "setprofile", "O", func);
+    Py_DECREF(threading);
+    if (res == NULL)
+        return -1;
+    Py_DECREF(res);
+    return 0;
+}
+
+/* Install the shadow stack on all threads of the interpreter, and on threads
+   created later by the threading module.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+static int
+shadow_stack_enable(PyInterpreterState *interp)
+{
+    PyThreadState *tstate;
+    PyObject *hook;
+    int res;
+
+    if (PyType_Ready(&ShadowStack_Type) < 0)
+        return -1;
+
+    for (tstate = PyInterpreterState_ThreadHead(interp);
+         tstate != NULL;
+         tstate = PyThreadState_Next(tstate))
+    {
+        if (shadow_stack_install(tstate) < 0)
+            return -1;
+    }
+
+    hook = PyCFunction_New(&shadow_stack_thread_hook_def, NULL);
+    if (hook == NULL)
+        return -1;
+    res = shadow_stack_set_thread_hook(hook);
+    Py_DECREF(hook);
+    return res;
+}
+
+/* Uninstall the shadow stack from all threads of the interpreter.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+static int
+shadow_stack_disable(PyInterpreterState *interp)
+{
+    PyThreadState *tstate;
+
+    for (tstate = PyInterpreterState_ThreadHead(interp);
+         tstate != NULL;
+         tstate = PyThreadState_Next(tstate))
+    {
+        shadow_stack_uninstall(tstate);
+    }
+    return shadow_stack_set_thread_hook(Py_None);
+}
+
+/* Uninstall the shadow stack if it is no more used.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+static int
+shadow_stack_release(void)
+{
+    if (shadow_stack_enabled || slow_calls.enabled || histograms.enabled)
+        return 0;
+    return shadow_stack_disable(PyThreadState_GET()->interp);
+}
+
+/* Install the shadow stack on all threads of the interpreter, and on threads
+   created later by the threading module.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+int
+_Py_ShadowStackEnable(PyInterpreterState *interp)
+{
+    if (shadow_stack_enable(interp) < 0)
+        return -1;
+    shadow_stack_enabled = 1;
+    return 0;
+}
+
+/* Disable the shadow stack enabled by _Py_ShadowStackEnable(). It is
+   uninstalled from all threads if slow calls are not watched and histograms
+   are not recorded.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+int
+_Py_ShadowStackDisable(void)
+{
+    shadow_stack_enabled = 0;
+    return shadow_stack_release();
+}
+
+/* Get the shadow stack of a thread: set *entries to the array of entries,
+   oldest frame first, and return the number of entries. Return 0 if the
+   thread has no shadow stack, if the stack is deeper than
+   _Py_SHADOW_STACK_SIZE frames, or if the shadow stack doesn't match the
+   current frame of the thread.
+
+   This function is signal safe. */
+unsigned int
+_Py_GetShadowStack(PyThreadState *tstate, _Py_ShadowEntry **entries)
+{
+    shadow_stack_t *stack;
+    unsigned int depth;
+
+    if (tstate->c_profilefunc != shadow_profile)
+        return 0;
+    stack = (shadow_stack_t *)tstate->c_profileobj;
+    if (stack == NULL)
+        return 0;
+    depth = stack->depth;
+    if (depth == 0 || depth > _Py_SHADOW_STACK_SIZE)
+        return 0;
+    if (stack->entries[depth - 1].frame != tstate->frame)
+        return 0;
+    *entries = stack->entries;
+    return depth;
+}
+
+/* Get the builtin function being called by the current frame of a thread:
+   borrowed reference, or NULL if the thread is not calling a builtin function
+   or has no shadow stack.
+
+   This function is signal safe. */
+PyObject*
+_Py_GetShadowCFunction(PyThreadState *tstate)
+{
+    shadow_stack_t *stack;
+
+    if (tstate->c_profilefunc != shadow_profile)
+        return NULL;
+    stack = (shadow_stack_t *)tstate->c_profileobj;
+    if (stack == NULL || stack->c_function == NULL)
+        return NULL;
+    /* the builtin function called a Python function */
+    if (stack->c_frame != tstate->frame)
+        return NULL;
+    return stack->c_function;
+}
+
+/* Get the name of a builtin function: "module.function", "type.method" or
+   "function". Raise an exception and return NULL on error. */
+PyObject*
+_Py_CFunctionName(PyObject *func)
+{
+    PyCFunctionObject *cfunc;
+    PyObject *module, *name;
+    const char *prefix;
+
+    if (!PyCFunction_Check(func))
+        return PyObject_Repr(func);
+    cfunc = (PyCFunctionObject *)func;
+
+    prefix = NULL;
+    module = cfunc->m_module;
+#if PY_MAJOR_VERSION >= 3
+    if (module != NULL && PyUnicode_Check(module))
+        return PyUnicode_FromFormat("%U.%s", module, cfunc->m_ml->ml_name);
+#else
+    if (module != NULL && PyString_Check(module))
+        prefix = PyString_AS_STRING(module);
+#endif
+    if (prefix == NULL && cfunc->m_self != NULL && !PyModule_Check(cfunc->m_self))
+        prefix = Py_TYPE(cfunc->m_self)->tp_name;
+
+#if PY_MAJOR_VERSION >= 3
+    if (prefix != NULL)
+        name = PyUnicode_FromFormat("%s.%s", prefix, cfunc->m_ml->ml_name);
+    else
+        name = PyUnicode_FromString(cfunc->m_ml->ml_name);
+#else
+    if (prefix != NULL)
+        name = PyString_FromFormat("%s.%s", prefix, cfunc->m_ml->ml_name);
+    else
+        name = PyString_FromString(cfunc->m_ml->ml_name);
+#endif
+    return name;
+}
+
+/* Write the traceback of calls longer than threshold microseconds into the
+   file fd, at most one call every interval microseconds. If filter is not
+   NULL, it is called with the code object of a slow call: the call is only
+   written if the filter returns true. Enable the shadow stack if needed.
+
+   file and filter are strong references stolen by this function, file can be
+   NULL.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+int
+_Py_WatchSlowCalls(PyInterpreterState *interp, PyObject *file, int fd,
+                   PY_LONG_LONG threshold, PY_LONG_LONG interval,
+                   PyObject *filter)
+{
+    if (shadow_stack_enable(interp) < 0) {
+        Py_XDECREF(file);
+        Py_XDECREF(filter);
+        return -1;
+    }
+
+    Py_XDECREF(slow_calls.file);
+    Py_XDECREF(slow_calls.filter);
+    slow_calls.file = file;
+    slow_calls.fd = fd;
+    slow_calls.threshold = threshold;
+    slow_calls.interval = interval;
+    slow_calls.filter = filter;
+    slow_calls.last_report = 0;
+    slow_calls.skipped = 0;
+    slow_calls.enabled = 1;
+    return 0;
+}
+
+/* Stop watching slow calls. Disable the shadow stack if it is no more used.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+int
+_Py_UnwatchSlowCalls(void)
+{
+    if (!slow_calls.enabled)
+        return 0;
+    slow_calls.enabled = 0;
+    Py_CLEAR(slow_calls.file);
+    Py_CLEAR(slow_calls.filter);
+    return shadow_stack_release();
+}
+
+/* Record the duration of calls in a histogram per code object. Enable the
+   shadow stack if needed.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+int
+_Py_HistogramsEnable(PyInterpreterState *interp)
+{
+    if (histograms.enabled)
+        return 0;
+
+    histograms.table = PyMem_Malloc(HISTOGRAM_TABLE_SIZE
+                                    * sizeof(histogram_t));
+    if (histograms.table == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(histograms.table, 0, HISTOGRAM_TABLE_SIZE * sizeof(histogram_t));
+    histograms.used = 0;
+    histograms.dropped = 0;
+
+    if (shadow_stack_enable(interp) < 0) {
+        PyMem_Free(histograms.table);
+        histograms.table = NULL;
+        return -1;
+    }
+    histograms.enabled = 1;
+    return 0;
+}
+
+/* Stop recording histograms and clear them. Disable the shadow stack if it
+   is no more used.
+
+   Must be called with the GIL held. Return 0 on success, raise an exception
+   and return -1 on error. */
+int
+_Py_HistogramsDisable(void)
+{
+    if (!histograms.enabled)
+        return 0;
+    histograms_clear();
+    return shadow_stack_release();
+}
+
+typedef struct {
+    histogram_t *hist;
+    /* 99th percentile in microseconds */
+    PY_LONG_LONG p99;
+} histogram_stat_t;
+
+/* Get the 99th percentile of a histogram: upper bound of the bucket
+   containing the 99th percentile, in microseconds */
+static PY_LONG_LONG
+histogram_p99(histogram_t *hist)
+{
+    unsigned long rank, count;
+    unsigned int bucket;
+
+    /* rank = ceil(count * 0.99) */
+    rank = hist->count - hist->count / 100;
+    count = 0;
+    for (bucket=0; bucket < HISTOGRAM_NBUCKET - 1; bucket++) {
+        count += hist->buckets[bucket];
+        if (count >= rank)
+            break;
+    }
+    return (PY_LONG_LONG)1 << bucket;
+}
+
+static int
+histogram_cmp_total(const void *a, const void *b)
+{
+    const histogram_stat_t *sa = a, *sb = b;
+    if (sa->hist->total != sb->hist->total)
+        return (sa->hist->total < sb->hist->total) ? 1 : -1;
+    if (sa->p99 != sb->p99)
+        return (sa->p99 < sb->p99) ? 1 : -1;
+    return 0;
+}
+
+static int
+histogram_cmp_p99(const void *a, const void *b)
+{
+    const histogram_stat_t *sa = a, *sb = b;
+    if (sa->p99 != sb->p99)
+        return (sa->p99 < sb->p99) ? 1 : -1;
+    if (sa->hist->total != sb->hist->total)
+        return (sa->hist->total < sb->hist->total) ? 1 : -1;
+    return 0;
+}
+
+/* Get the top histograms sorted by total duration (by_p99=0) or by 99th
+   percentile (by_p99=1): list of (code, calls, total, p99) tuples where the
+   durations are in seconds. Return None if histograms are not recorded.
+
+   Must be called with the GIL held. Raise an exception and return NULL on
+   error. */
+PyObject*
+_Py_GetHistograms(Py_ssize_t top, int by_p99)
+{
+    histogram_stat_t *stats;
+    histogram_t *hist;
+    Py_ssize_t nstat, i;
+    PyObject *list, *item;
+
+    if (!histograms.enabled)
+        Py_RETURN_NONE;
+
+    stats = PyMem_Malloc(HISTOGRAM_MAX_USED * sizeof(histogram_stat_t));
+    if (stats == NULL)
+        return PyErr_NoMemory();
+
+    nstat = 0;
+    for (i=0; i < HISTOGRAM_TABLE_SIZE; i++) {
+        hist = &histograms.table[i];
+        if (hist->code == NULL)
+            continue;
+        stats[nstat].hist = hist;
+        stats[nstat].p99 = histogram_p99(hist);
+        nstat++;
+    }
+    qsort(stats, nstat, sizeof(histogram_stat_t),
+          by_p99 ? histogram_cmp_p99 : histogram_cmp_total);
+    if (top < nstat)
+        nstat = top;
+
+    list = PyList_New(nstat);
+    if (list == NULL)
+        goto error;
+    for (i=0; i < nstat; i++) {
+        hist = stats[i].hist;
+        item = Py_BuildValue("(Okdd)",
+                             (PyObject *)hist->code,
+                             hist->count,
+                             hist->total * 1e-6,
+                             stats[i].p99 * 1e-6);
+        if (item == NULL) {
+            Py_DECREF(list);
+            goto error;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    PyMem_Free(stats);
+    return list;
+
+error:
+    PyMem_Free(stats);
+    return NULL;
+}
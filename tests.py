@@ -17,6 +17,11 @@ try:
 except ImportError:
     HAVE_THREADS = False
 
+try:
+    import ctypes
+except ImportError:
+    ctypes = None
+
 TIMEOUT = 1
 MS_WINDOWS = (os.name == 'nt')
 
@@ -121,6 +126,41 @@ else:
         except (ValueError, resource_error):
             pass
 
+def greenlet_supported():
+    try:
+        import greenlet
+    except ImportError:
+        return False
+    try:
+        with open(os.devnull, 'w') as fp:
+            faulthandler.dump_traceback(fp, all_threads=False, greenlets=True)
+    except RuntimeError:
+        # faulthandler was built without greenlet support
+        return False
+    return True
+
+_perf_supported = None
+
+def perf_supported():
+    # probe in a child process: starting the perf backend installs a signal
+    # handler and opens an event for each thread of the test runner
+    global _perf_supported
+    if _perf_supported is None:
+        code = dedent("""
+            import faulthandler
+            import sys
+            try:
+                faulthandler.start_sampler(backend='perf')
+            except (OSError, RuntimeError):
+                # not Linux, or perf_event_open() is not allowed
+                sys.exit(1)
+            faulthandler.stop_sampler()
+            """)
+        process = spawn_python('-c', code)
+        process.communicate()
+        _perf_supported = (process.returncode == 0)
+    return _perf_supported
+
 def spawn_python(*args, **kwargs):
     args = (sys.executable,) + args
     return subprocess.Popen(args,
@@ -498,6 +538,202 @@ class FaultHandlerTests(unittest.TestCase):
         with temporary_filename() as filename:
             self.check_dump_traceback(filename)
 
+    def test_dump_traceback_exceptions(self):
+        code = """
+            import faulthandler
+
+            def func():
+                try:
+                    raise ValueError('bad value')
+                except ValueError:
+                    faulthandler.dump_traceback(all_threads=False, exceptions=True)
+
+            func()
+            """
+        expected = [
+            'Stack (most recent call first):',
+            '  Handled exception: exceptions.ValueError: bad value',
+            '  File "<string>", line 7 in func',
+            '  File "<string>", line 9 in <module>'
+        ]
+        trace, exitcode = self.get_output(code)
+        self.assertEqual(trace, expected)
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(sys.version_info >= (3,), 'need old-style classes')
+    def test_dump_traceback_exceptions_old_style(self):
+        # an instance of an old-style class has no message
+        code = """
+            import faulthandler
+
+            class OldError:
+                args = ('bad value',)
+
+            try:
+                raise OldError()
+            except OldError:
+                faulthandler.dump_traceback(all_threads=False, exceptions=True)
+            """
+        expected = [
+            'Stack (most recent call first):',
+            '  Handled exception: OldError',
+            '  File "<string>", line 9 in <module>'
+        ]
+        trace, exitcode = self.get_output(code)
+        self.assertEqual(trace, expected)
+        self.assertEqual(exitcode, 0)
+
+    def test_dump_traceback_opcodes(self):
+        code = """
+            import faulthandler
+
+            def func():
+                faulthandler.dump_traceback(all_threads=False, opcodes=True)
+
+            func()
+            """
+        trace, exitcode = self.get_output(code)
+        self.assertEqual(len(trace), 3)
+        self.assertEqual(trace[0], 'Stack (most recent call first):')
+        regex = (r'^  File "<string>", line 4 in func '
+                 r'\(code 0x[0-9a-f]+, first line 3, offset [0-9]+: '
+                 r'CALL_FUNCTION\)$')
+        self.assertRegex(trace[1], regex)
+        regex = (r'^  File "<string>", line 6 in <module> '
+                 r'\(code 0x[0-9a-f]+, first line 1, offset [0-9]+: '
+                 r'CALL_FUNCTION\)$')
+        self.assertRegex(trace[2], regex)
+        self.assertEqual(exitcode, 0)
+
+    def test_dump_traceback_locals(self):
+        code = """
+            import faulthandler
+
+            def func(url, size, ratio=0.5, data=None):
+                items = [1, 2]
+                faulthandler.dump_traceback(all_threads=False, locals=10)
+
+            func('http://example.com/', -3)
+            """
+        expected = [
+            'Stack (most recent call first):',
+            '  File "<string>", line 5 in func',
+            "    url = 'http://exa...'",
+            '    size = -3',
+            '    ratio = 0.5',
+            '    data = None',
+            '    items = <list>',
+            '  File "<string>", line 7 in <module>'
+        ]
+        trace, exitcode = self.get_output(code)
+        self.assertEqual(trace, expected)
+        self.assertEqual(exitcode, 0)
+
+        code = """
+            import faulthandler
+            faulthandler.dump_traceback(locals=-1)
+            """
+        output, exitcode = self.get_output(code)
+        self.assertNotEqual(exitcode, 0)
+        self.assertIn('ValueError: locals must be greater than or equal to 0',
+                      output[-1])
+
+    def test_dump_traceback_depth(self):
+        code = """
+            import faulthandler
+
+            def recurse(n):
+                if n:
+                    return recurse(n - 1)
+                print(sorted(faulthandler.stack_depths().values())[-1])
+                faulthandler.dump_traceback(all_threads=False)
+
+            recurse(150)
+            """
+        trace, exitcode = self.get_output(code)
+        self.assertEqual(trace[0], '152')
+        self.assertEqual(len(trace), 2 + 100 + 1)
+        self.assertEqual(trace[-1], '  ... (152 frames in total)')
+        self.assertEqual(exitcode, 0)
+
+    def test_dump_traceback_generators(self):
+        code = """
+            import faulthandler
+
+            def worker():
+                while True:
+                    yield
+
+            gen = worker()
+            next(gen)
+            faulthandler.dump_traceback(all_threads=False, generators=True)
+            """
+        expected = [
+            'Stack (most recent call first):',
+            '  File "<string>", line 9 in <module>',
+            '',
+            'Suspended generator (most recent call first):',
+            '  File "<string>", line 5 in worker'
+        ]
+        trace, exitcode = self.get_output(code)
+        self.assertEqual(trace, expected)
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not greenlet_supported(), 'need greenlet support')
+    def test_dump_traceback_greenlets(self):
+        code = """
+            import faulthandler
+            import greenlet
+
+            def worker():
+                greenlet.getcurrent().parent.switch()
+
+            workers = [greenlet.greenlet(worker) for index in range(3)]
+            for gr in workers:
+                gr.switch()
+            faulthandler.dump_traceback(all_threads=False, greenlets=True)
+            """
+        expected = [
+            'Stack (most recent call first):',
+            '  File "<string>", line 10 in <module>',
+            '',
+            '3 suspended greenlet(s) (most recent call first):',
+            '  File "<string>", line 5 in worker'
+        ]
+        trace, exitcode = self.get_output(code)
+        self.assertEqual(trace, expected)
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(ctypes is None, 'need ctypes')
+    def test_dump_traceback_all_interpreters(self):
+        self.assertRaises(ValueError, faulthandler.dump_traceback,
+                          all_threads=False, all_interpreters=True)
+        code = """
+            import ctypes
+            import faulthandler
+
+            api = ctypes.pythonapi
+            api.PyThreadState_Get.restype = ctypes.c_void_p
+            api.Py_NewInterpreter.restype = ctypes.c_void_p
+            api.PyThreadState_Swap.restype = ctypes.c_void_p
+            api.PyThreadState_Swap.argtypes = [ctypes.c_void_p]
+            main = api.PyThreadState_Get()
+            sub = api.Py_NewInterpreter()
+            api.PyThreadState_Swap(main)
+            faulthandler.dump_traceback(all_interpreters=True)
+            """
+        trace, exitcode = self.get_output(code)
+        self.assertEqual(len(trace), 6)
+        self.assertRegex(trace[0], r'^Interpreter 0x[0-9a-f]+:$')
+        self.assertRegex(trace[1],
+                         r'^Thread 0x[0-9a-f]+.*\(most recent call first\):$')
+        self.assertEqual(trace[2], '')
+        self.assertRegex(trace[3], r'^Interpreter 0x[0-9a-f]+ \(current\):$')
+        self.assertRegex(trace[4],
+                         r'^Current thread XXX.*\(most recent call first\):$')
+        self.assertEqual(trace[5], '  File "<string>", line 12 in <module>')
+        self.assertEqual(exitcode, 0)
+
     def test_truncate(self):
         maxlen = 500
         func_name = 'x' * (maxlen + 50)
@@ -522,6 +758,963 @@ class FaultHandlerTests(unittest.TestCase):
         self.assertEqual(trace, expected)
         self.assertEqual(exitcode, 0)
 
+    def test_stack_signature(self):
+        def func():
+            sig1 = faulthandler.stack_signature()
+            sig2 = faulthandler.stack_signature()
+            return (sig1, sig2,
+                    faulthandler.stack_signature(lines=False),
+                    faulthandler.stack_signature(lines=False))
+        sig1, sig2, sig3, sig4 = func()
+        self.assertTrue(0 <= sig1 < 2 ** 64)
+        self.assertNotEqual(sig1, sig2)
+        self.assertEqual(sig3, sig4)
+        self.assertNotEqual(sig1, sig3)
+
+    def test_enable_signature(self):
+        code = """
+            import faulthandler
+            import sys
+            print('%016x' % faulthandler.stack_signature(lines=False))
+            sys.stdout.flush()
+            faulthandler.enable(signature=True)
+            faulthandler._sigsegv()
+            """
+        output, exitcode = self.get_output(code)
+        regex = (r'^Fatal Python error: Segmentation fault '
+                 r'\(stack signature [0-9a-f]{16}, without lines ([0-9a-f]{16})\)$')
+        match = re.match(regex, output[1])
+        self.assertTrue(match, output[1])
+        self.assertEqual(match.group(1), output[0])
+        self.assertNotEqual(exitcode, 0)
+
+    def test_breadcrumbs(self):
+        code = """
+            import faulthandler
+            faulthandler.enable()
+            for index in range(40):
+                faulthandler.breadcrumb('crumb %s' % index)
+            faulthandler.breadcrumb('bad\\nchar')
+            faulthandler._sigsegv()
+            """
+        output, exitcode = self.get_output(code)
+        self.assertNotEqual(exitcode, 0)
+        index = output.index('Breadcrumbs (most recent last):')
+        crumbs = output[index + 1:]
+        self.assertEqual(len(crumbs), 32)
+        regex = r'^  \[[0-9]+\.[0-9]{6}\] Thread 0x[0-9a-f]+: (.*)$'
+        messages = [re.match(regex, line).group(1) for line in crumbs]
+        expected = ['crumb %s' % index for index in range(9, 40)]
+        expected.append('bad?char')
+        self.assertEqual(messages, expected)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_sampler(self):
+        code = """
+            import faulthandler
+            import time
+
+            def busy():
+                deadline = time.time() + 0.5
+                while time.time() < deadline:
+                    pass
+
+            faulthandler.start_sampler(interval=0.01)
+            busy()
+            faulthandler.enable()
+            faulthandler._sigsegv()
+            """
+        output, exitcode = self.get_output(code)
+        output = '\n'.join(output)
+        regex = (r'\n\nSampler: [0-9]+ samples in the last [0-9]+\.[0-9] seconds '
+                 r'\(most frequent stack first\):\n'
+                 r'\n'
+                 r'[0-9]+ samples \([0-9]+%, running\):\n'
+                 r'  File "<string>", line [67] in busy\n'
+                 r'  File "<string>", line 10 in <module>')
+        self.assertRegex(output, regex)
+        self.assertNotEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_stop_sampler(self):
+        self.assertRaises(ValueError, faulthandler.start_sampler, 0)
+        self.assertRaises(ValueError, faulthandler.start_sampler, 1.0, 0.5)
+        code = """
+            import faulthandler
+            import time
+
+            faulthandler.start_sampler(interval=0.01)
+            time.sleep(0.1)
+            faulthandler.stop_sampler()
+            faulthandler.dump_samples()
+            faulthandler.start_sampler(interval=0.01)
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, [])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_samples_pprof(self):
+        code = """
+            import faulthandler
+            import time
+            import zlib
+
+            def busy():
+                deadline = time.time() + 0.5
+                while time.time() < deadline:
+                    pass
+
+            def varint(data, pos):
+                value = shift = 0
+                while True:
+                    byte = bytearray(data[pos:pos+1])[0]
+                    pos += 1
+                    value |= (byte & 0x7f) << shift
+                    shift += 7
+                    if not byte & 0x80:
+                        return value, pos
+
+            def parse(data):
+                pos = 0
+                fields = []
+                while pos < len(data):
+                    key, pos = varint(data, pos)
+                    if key & 7 == 0:
+                        value, pos = varint(data, pos)
+                    else:
+                        size, pos = varint(data, pos)
+                        value = data[pos:pos+size]
+                        pos += size
+                    fields.append((key >> 3, value))
+                return fields
+
+            print(faulthandler.samples_pprof())
+            faulthandler.start_sampler(interval=0.01)
+            busy()
+            data = faulthandler.samples_pprof()
+            faulthandler.stop_sampler()
+            print(data[:2] == b'\\x1f\\x8b')
+            profile = parse(zlib.decompress(data, 31))
+            strings = [value.decode() for field, value in profile
+                       if field == 6]
+            print(strings[:5] == ['', 'samples', 'count', 'wall',
+                                  'nanoseconds'])
+            print('busy' in strings and '<module>' in strings)
+            print([value for field, value in profile if field == 12])
+            print(any(field == 2 for field, value in profile))
+            print('thread_state' in strings and 'running' in strings)
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, [
+            "None",
+            "True",
+            "True",
+            "True",
+            "[10000000]",
+            "True",
+            "True",
+        ])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_samples_pprof_cpu(self):
+        # the cpu mode takes samples of the CPU time, not of the wall time
+        code = """
+            import faulthandler
+            import time
+
+            faulthandler.start_sampler(interval=0.01, mode='cpu')
+            deadline = time.time() + 0.3
+            while time.time() < deadline:
+                pass
+            data = faulthandler.samples_pprof(compress=False)
+            faulthandler.stop_sampler()
+            print(b'cpu' in data and b'wall' not in data)
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, ["True"])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_samples_pprof_no_zlib(self):
+        # without zlib, the profile is not compressed
+        code = """
+            import sys
+            sys.modules['zlib'] = None
+            import faulthandler
+            import time
+
+            faulthandler.start_sampler(interval=0.01)
+            time.sleep(0.1)
+            data = faulthandler.samples_pprof()
+            faulthandler.stop_sampler()
+            print(len(data) > 0 and data[:2] != b'\\x1f\\x8b')
+            print(b'samples' in data)
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, ["True", "True"])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_samples_pprof_builtin_method(self):
+        # the leaf frame is a builtin method bound to an unhashable object
+        code = """
+            import faulthandler
+            import time
+            import zlib
+
+            faulthandler.enable_shadow_stack()
+            faulthandler.start_sampler(interval=0.01)
+            items = [0.1] * 3
+            items.sort(key=time.sleep)
+            data = faulthandler.samples_pprof()
+            faulthandler.stop_sampler()
+            print(b'[C] list.sort' in zlib.decompress(data, 31))
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, ["True"])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_samples_chrome_trace(self):
+        code = """
+            import faulthandler
+            import json
+            import threading
+            import time
+
+            def busy(duration):
+                deadline = time.time() + duration
+                while time.time() < deadline:
+                    pass
+
+            def first():
+                busy(0.3)
+
+            def second():
+                busy(0.3)
+
+            def worker():
+                event.wait()
+
+            print(faulthandler.samples_chrome_trace())
+            event = threading.Event()
+            thread = threading.Thread(target=worker, name="worker")
+            thread.start()
+            faulthandler.start_sampler(interval=0.01)
+            first()
+            second()
+            trace = json.loads(faulthandler.samples_chrome_trace())
+            event.set()
+            thread.join()
+
+            events = trace['traceEvents']
+            main = threading.current_thread().ident
+            slices = [event for event in events
+                      if event['ph'] == 'X' and event['tid'] == main]
+            names = [event['name'] for event in slices]
+            print(names.count('first') == names.count('second') == 1)
+            first = slices[names.index('first')]
+            second = slices[names.index('second')]
+            print(first['ts'] + first['dur'] <= second['ts'])
+            print(first['dur'] >= 100000)
+            print(' '.join(sorted(event['args']['name'] for event in events
+                                  if event['ph'] == 'M')))
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, [
+            "None",
+            "True",
+            "True",
+            "True",
+            "MainThread worker",
+        ])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_samples_collapsed(self):
+        with temporary_filename() as filename:
+            with temporary_filename() as merged:
+                code = """
+                    import faulthandler
+                    import sys
+                    import time
+
+                    def busy():
+                        deadline = time.time() + 0.3
+                        while time.time() < deadline:
+                            pass
+
+                    print(faulthandler.samples_collapsed())
+                    faulthandler.set_sample_label('a;b')
+                    faulthandler.start_sampler(interval=0.01, mode='cpu')
+                    busy()
+                    profile = faulthandler.samples_collapsed()
+                    faulthandler.stop_sampler()
+                    with open({filename!r}, 'w') as fp:
+                        fp.write(profile)
+                    sys.stdout.write(profile)
+
+                    sys.argv = ['faulthandler-merge', '-o', {merged!r},
+                                {filename!r}, {filename!r}]
+                    print(faulthandler.merge_main())
+                    with open({merged!r}) as fp:
+                        sys.stdout.write(fp.read())
+                    """.format(filename=filename, merged=merged)
+                output, exitcode = self.get_output(code)
+        self.assertEqual(output[0], 'None')
+        index = output.index('0')
+        profile, merged = output[1:index], output[index + 1:]
+        regex = (r'^\[running\];\[label a%3Bb\];<module> \(<string>:1\):13;'
+                 r'busy \(<string>:5\):[78] [0-9]+$')
+        for line in profile:
+            self.assertRegex(line, regex)
+        # identical stacks of the two profiles are merged
+        self.assertEqual(len(merged), len(profile))
+        counts = dict(line.rsplit(' ', 1) for line in profile)
+        for line in merged:
+            stack, count = line.rsplit(' ', 1)
+            self.assertEqual(int(count), int(counts[stack]) * 2)
+        self.assertEqual(exitcode, 0)
+
+    def test_merge_collapsed(self):
+        with temporary_filename() as filename1:
+            with temporary_filename() as filename2:
+                with open(filename1, 'w') as fp:
+                    fp.write("# comment\n"
+                             "[running];main (app.py:1):5 3\n"
+                             "[running];main (app.py:1):5;[C] time.sleep 1\n")
+                with open(filename2, 'w') as fp:
+                    fp.write("[running];main (app.py:1):5 4\n"
+                             "\n"
+                             "[gil];main (app.py:1):5 4\n")
+                merged = faulthandler.merge_collapsed([filename1, filename2])
+                self.assertEqual(merged.splitlines(), [
+                    "[running];main (app.py:1):5 7",
+                    "[gil];main (app.py:1):5 4",
+                    "[running];main (app.py:1):5;[C] time.sleep 1",
+                ])
+
+                with open(filename2, 'w') as fp:
+                    fp.write("[running];main (app.py:1):5\n")
+                self.assertRaises(ValueError, faulthandler.merge_collapsed,
+                                  [filename1, filename2])
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_hot_lines(self):
+        code = """
+            import faulthandler
+            import sys
+            import time
+
+            def busy():
+                deadline = time.time() + 0.5
+                while time.time() < deadline:
+                    pass
+
+            print(faulthandler.sample_lines())
+            sys.stdout.flush()
+            faulthandler.start_sampler(interval=0.01)
+            busy()
+            lines = faulthandler.sample_lines()
+            faulthandler.dump_hot_lines(sys.stdout)
+            total = sum(line[2] for line in lines)
+            print(all(code.co_name == 'busy' and lineno in (7, 8)
+                      for code, lineno, self, inclusive in lines
+                      if self != 0))
+            print([(code.co_name, self, inclusive == total)
+                   for code, lineno, self, inclusive in lines
+                   if code.co_name == '<module>'])
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output[0], "None")
+        self.assertEqual(output[-2:], [
+            "True",
+            "[('<module>', 0, True)]",
+        ])
+        regex = (r'^Hot lines: [0-9]+ samples \(most self samples first\):\n'
+                 r'\n'
+                 r'  File "<string>", line 5 in busy\n'
+                 r'    self  total   line\n'
+                 r'( +[0-9]+\.[0-9]% +[0-9]+\.[0-9]% +[78] .*\n?)+'
+                 # the sampler may take a sample of the module while
+                 # sample_lines() or dump_hot_lines() is called
+                 r'(\n  File "<string>", line 1 in <module>\n'
+                 r'    self  total   line\n'
+                 r'( +[0-9]+\.[0-9]% +[0-9]+\.[0-9]% +1[345] .*\n?)+)?$')
+        self.assertRegex('\n'.join(output[1:-2]), regex)
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_hot_lines_equal_code(self):
+        # on Python 2, code objects which only differ by their filename are
+        # equal: they must not be merged
+        code = """
+            import faulthandler
+            import time
+
+            source = ("def busy():\\n"
+                      "    deadline = time.time() + 0.3\\n"
+                      "    while time.time() < deadline:\\n"
+                      "        pass\\n")
+            funcs = []
+            for filename in ('a.py', 'b.py'):
+                namespace = {'time': time}
+                exec(compile(source, filename, 'exec'), namespace)
+                funcs.append(namespace['busy'])
+            faulthandler.start_sampler(interval=0.01)
+            for func in funcs:
+                func()
+            lines = faulthandler.sample_lines()
+            data = faulthandler.samples_pprof(compress=False)
+            faulthandler.stop_sampler()
+            print(sorted(set(code.co_filename
+                             for code, lineno, self, inclusive in lines
+                             if code.co_name == 'busy')))
+            print(b'a.py' in data and b'b.py' in data)
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, ["['a.py', 'b.py']", "True"])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS or not hasattr(os, 'fork'),
+            'need threads and os.fork()')
+    def test_sampler_fork(self):
+        code = """
+            import faulthandler
+            import os
+            import sys
+
+            faulthandler.start_sampler(interval=0.01)
+            pid = os.fork()
+            if not pid:
+                # the sampler thread doesn't exist in the child process:
+                # stop_sampler() at exit must not wait for it
+                sys.exit(0)
+            os.waitpid(pid, 0)
+            print("done")
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, ["done"])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_sampler_states(self):
+        self.assertRaises(ValueError, faulthandler.start_sampler, mode='io')
+        code = """
+            import faulthandler
+            import sys
+            import threading
+            import time
+
+            def sleeper():
+                time.sleep(1.0)
+
+            def busy():
+                deadline = time.time() + 0.5
+                while time.time() < deadline:
+                    pass
+
+            for mode in ('wall', 'cpu'):
+                thread = threading.Thread(target=sleeper)
+                faulthandler.start_sampler(interval=0.01, mode=mode)
+                thread.start()
+                busy()
+                faulthandler.dump_samples(sys.stdout)
+                faulthandler.stop_sampler()
+                thread.join()
+            """
+        output, exitcode = self.get_output(code)
+        output = '\n'.join(output)
+        wall, cpu = output.split('Sampler:')[1:]
+        regex = (r'^[0-9]+ samples \([0-9]+%%, %s\):\n'
+                 r'  File "<string>", line %s in %s$')
+        self.assertRegex(wall, re.compile(regex % ('running', 11, 'busy'),
+                                          re.MULTILINE))
+        self.assertRegex(wall, re.compile(regex % ('syscall', 7, 'sleeper'),
+                                          re.MULTILINE))
+        # the cpu mode only takes samples of running threads
+        self.assertRegex(cpu, re.compile(regex % ('running', 11, 'busy'),
+                                         re.MULTILINE))
+        self.assertNotIn('sleeper', cpu)
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_sampler_many_threads(self):
+        self.assertIsNone(faulthandler.sample_thread_stats())
+        code = """
+            import faulthandler
+            import threading
+            import time
+
+            def waiter(event):
+                event.wait()
+
+            event = threading.Event()
+            threads = [threading.Thread(target=waiter, args=(event,))
+                       for i in range(20)]
+            for thread in threads:
+                thread.start()
+            faulthandler.start_sampler(interval=0.01)
+            time.sleep(0.3)
+            nthread, untracked, untracked_samples = \
+                faulthandler.sample_thread_stats()
+            text = faulthandler.samples_collapsed()
+            faulthandler.stop_sampler()
+            event.set()
+            for thread in threads:
+                thread.join()
+            print("%s %s %s" % (nthread, untracked, untracked_samples > 0))
+            print(sum(int(line.rsplit(' ', 1)[1])
+                      for line in text.splitlines() if 'waiter' in line)
+                  > 20 * 10)
+            """
+        output, exitcode = self.get_output(code)
+        # 20 waiting threads and the main thread: the CPU time of 5 threads
+        # is not tracked, but they are still sampled
+        self.assertEqual(output, ['21 5 True', 'True'])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_sampler_labels(self):
+        code = """
+            import faulthandler
+            import sys
+            import threading
+            import time
+
+            def request(label):
+                faulthandler.set_sample_label(label)
+                deadline = time.time() + 0.3
+                while time.time() < deadline:
+                    pass
+                faulthandler.set_sample_label(None)
+
+            faulthandler.start_sampler(interval=0.01, mode='cpu')
+            thread = threading.Thread(target=request, args=('tenant-b',))
+            thread.start()
+            request('tenant-a')
+            thread.join()
+            print(faulthandler.get_sample_label())
+            faulthandler.dump_samples(sys.stdout)
+            print(len(faulthandler.sample_lines(label='tenant-a')) > 0)
+            print(faulthandler.sample_lines(label='tenant-c'))
+            faulthandler.stop_sampler()
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output[0], 'None')
+        output = '\n'.join(output[1:])
+        regex = (r'^[0-9]+ samples \([0-9]+%%, running, label %s\):\n'
+                 r'  File "<string>", line (9|10) in request$')
+        self.assertRegex(output, re.compile(regex % 'tenant-a', re.MULTILINE))
+        self.assertRegex(output, re.compile(regex % 'tenant-b', re.MULTILINE))
+        self.assertRegex(output, r'\nTrue\n\[\]$')
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_sampling(self):
+        self.assertRaises(ValueError, faulthandler.sampling, threads='main')
+        code = """
+            import faulthandler
+            import threading
+            import time
+
+            def busy(duration):
+                deadline = time.time() + duration
+                while time.time() < deadline:
+                    pass
+
+            thread = threading.Thread(target=busy, args=(0.5,))
+            thread.start()
+            with faulthandler.sampling(interval=0.01) as outer:
+                with faulthandler.sampling(threads='all') as inner:
+                    busy(0.2)
+                busy(0.2)
+            thread.join()
+            print(faulthandler.samples_pprof())
+            print(inner.interval)
+            for stack, state, label, count in outer.stacks():
+                print('%s %s %s' % (stack[0][0].co_name, stack[1][1], label))
+            print(set(stack[0][0].co_name for stack, state, label, count
+                      in inner.stacks()))
+            print(inner.stacks()[0][3] >= inner.stacks()[-1][3])
+            faulthandler.set_sample_label('request')
+            with faulthandler.sampling(interval=0.01) as labeled:
+                busy(0.1)
+            print(set(label for stack, state, label, count
+                      in labeled.stacks()))
+            """
+        output, exitcode = self.get_output(code)
+        # the sampler is stopped by the last scope
+        self.assertEqual(output[0], 'None')
+        # nested scopes share the interval of the sampler
+        self.assertEqual(output[1], '0.01')
+        # the outer scope only samples the current thread
+        self.assertEqual(sorted(set(output[2:-3])),
+                         ['busy 14 None', 'busy 15 None'])
+        self.assertEqual(output[-3], "set(['busy'])")
+        self.assertEqual(output[-2], 'True')
+        # the label of the thread is part of the stacks
+        self.assertEqual(output[-1], "set(['request'])")
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_sampling_stop_sampler(self):
+        code = """
+            import faulthandler
+            import time
+
+            def busy(duration):
+                deadline = time.time() + duration
+                while time.time() < deadline:
+                    pass
+
+            for start in (False, True):
+                if start:
+                    faulthandler.start_sampler(interval=0.01)
+                with faulthandler.sampling(interval=0.01) as prof:
+                    try:
+                        faulthandler.stop_sampler()
+                    except RuntimeError as exc:
+                        print(exc)
+                    busy(0.2)
+                print(prof.total > 0)
+                faulthandler.stop_sampler()
+                print(faulthandler.samples_pprof())
+            """
+        output, exitcode = self.get_output(code)
+        # the scope keeps sampling, with or without start_sampler()
+        error = 'cannot stop the sampler while a sampling scope is active'
+        self.assertEqual(output, [error, 'True', 'None'] * 2)
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_sampling_builtin_method(self):
+        # a builtin method bound to an unhashable object is counted
+        code = """
+            import faulthandler
+            import time
+
+            faulthandler.enable_shadow_stack()
+            items = [0.1] * 3
+            with faulthandler.sampling(interval=0.01) as prof:
+                items.sort(key=time.sleep)
+            print(prof.total > 0 and prof.lost == 0)
+            names = set(stack[0][0].__name__ for stack, state, label, count
+                        in prof.stacks())
+            print('sort' in names)
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, ["True", "True"])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS or not perf_supported(),
+            'need the perf backend of the sampler')
+    def test_sampler_perf(self):
+        self.assertRaises(ValueError, faulthandler.start_sampler,
+                          backend='perf', mode='wall')
+        self.assertRaises(ValueError, faulthandler.start_sampler,
+                          backend='timer')
+        code = """
+            import faulthandler
+            import sys
+            import threading
+            import time
+
+            def sleeper():
+                time.sleep(1.0)
+
+            def busy():
+                deadline = time.time() + 0.5
+                while time.time() < deadline:
+                    pass
+
+            thread = threading.Thread(target=sleeper)
+            thread.start()
+            faulthandler.start_sampler(interval=0.01, backend='perf')
+            busy()
+            faulthandler.dump_samples(sys.stdout)
+            faulthandler.stop_sampler()
+            thread.join()
+            """
+        output, exitcode = self.get_output(code)
+        output = '\n'.join(output)
+        regex = (r'^[0-9]+ samples \([0-9]+%, running\):\n'
+                 r'  File "<string>", line 1[12] in busy\n'
+                 r'  File "<string>", line 17 in <module>$')
+        self.assertRegex(output, re.compile(regex, re.MULTILINE))
+        # the sleeping thread doesn't use the CPU
+        self.assertNotIn('sleeper', output)
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS or not perf_supported(),
+            'need the perf backend of the sampler')
+    def test_sampler_perf_signal(self):
+        # the perf backend doesn't replace the handler of SIGPROF
+        code = """
+            import faulthandler
+            import os
+            import signal
+            import time
+
+            calls = []
+            signal.signal(signal.SIGPROF, lambda signum, frame: calls.append(1))
+            faulthandler.start_sampler(interval=0.01, backend='perf')
+            deadline = time.time() + 0.2
+            while time.time() < deadline:
+                pass
+            os.kill(os.getpid(), signal.SIGPROF)
+            time.sleep(0.01)
+            print(calls)
+            print(len(faulthandler.sample_lines()) > 0)
+            faulthandler.stop_sampler()
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, ["[1]", "True"])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_sampler_trie(self):
+        self.assertRaises(ValueError, faulthandler.start_sampler, trie_size=-1)
+        code = """
+            import faulthandler
+            import time
+
+            def busy():
+                deadline = time.time() + 0.5
+                while time.time() < deadline:
+                    pass
+
+            def recurse(depth):
+                if depth:
+                    return recurse(depth - 1)
+                busy()
+
+            print(faulthandler.sample_trie_stats())
+            # the ring keeps 16 samples
+            faulthandler.start_sampler(interval=0.01, duration=0.01,
+                                       trie_size=1000)
+            busy()
+            lines = faulthandler.sample_lines()
+            print(sum(line[2] for line in lines) > 30)
+            nodes, capacity, overflow = faulthandler.sample_trie_stats()
+            print(capacity, overflow)
+
+            faulthandler.start_sampler(interval=0.01, trie_size=10)
+            recurse(20)
+            nodes, capacity, overflow = faulthandler.sample_trie_stats()
+            print(nodes, capacity, overflow > 30)
+            faulthandler.stop_sampler()
+            print(faulthandler.sample_trie_stats())
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, [
+            "None",
+            "True",
+            "(1000, 0)",
+            "(10, 10, True)",
+            "None",
+        ])
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_shadow_stack(self):
+        code = """
+            import faulthandler
+            import threading
+            import time
+
+            def func():
+                return faulthandler.shadow_stack()
+
+            def worker():
+                result.append(func())
+
+            faulthandler.enable_shadow_stack()
+            stack = func()
+            print([code.co_name for code, timestamp in stack])
+            print(all(0 <= time.time() - timestamp < 60.0
+                      for code, timestamp in stack))
+            result = []
+            thread = threading.Thread(target=worker)
+            thread.start()
+            thread.join()
+            print([code.co_name for code, timestamp in result[0]][:2])
+            faulthandler.disable_shadow_stack()
+            print(func())
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, [
+            "['func', '<module>']",
+            "True",
+            "['func', 'worker']",
+            "None",
+        ])
+        self.assertEqual(exitcode, 0)
+
+    def test_shadow_stack_age(self):
+        code = """
+            import faulthandler
+            import time
+
+            def func():
+                time.sleep(0.1)
+                faulthandler.dump_traceback(all_threads=False)
+
+            faulthandler.enable_shadow_stack()
+            func()
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(len(output), 4)
+        self.assertEqual(output[1], '  [C] faulthandler.dump_traceback')
+        self.assertRegex(output[2],
+            r'^  File "<string>", line 6 in func \(active for ([0-9]+) ms\)$')
+        age = int(re.search(r'([0-9]+) ms', output[2]).group(1))
+        self.assertGreaterEqual(age, 90)
+        self.assertRegex(output[3],
+            r'^  File "<string>", line 9 in <module> '
+            r'\(active for [0-9]+ ms\)$')
+        self.assertEqual(exitcode, 0)
+
+    @skipIf(not HAVE_THREADS, 'need threads')
+    def test_shadow_stack_c_function(self):
+        code = """
+            import faulthandler
+            import time
+
+            def func():
+                time.sleep(1.5)
+
+            faulthandler.enable_shadow_stack()
+            faulthandler.dump_traceback_later(1, exit=False)
+            faulthandler.start_sampler(interval=0.05)
+            func()
+            faulthandler.dump_samples()
+            faulthandler.stop_sampler()
+            """
+        output, exitcode = self.get_output(code)
+        self.assertIn('  [C] time.sleep', output)
+        index = output.index('  [C] time.sleep')
+        self.assertRegex(output[index + 1],
+            r'^  File "<string>", line 5 in func')
+        # the leaf frame of the samples is the builtin function
+        index = [i for i, line in enumerate(output)
+                 if ' samples (' in line][0]
+        self.assertEqual(output[index + 1], '  [C] time.sleep')
+        self.assertRegex(output[index + 2],
+            r'^  File "<string>", line 5 in func')
+        self.assertEqual(exitcode, 0)
+
+    def test_watch_slow_calls(self):
+        code = """
+            import faulthandler
+            import time
+
+            def fast():
+                pass
+
+            def slow():
+                time.sleep(0.2)
+
+            def ignored():
+                time.sleep(0.2)
+
+            faulthandler.watch_slow_calls(
+                0.1, interval=60.0,
+                filter=lambda code: code.co_name != 'ignored')
+            fast()
+            ignored()
+            slow()
+            slow()
+            faulthandler.unwatch_slow_calls()
+            slow()
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(len(output), 4, output)
+        self.assertRegex(output[0], r'^Slow call \(([0-9]+) ms\)!$')
+        duration = int(re.search(r'([0-9]+) ms', output[0]).group(1))
+        self.assertGreaterEqual(duration, 190)
+        self.assertEqual(output[1], 'Stack (most recent call first):')
+        self.assertRegex(output[2],
+            r'^  File "<string>", line 8 in slow \(active for [0-9]+ ms\)$')
+        self.assertRegex(output[3],
+            r'^  File "<string>", line 18 in <module> '
+            r'\(active for [0-9]+ ms\)$')
+        self.assertEqual(exitcode, 0)
+
+    def test_watch_slow_calls_unwatch_in_filter(self):
+        # the filter uninstalls the shadow stack while it is used by the
+        # profile function
+        code = """
+            import faulthandler
+            import sys
+            import time
+
+            def slow():
+                time.sleep(0.05)
+
+            def unwatch(code):
+                faulthandler.unwatch_slow_calls()
+                return True
+
+            faulthandler.watch_slow_calls(0.01, filter=unwatch)
+            slow()
+            faulthandler.watch_slow_calls(
+                0.01, filter=lambda code: sys.setprofile(None) or True)
+            slow()
+            data = [str(i) for i in range(10000)]
+            print(len(data))
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output[-1], '10000')
+        self.assertEqual(len([line for line in output
+                              if line.startswith('Slow call')]), 1)
+        self.assertEqual(exitcode, 0)
+
+    def test_latency_histograms(self):
+        code = """
+            import faulthandler
+            import time
+
+            def fast():
+                pass
+
+            def slow():
+                time.sleep(0.02)
+
+            def once():
+                time.sleep(0.05)
+
+            faulthandler.enable_shadow_stack()
+            faulthandler.enable_latency_histograms()
+            # the histograms still use the shadow stack
+            faulthandler.disable_shadow_stack()
+            for i in range(100):
+                fast()
+            for i in range(3):
+                slow()
+            once()
+            for sort in ('total', 'p99'):
+                stats = faulthandler.latency_histograms(top=3, sort=sort)
+                print([(code.co_name, calls) for code, calls, total, p99
+                       in stats])
+            code, calls, total, p99 = stats[0]
+            print(0.05 <= total < 10.0 and 0.05 <= p99 <= 0.2)
+            faulthandler.disable_latency_histograms()
+            print(faulthandler.latency_histograms())
+            print(faulthandler.shadow_stack())
+            """
+        output, exitcode = self.get_output(code)
+        self.assertEqual(output, [
+            "[('slow', 3), ('once', 1), ('fast', 100)]",
+            "[('once', 1), ('slow', 3), ('fast', 100)]",
+            "True",
+            "None",
+            "None",
+        ])
+        self.assertEqual(exitcode, 0)
+
     @skipIf(sys.platform != 'linux2', 'thread name printing is only supported on Linux')
     def test_thread_name_when_set(self):
         self.check_fatal_error("""
@@ -806,6 +1999,33 @@ class FaultHandlerTests(unittest.TestCase):
     def test_register_chain(self):
         self.check_register(chain=True)
 
+    @skipIf(not hasattr(faulthandler, "register"),
+            "need faulthandler.register")
+    def test_register_snapshot(self):
+        code = """
+            import faulthandler
+            import os
+            import signal
+
+            def func(signum):
+                os.kill(os.getpid(), signum)
+
+            signum = signal.SIGUSR1
+            faulthandler.register(signum, all_threads=False, snapshot=True)
+            func(signum)
+            """
+        expected = [
+            'Stack (most recent call first):',
+            '  File "<string>", line 6 in func',
+            '  File "<string>", line 10 in <module>'
+        ]
+        trace, exitcode = self.get_output(code)
+        self.assertEqual(trace, expected)
+        self.assertEqual(exitcode, 0)
+
+        self.assertRaises(ValueError, faulthandler.register, signal.SIGUSR1,
+                          snapshot=True, locals=10)
+
     @contextmanager
     def check_stderr_none(self):
         stderr = sys.stderr
@@ -3,18 +3,41 @@
 #endif
 
 #include "Python.h"
-#include <frameobject.h>
+#include "longintrepr.h"
+#if PY_MAJOR_VERSION >= 3
+#  include "opcode.h"
+#endif
+#include "faulthandler.h"
+#ifdef HAVE_GREENLET_H
+#  include "greenlet.h"
+#endif
 
 #if PY_MAJOR_VERSION >= 3
 #  define PYSTRING_CHECK PyUnicode_Check
+#  define STRING_TYPE (&PyUnicode_Type)
 #else
 #  define PYSTRING_CHECK PyString_Check
+#  define STRING_TYPE (&PyString_Type)
 #endif
 
 #define PUTS(fd, str) _Py_write_noraise(fd, str, (int)strlen(str))
 #define MAX_STRING_LENGTH 500
 #define MAX_FRAME_DEPTH 100
+#define MAX_FRAME_COUNT 100000
 #define MAX_NTHREADS 100
+#define MAX_NINTERPRETERS 100
+#define MAX_LOCALS 50
+#define MAX_GENERATORS 100
+#define MAX_COLLECTED_GENERATORS 1000
+#define MAX_GC_OBJECTS 1000000
+#define MAX_COLLECTED_GREENLETS 10000
+#define MAX_GREENLET_STACKS 20
+
+/* The generations of the garbage collector are only reachable through
+   _PyGC_generation0 in Python 2.7 and Python 3.6 and older */
+#if PY_VERSION_HEX < 0x03070000
+#  define HAVE_GC_GENERATIONS
+#endif
 
 /* Write count bytes of buf into fd.
  *
@@ -59,18 +82,15 @@ reverse_string(char *text, const size_t len)
     }
 }
 
-/* Format an integer in range [0; 999999] to decimal,
-   and write it into the file fd.
+/* Format an unsigned integer to decimal, and write it into the file fd.
 
    This function is signal safe. */
 
-static void
-dump_decimal(int fd, int value)
+void
+_Py_dump_decimal(int fd, unsigned long value)
 {
-    char buffer[7];
-    int len;
-    if (value < 0 || 999999 < value)
-        return;
+    char buffer[sizeof(unsigned long) * 3];
+    size_t len;
     len = 0;
     do {
         buffer[len] = '0' + (value % 10);
@@ -81,6 +101,19 @@ dump_decimal(int fd, int value)
     _Py_write_noraise(fd, buffer, len);
 }
 
+/* Format an integer in range [0; 999999] to decimal,
+   and write it into the file fd.
+
+   This function is signal safe. */
+
+static void
+dump_decimal(int fd, int value)
+{
+    if (value < 0 || 999999 < value)
+        return;
+    _Py_dump_decimal(fd, (unsigned long)value);
+}
+
 /* Format an integer in range [0; 0xffffffff] to hexadecimal of 'width' digits,
    and write it into the file fd.
 
@@ -103,17 +136,42 @@ _Py_dump_hexadecimal(int fd, unsigned long value, size_t bytes)
     _Py_write_noraise(fd, buffer, len);
 }
 
-/* Write an unicode object into the file fd using ascii+backslashreplace.
+/* Write bytes into the file fd using ascii+backslashreplace.
 
    This function is signal safe. */
 
 static void
-dump_ascii(int fd, PyObject *text)
+dump_bytes(int fd, const char *s, Py_ssize_t size)
 {
-    Py_ssize_t i, size;
+    Py_ssize_t i;
+    unsigned char ch;
+
+    for (i=0; i < size; i++, s++) {
+        ch = (unsigned char)*s;
+        if (' ' <= ch && ch <= 126) {
+            /* printable ASCII character */
+            _Py_write_noraise(fd, s, 1);
+        }
+        else {
+            PUTS(fd, "\\x");
+            _Py_dump_hexadecimal(fd, ch, 1);
+        }
+    }
+}
+
+/* Write an unicode object into the file fd using ascii+backslashreplace,
+   truncated to max_length characters.
+
+   This function is signal safe. */
+
+static void
+dump_ascii_length(int fd, PyObject *text, Py_ssize_t max_length)
+{
+    Py_ssize_t size;
     int truncated;
-    unsigned long ch;
 #if PY_MAJOR_VERSION >= 3
+    Py_ssize_t i;
+    unsigned long ch;
     Py_UNICODE *u;
 
     size = PyUnicode_GET_SIZE(text);
@@ -125,8 +183,8 @@ dump_ascii(int fd, PyObject *text)
     s = PyString_AS_STRING(text);
 #endif
 
-    if (MAX_STRING_LENGTH < size) {
-        size = MAX_STRING_LENGTH;
+    if (max_length < size) {
+        size = max_length;
         truncated = 1;
     }
     else
@@ -160,33 +218,30 @@ dump_ascii(int fd, PyObject *text)
         }
     }
 #else
-    for (i=0; i < size; i++, s++) {
-        ch = *s;
-        if (' ' <= ch && ch <= 126) {
-            /* printable ASCII character */
-            _Py_write_noraise(fd, s, 1);
-        }
-        else {
-            PUTS(fd, "\\x");
-            _Py_dump_hexadecimal(fd, ch, 1);
-        }
-    }
+    dump_bytes(fd, s, size);
 #endif
     if (truncated)
         PUTS(fd, "...");
 }
 
-/* Write a frame into the file fd: "File "xxx", line xxx in xxx".
+/* Write an unicode object into the file fd using ascii+backslashreplace.
 
    This function is signal safe. */
 
 static void
-dump_frame(int fd, PyFrameObject *frame)
+dump_ascii(int fd, PyObject *text)
 {
-    PyCodeObject *code;
-    int lineno;
+    dump_ascii_length(fd, text, MAX_STRING_LENGTH);
+}
+
+/* Write a code location into the file fd, without newline:
+   "File "xxx", line xxx in xxx".
+
+   This function is signal safe. */
 
-    code = frame->f_code;
+static void
+dump_code_location(int fd, PyCodeObject *code, int lineno)
+{
     PUTS(fd, "  File ");
     if (code != NULL && code->co_filename != NULL
         && PYSTRING_CHECK(code->co_filename))
@@ -198,13 +253,6 @@ dump_frame(int fd, PyFrameObject *frame)
         PUTS(fd, "???");
     }
 
-#if (PY_MAJOR_VERSION <= 2 && PY_MINOR_VERSION < 7) \
-||  (PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION < 2)
-    /* PyFrame_GetLineNumber() was introduced in Python 2.7.0 and 3.2.0 */
-    lineno = PyCode_Addr2Line(code, frame->f_lasti);
-#else
-    lineno = PyFrame_GetLineNumber(frame);
-#endif
     PUTS(fd, ", line ");
     dump_decimal(fd, lineno);
     PUTS(fd, " in ");
@@ -214,37 +262,922 @@ dump_frame(int fd, PyFrameObject *frame)
         dump_ascii(fd, code->co_name);
     else
         PUTS(fd, "???");
+}
 
+/* Write a code location into the file fd: "File "xxx", line xxx in xxx".
+
+   This function is signal safe. */
+
+void
+_Py_DumpCodeLocation(int fd, PyCodeObject *code, int lineno)
+{
+    dump_code_location(fd, code, lineno);
     PUTS(fd, "\n");
 }
 
+/* Write a builtin function into the file fd: "[C] module.function".
+
+   This function is signal safe. */
+
+void
+_Py_DumpCFunction(int fd, PyObject *func)
+{
+    PyCFunctionObject *cfunc;
+
+    PUTS(fd, "  [C] ");
+    if (!PyCFunction_Check(func)) {
+        PUTS(fd, "???\n");
+        return;
+    }
+    cfunc = (PyCFunctionObject *)func;
+    if (cfunc->m_module != NULL && PYSTRING_CHECK(cfunc->m_module)) {
+        dump_ascii(fd, cfunc->m_module);
+        PUTS(fd, ".");
+    }
+    else if (cfunc->m_self != NULL && !PyModule_Check(cfunc->m_self)) {
+        PUTS(fd, Py_TYPE(cfunc->m_self)->tp_name);
+        PUTS(fd, ".");
+    }
+    PUTS(fd, cfunc->m_ml->ml_name);
+    PUTS(fd, "\n");
+}
+
+/* Get the line number currently executed by a frame.
+
+   This function is signal safe. */
+
+int
+_Py_GetFrameLineNumber(PyFrameObject *frame)
+{
+#if (PY_MAJOR_VERSION <= 2 && PY_MINOR_VERSION < 7) \
+||  (PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION < 2)
+    /* PyFrame_GetLineNumber() was introduced in Python 2.7.0 and 3.2.0 */
+    return PyCode_Addr2Line(frame->f_code, frame->f_lasti);
+#else
+    return PyFrame_GetLineNumber(frame);
+#endif
+}
+
+#if PY_MAJOR_VERSION < 3
+/* Name of the Python 2 opcodes, see Lib/opcode.py */
+static const char* const opcode_names[256] = {
+    /*   0 */ "STOP_CODE", "POP_TOP", "ROT_TWO", "ROT_THREE", "DUP_TOP",
+    /*   5 */ "ROT_FOUR", NULL, NULL, NULL, "NOP", "UNARY_POSITIVE",
+    /*  11 */ "UNARY_NEGATIVE", "UNARY_NOT", "UNARY_CONVERT", NULL,
+    /*  15 */ "UNARY_INVERT", NULL, NULL, NULL, "BINARY_POWER",
+    /*  20 */ "BINARY_MULTIPLY", "BINARY_DIVIDE", "BINARY_MODULO",
+    /*  23 */ "BINARY_ADD", "BINARY_SUBTRACT", "BINARY_SUBSCR",
+    /*  26 */ "BINARY_FLOOR_DIVIDE", "BINARY_TRUE_DIVIDE",
+    /*  28 */ "INPLACE_FLOOR_DIVIDE", "INPLACE_TRUE_DIVIDE", "SLICE+0",
+    /*  31 */ "SLICE+1", "SLICE+2", "SLICE+3", NULL, NULL, NULL, NULL, NULL,
+    /*  39 */ NULL, "STORE_SLICE+0", "STORE_SLICE+1", "STORE_SLICE+2",
+    /*  43 */ "STORE_SLICE+3", NULL, NULL, NULL, NULL, NULL, NULL,
+    /*  50 */ "DELETE_SLICE+0", "DELETE_SLICE+1", "DELETE_SLICE+2",
+    /*  53 */ "DELETE_SLICE+3", "STORE_MAP", "INPLACE_ADD",
+    /*  56 */ "INPLACE_SUBTRACT", "INPLACE_MULTIPLY", "INPLACE_DIVIDE",
+    /*  59 */ "INPLACE_MODULO", "STORE_SUBSCR", "DELETE_SUBSCR",
+    /*  62 */ "BINARY_LSHIFT", "BINARY_RSHIFT", "BINARY_AND", "BINARY_XOR",
+    /*  66 */ "BINARY_OR", "INPLACE_POWER", "GET_ITER", NULL, "PRINT_EXPR",
+    /*  71 */ "PRINT_ITEM", "PRINT_NEWLINE", "PRINT_ITEM_TO",
+    /*  74 */ "PRINT_NEWLINE_TO", "INPLACE_LSHIFT", "INPLACE_RSHIFT",
+    /*  77 */ "INPLACE_AND", "INPLACE_XOR", "INPLACE_OR", "BREAK_LOOP",
+    /*  81 */ "WITH_CLEANUP", "LOAD_LOCALS", "RETURN_VALUE", "IMPORT_STAR",
+    /*  85 */ "EXEC_STMT", "YIELD_VALUE", "POP_BLOCK", "END_FINALLY",
+    /*  89 */ "BUILD_CLASS", "STORE_NAME", "DELETE_NAME", "UNPACK_SEQUENCE",
+    /*  93 */ "FOR_ITER", "LIST_APPEND", "STORE_ATTR", "DELETE_ATTR",
+    /*  97 */ "STORE_GLOBAL", "DELETE_GLOBAL", "DUP_TOPX", "LOAD_CONST",
+    /* 101 */ "LOAD_NAME", "BUILD_TUPLE", "BUILD_LIST", "BUILD_SET",
+    /* 105 */ "BUILD_MAP", "LOAD_ATTR", "COMPARE_OP", "IMPORT_NAME",
+    /* 109 */ "IMPORT_FROM", "JUMP_FORWARD", "JUMP_IF_FALSE_OR_POP",
+    /* 112 */ "JUMP_IF_TRUE_OR_POP", "JUMP_ABSOLUTE", "POP_JUMP_IF_FALSE",
+    /* 115 */ "POP_JUMP_IF_TRUE", "LOAD_GLOBAL", NULL, NULL, "CONTINUE_LOOP",
+    /* 120 */ "SETUP_LOOP", "SETUP_EXCEPT", "SETUP_FINALLY", NULL,
+    /* 124 */ "LOAD_FAST", "STORE_FAST", "DELETE_FAST", NULL, NULL, NULL,
+    /* 130 */ "RAISE_VARARGS", "CALL_FUNCTION", "MAKE_FUNCTION",
+    /* 133 */ "BUILD_SLICE", "MAKE_CLOSURE", "LOAD_CLOSURE", "LOAD_DEREF",
+    /* 137 */ "STORE_DEREF", NULL, NULL, "CALL_FUNCTION_VAR",
+    /* 141 */ "CALL_FUNCTION_KW", "CALL_FUNCTION_VAR_KW", "SETUP_WITH", NULL,
+    /* 145 */ "EXTENDED_ARG", "SET_ADD", "MAP_ADD"
+
+};
+#endif
+
+/* Write a pointer into the file fd: "0xHHHH".
+
+   This function is signal safe. */
+
 static void
-dump_traceback(int fd, PyThreadState *tstate, int write_header)
+dump_pointer(int fd, void *ptr)
+{
+    Py_uintptr_t value = (Py_uintptr_t)ptr;
+
+    PUTS(fd, "0x");
+#if SIZEOF_VOID_P > SIZEOF_LONG
+    _Py_dump_hexadecimal(fd, (unsigned long)(value >> 32), 4);
+    _Py_dump_hexadecimal(fd, (unsigned long)(value & 0xffffffff), 4);
+#else
+    _Py_dump_hexadecimal(fd, (unsigned long)value, sizeof(void*));
+#endif
+}
+
+/* Write a code object and the bytecode instruction at the offset lasti into
+   the file fd: " (code 0xHHHH, first line xxx, offset xxx: OPNAME)".
+
+   This function is signal safe. */
+
+static void
+dump_instruction(int fd, PyCodeObject *code, int lasti)
+{
+    const char *name;
+    int opcode;
+
+    PUTS(fd, " (code ");
+    dump_pointer(fd, code);
+    PUTS(fd, ", first line ");
+    dump_decimal(fd, code->co_firstlineno);
+    PUTS(fd, ", offset ");
+    if (lasti < 0) {
+        /* the frame didn't start yet */
+        PUTS(fd, "-1)");
+        return;
+    }
+    dump_decimal(fd, lasti);
+
+    if (code->co_code != NULL && PyBytes_Check(code->co_code)
+        && lasti < PyBytes_GET_SIZE(code->co_code))
+    {
+        opcode = (unsigned char)PyBytes_AS_STRING(code->co_code)[lasti];
+        PUTS(fd, ": ");
+#if PY_MAJOR_VERSION < 3
+        name = opcode_names[opcode];
+#else
+        name = NULL;
+#endif
+        if (name != NULL)
+            PUTS(fd, name);
+        else {
+            PUTS(fd, "opcode ");
+            dump_decimal(fd, opcode);
+        }
+    }
+    PUTS(fd, ")");
+}
+
+/* Write a signed integer into the file fd.
+
+   This function is signal safe. */
+
+static void
+dump_long(int fd, long value)
+{
+    if (value < 0) {
+        PUTS(fd, "-");
+        /* -(value + 1) + 1 doesn't overflow for LONG_MIN */
+        _Py_dump_decimal(fd, (unsigned long)(-(value + 1)) + 1);
+    }
+    else
+        _Py_dump_decimal(fd, (unsigned long)value);
+}
+
+/* Write a long object into the file fd, or "<type name>" if it doesn't fit
+   into an unsigned long. The digits are read directly, PyLong_AsLong() is not
+   used because it can raise an exception.
+
+   This function is signal safe. */
+
+static void
+dump_long_object(int fd, PyObject *obj)
+{
+    PyLongObject *v = (PyLongObject *)obj;
+    Py_ssize_t i, size;
+    unsigned long value;
+
+    size = Py_SIZE(v);
+    if (size < 0)
+        size = -size;
+    if ((size_t)size * PyLong_SHIFT > sizeof(unsigned long) * 8) {
+        PUTS(fd, "<");
+        PUTS(fd, Py_TYPE(obj)->tp_name);
+        PUTS(fd, ">");
+        return;
+    }
+
+    value = 0;
+    for (i=size - 1; i >= 0; i--)
+        value = (value << PyLong_SHIFT) | v->ob_digit[i];
+    if (Py_SIZE(v) < 0)
+        PUTS(fd, "-");
+    _Py_dump_decimal(fd, value);
+}
+
+/* Write a float into the file fd with 6 digits after the point at most,
+   using an exponent for large and small numbers.
+
+   This function is signal safe: it doesn't use snprintf(). */
+
+static void
+dump_double(int fd, double value)
+{
+    unsigned long integer, fraction;
+    int exponent;
+    char digits[6];
+    size_t len;
+
+    if (Py_IS_NAN(value)) {
+        PUTS(fd, "nan");
+        return;
+    }
+    if (value < 0) {
+        PUTS(fd, "-");
+        value = -value;
+    }
+    if (Py_IS_INFINITY(value)) {
+        PUTS(fd, "inf");
+        return;
+    }
+
+    exponent = 0;
+    if (value >= 1e9) {
+        while (value >= 10.0) {
+            value /= 10.0;
+            exponent++;
+        }
+    }
+    else if (value != 0.0 && value < 1e-4) {
+        while (value < 1.0) {
+            value *= 10.0;
+            exponent--;
+        }
+    }
+
+    integer = (unsigned long)value;
+    fraction = (unsigned long)((value - integer) * 1e6 + 0.5);
+    if (fraction >= 1000000) {
+        integer++;
+        fraction -= 1000000;
+    }
+    _Py_dump_decimal(fd, integer);
+
+    for (len=sizeof(digits); len != 0; len--) {
+        digits[len - 1] = '0' + (fraction % 10);
+        fraction /= 10;
+    }
+    /* strip trailing zeros, but keep at least one digit */
+    len = sizeof(digits);
+    while (len > 1 && digits[len - 1] == '0')
+        len--;
+    PUTS(fd, ".");
+    _Py_write_noraise(fd, digits, len);
+
+    if (exponent != 0) {
+        if (exponent < 0) {
+            PUTS(fd, "e-");
+            exponent = -exponent;
+        }
+        else
+            PUTS(fd, "e+");
+        dump_decimal(fd, exponent);
+    }
+}
+
+/* Write the value of a local variable into the file fd. Only write the value
+   of None, bool, int, float, str and bytes objects (exact types), strings are
+   truncated to max_length characters. Write "<type name>" for other objects.
+
+   This function is signal safe: it doesn't call repr(). */
+
+static void
+dump_value(int fd, PyObject *value, Py_ssize_t max_length)
+{
+    PyTypeObject *type = Py_TYPE(value);
+
+    if (value == Py_None)
+        PUTS(fd, "None");
+    else if (value == Py_True)
+        PUTS(fd, "True");
+    else if (value == Py_False)
+        PUTS(fd, "False");
+#if PY_MAJOR_VERSION < 3
+    else if (type == &PyInt_Type)
+        dump_long(fd, PyInt_AS_LONG(value));
+#endif
+    else if (type == &PyLong_Type)
+        dump_long_object(fd, value);
+    else if (type == &PyFloat_Type)
+        dump_double(fd, PyFloat_AS_DOUBLE(value));
+    else if (type == STRING_TYPE) {
+        PUTS(fd, "'");
+        dump_ascii_length(fd, value, max_length);
+        PUTS(fd, "'");
+    }
+#if PY_MAJOR_VERSION >= 3
+    else if (type == &PyBytes_Type) {
+        Py_ssize_t size = PyBytes_GET_SIZE(value);
+        PUTS(fd, "b'");
+        if (max_length < size)
+            dump_bytes(fd, PyBytes_AS_STRING(value), max_length);
+        else
+            dump_bytes(fd, PyBytes_AS_STRING(value), size);
+        PUTS(fd, "'");
+        if (max_length < size)
+            PUTS(fd, "...");
+    }
+#endif
+    else {
+        PUTS(fd, "<");
+        PUTS(fd, type->tp_name);
+        PUTS(fd, ">");
+    }
+}
+
+/* Write the local variables of a frame into the file fd, one per line:
+   "    name = value". The values are read from f_localsplus, unbound
+   variables are skipped. Write at most MAX_LOCALS variables.
+
+   This function is signal safe. */
+
+static void
+dump_locals(int fd, PyFrameObject *frame, Py_ssize_t max_length)
+{
+    PyCodeObject *code = frame->f_code;
+    PyObject *names = code->co_varnames;
+    PyObject *name, *value;
+    Py_ssize_t i, nlocals;
+    int count;
+
+    if (names == NULL || !PyTuple_Check(names))
+        return;
+    nlocals = code->co_nlocals;
+    if (PyTuple_GET_SIZE(names) < nlocals)
+        nlocals = PyTuple_GET_SIZE(names);
+
+    count = 0;
+    for (i=0; i < nlocals; i++) {
+        value = frame->f_localsplus[i];
+        if (value == NULL)
+            continue;
+        if (MAX_LOCALS <= count) {
+            PUTS(fd, "    ...\n");
+            break;
+        }
+        PUTS(fd, "    ");
+        name = PyTuple_GET_ITEM(names, i);
+        if (name != NULL && PYSTRING_CHECK(name))
+            dump_ascii(fd, name);
+        else
+            PUTS(fd, "???");
+        PUTS(fd, " = ");
+        dump_value(fd, value, max_length);
+        PUTS(fd, "\n");
+        count++;
+    }
+}
+
+/* Write the time elapsed since a frame was entered into the file fd:
+   " (active for xxx ms)". age is in microseconds.
+
+   This function is signal safe. */
+
+static void
+dump_age(int fd, PY_LONG_LONG age)
+{
+    if (age < 0)
+        age = 0;
+    PUTS(fd, " (active for ");
+    _Py_dump_decimal(fd, (unsigned long)(age / 1000));
+    PUTS(fd, " ms)");
+}
+
+/* Write a frame into the file fd: "File "xxx", line xxx in xxx". If the
+   _Py_DUMP_OPCODES flag is set, write also the code object and the bytecode
+   instruction. If age is not negative, write the time elapsed since the
+   frame was entered. If _Py_DUMP_LOCALS_LENGTH(flags) is not zero, write
+   also the local variables.
+
+   This function is signal safe. */
+
+static void
+dump_frame(int fd, PyFrameObject *frame, int flags, PY_LONG_LONG age)
+{
+    Py_ssize_t max_length;
+
+    dump_code_location(fd, frame->f_code, _Py_GetFrameLineNumber(frame));
+    if (flags & _Py_DUMP_OPCODES)
+        dump_instruction(fd, frame->f_code, frame->f_lasti);
+    if (age >= 0)
+        dump_age(fd, age);
+    PUTS(fd, "\n");
+
+    max_length = _Py_DUMP_LOCALS_LENGTH(flags);
+    if (max_length != 0) {
+        if (MAX_STRING_LENGTH < max_length)
+            max_length = MAX_STRING_LENGTH;
+        dump_locals(fd, frame, max_length);
+    }
+}
+
+/* FNV-1a hash: see http://www.isthe.com/chongo/tech/comp/fnv/ */
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static unsigned PY_LONG_LONG
+hash_bytes(unsigned PY_LONG_LONG hash, const unsigned char *data, size_t size)
+{
+    size_t i;
+    for (i=0; i < size; i++) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Hash a string using its characters, not the object hash which may be
+   randomized.
+
+   This function is signal safe. */
+
+static unsigned PY_LONG_LONG
+hash_string(unsigned PY_LONG_LONG hash, PyObject *text)
+{
+    unsigned char nul = 0;
+
+    if (text == NULL || !PYSTRING_CHECK(text))
+        return hash_bytes(hash, (const unsigned char *)"???", 3);
+#if PY_MAJOR_VERSION >= 3
+    {
+        Py_ssize_t i, size = PyUnicode_GET_SIZE(text);
+        Py_UNICODE *u = PyUnicode_AS_UNICODE(text);
+        unsigned char ch[4];
+        for (i=0; i < size; i++) {
+            if (u[i] < 0x80) {
+                ch[0] = (unsigned char)u[i];
+                hash = hash_bytes(hash, ch, 1);
+            }
+            else {
+                ch[0] = (unsigned char)(u[i] >> 24);
+                ch[1] = (unsigned char)(u[i] >> 16);
+                ch[2] = (unsigned char)(u[i] >> 8);
+                ch[3] = (unsigned char)u[i];
+                hash = hash_bytes(hash, ch, 4);
+            }
+        }
+    }
+#else
+    hash = hash_bytes(hash, (const unsigned char *)PyString_AS_STRING(text),
+                      PyString_GET_SIZE(text));
+#endif
+    return hash_bytes(hash, &nul, 1);
+}
+
+/* Compute a signature of the stack of a thread: a 64-bit FNV-1a hash of the
+   filename, the function name and, if with_lines is true, the line number of
+   each frame. The signature only depends on the stack, it is the same in all
+   processes.
+
+   This function is signal safe. */
+
+unsigned PY_LONG_LONG
+_Py_StackSignature(PyThreadState *tstate, int with_lines)
 {
     PyFrameObject *frame;
+    PyCodeObject *code;
+    unsigned PY_LONG_LONG hash;
     unsigned int depth;
+    unsigned char lineno[4];
+    int line;
 
-    if (write_header)
-        PUTS(fd, "Stack (most recent call first):\n");
-
+    hash = FNV_OFFSET_BASIS;
     frame = _PyThreadState_GetFrame(tstate);
-    if (frame == NULL)
+    for (depth=0; frame != NULL && depth < MAX_FRAME_DEPTH; depth++) {
+        if (!PyFrame_Check(frame))
+            break;
+        code = frame->f_code;
+        if (code != NULL) {
+            hash = hash_string(hash, code->co_filename);
+            hash = hash_string(hash, code->co_name);
+        }
+        if (with_lines) {
+            line = _Py_GetFrameLineNumber(frame);
+            lineno[0] = (unsigned char)(line >> 24);
+            lineno[1] = (unsigned char)(line >> 16);
+            lineno[2] = (unsigned char)(line >> 8);
+            lineno[3] = (unsigned char)line;
+            hash = hash_bytes(hash, lineno, sizeof(lineno));
+        }
+        frame = frame->f_back;
+    }
+    return hash;
+}
+
+/* Count the frames from frame to the oldest frame, starting at depth.
+   Stop counting at MAX_FRAME_COUNT frames, in case the frame chain is
+   corrupted.
+
+   This function is signal safe. */
+
+unsigned int
+_Py_CountFrames(PyFrameObject *frame, unsigned int depth)
+{
+    while (frame != NULL && depth < MAX_FRAME_COUNT) {
+        if (!PyFrame_Check(frame))
+            break;
+        frame = frame->f_back;
+        depth++;
+    }
+    return depth;
+}
+
+/* Write an exception into the file fd: "  <label>: <type name>: <message>".
+   The message is only written if the exception value is a str, or an
+   exception instance with a single str argument. Do nothing if type is NULL
+   or None.
+
+   This function is signal safe: it doesn't call Python code. */
+
+static void
+dump_exception(int fd, const char *label, PyObject *type, PyObject *value)
+{
+    PyObject *message;
+
+    if (type == NULL || type == Py_None)
         return;
 
+    PUTS(fd, "  ");
+    PUTS(fd, label);
+    PUTS(fd, ": ");
+    if (PyType_Check(type))
+        PUTS(fd, ((PyTypeObject *)type)->tp_name);
+#if PY_MAJOR_VERSION < 3
+    else if (PyClass_Check(type)
+             && PyString_Check(((PyClassObject *)type)->cl_name))
+        dump_ascii(fd, ((PyClassObject *)type)->cl_name);
+#endif
+    else
+        PUTS(fd, "???");
+
+    /* the value of the current exception is not normalized yet: it can be
+       the message */
+    message = NULL;
+    if (value != NULL && Py_TYPE(value) == STRING_TYPE)
+        message = value;
+    /* on Python 2, PyExceptionInstance_Check() is also true for instances
+       of old-style classes, which have no args */
+    else if (value != NULL
+             && PyObject_TypeCheck(value,
+                                   (PyTypeObject *)PyExc_BaseException)) {
+        PyObject *args = ((PyBaseExceptionObject *)value)->args;
+        if (args != NULL && PyTuple_CheckExact(args)
+            && PyTuple_GET_SIZE(args) == 1
+            && Py_TYPE(PyTuple_GET_ITEM(args, 0)) == STRING_TYPE)
+            message = PyTuple_GET_ITEM(args, 0);
+    }
+    if (message != NULL) {
+        PUTS(fd, ": ");
+        dump_ascii(fd, message);
+    }
+    PUTS(fd, "\n");
+}
+
+#ifdef HAVE_GC_GENERATIONS
+/* Layout of the generations array of Modules/gcmodule.c: _PyGC_generation0
+   is the head of the first generation */
+struct gc_generation {
+    PyGC_Head head;
+    int threshold;
+    int count;
+};
+#define NUM_GENERATIONS 3
+#endif
+
+/* Suspended generators collected by collect_generators() */
+static PyGenObject *generators[MAX_COLLECTED_GENERATORS];
+static size_t ngenerator = 0;
+
+/* Call visit() on each object tracked by the garbage collector, until visit()
+   returns a non-zero value. Visit at most MAX_GC_OBJECTS objects.
+
+   The lists of the garbage collector are read without lock: it is a best
+   effort, as reading the frames of other threads. */
+
+static void
+visit_gc_objects(int (*visit)(PyObject *op))
+{
+#ifdef HAVE_GC_GENERATIONS
+    PyGC_Head *head, *gc;
+    size_t nobject;
+    int generation;
+
+    nobject = 0;
+    for (generation=0; generation < NUM_GENERATIONS; generation++) {
+        head = &((struct gc_generation *)_PyGC_generation0)[generation].head;
+        for (gc = head->gc.gc_next;
+             gc != NULL && gc != head;
+             gc = gc->gc.gc_next)
+        {
+            if (MAX_GC_OBJECTS <= nobject)
+                return;
+            nobject++;
+
+            if (visit((PyObject *)(gc + 1)))
+                return;
+        }
+    }
+#endif
+}
+
+static int
+collect_generator(PyObject *op)
+{
+    PyGenObject *gen;
+
+    if (!PyGen_Check(op))
+        return 0;
+    gen = (PyGenObject *)op;
+    /* skip running, exhausted and not started generators */
+    if (gen->gi_running || gen->gi_frame == NULL
+        || gen->gi_frame->f_lasti < 0)
+        return 0;
+
+    if (MAX_COLLECTED_GENERATORS <= ngenerator)
+        return 1;
+    generators[ngenerator] = gen;
+    ngenerator++;
+    return 0;
+}
+
+/* Collect and write the suspended generators tracked by the garbage
+   collector, whatever the thread which created them:
+
+   Suspended generator (most recent call first):
+     File "xxx", line xxx in xxx
+
+   Suspended generators are not attached to a thread: their f_tstate can be
+   NULL. Python 2 generators cannot delegate to another generator, so only
+   the frame of the generator is written.
+
+   This function is signal safe. */
+
+static void
+dump_generators(int fd, int flags)
+{
+    PyGenObject *gen;
+    size_t i, count;
+
+    ngenerator = 0;
+    visit_gc_objects(collect_generator);
+
+    count = 0;
+    for (i=0; i < ngenerator; i++) {
+        gen = generators[i];
+        if (gen->gi_frame == NULL)
+            continue;
+        if (MAX_GENERATORS <= count) {
+            PUTS(fd, "\n...\n");
+            break;
+        }
+
+        PUTS(fd, "\nSuspended ");
+        PUTS(fd, Py_TYPE(gen)->tp_name);
+        PUTS(fd, " (most recent call first):\n");
+        dump_frame(fd, gen->gi_frame, flags, -1);
+        count++;
+    }
+}
+
+/* Write a frame and the frames calling it, most recent call first. Write at
+   most MAX_FRAME_DEPTH frames, and then the total number of frames.
+
+   If entries is not NULL, it is the shadow stack of the thread (nentry
+   entries, oldest frame first): write the age of the frames found in the
+   shadow stack.
+
+   This function is signal safe. */
+
+static void
+dump_frames(int fd, PyFrameObject *frame, int flags,
+            _Py_ShadowEntry *entries, unsigned int nentry)
+{
+    unsigned int depth;
+    PY_LONG_LONG now, age;
+
+    now = (entries != NULL) ? _Py_monotonic() : 0;
     depth = 0;
     while (frame != NULL) {
         if (MAX_FRAME_DEPTH <= depth) {
-            PUTS(fd, "  ...\n");
+            /* count the remaining frames without writing them */
+            depth = _Py_CountFrames(frame, depth);
+            if (depth < MAX_FRAME_COUNT)
+                PUTS(fd, "  ... (");
+            else
+                PUTS(fd, "  ... (at least ");
+            _Py_dump_decimal(fd, depth);
+            PUTS(fd, " frames in total)\n");
             break;
         }
         if (!PyFrame_Check(frame))
             break;
-        dump_frame(fd, frame);
+        age = -1;
+        if (entries != NULL && depth < nentry
+            && entries[nentry - 1 - depth].frame == frame)
+            age = now - entries[nentry - 1 - depth].timestamp;
+        dump_frame(fd, frame, flags, age);
         frame = frame->f_back;
         depth++;
     }
 }
 
+#ifdef HAVE_GREENLET_H
+/* Suspended greenlets collected by collect_greenlet(): top frame, hash of
+   the stack and number of greenlets with the same stack */
+static PyFrameObject *greenlet_frames[MAX_COLLECTED_GREENLETS];
+static unsigned PY_LONG_LONG greenlet_hashes[MAX_COLLECTED_GREENLETS];
+static size_t greenlet_counts[MAX_COLLECTED_GREENLETS];
+static size_t ngreenlet = 0;
+
+/* Check if an object is a greenlet: the greenlet type is identified by its
+   name to not have to import the greenlet C API.
+
+   This function is signal safe. */
+
+static int
+is_greenlet(PyObject *op)
+{
+    PyTypeObject *type;
+
+    for (type = Py_TYPE(op); type != NULL; type = type->tp_base) {
+        if (strcmp(type->tp_name, "greenlet.greenlet") == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Hash the code objects and the line numbers of the first MAX_FRAME_DEPTH
+   frames of a stack to group identical stacks: stacks with the same hash are
+   compared by same_frames().
+
+   This function is signal safe. */
+
+static unsigned PY_LONG_LONG
+hash_frames(PyFrameObject *frame)
+{
+    unsigned PY_LONG_LONG hash;
+    unsigned int depth;
+    int lineno;
+
+    hash = FNV_OFFSET_BASIS;
+    for (depth=0; frame != NULL && depth < MAX_FRAME_DEPTH; depth++) {
+        if (!PyFrame_Check(frame))
+            break;
+        lineno = _Py_GetFrameLineNumber(frame);
+        hash = hash_bytes(hash, (const unsigned char *)&frame->f_code,
+                          sizeof(frame->f_code));
+        hash = hash_bytes(hash, (const unsigned char *)&lineno,
+                          sizeof(lineno));
+        frame = frame->f_back;
+    }
+    return hash;
+}
+
+/* Check if two stacks are written identically by dump_frames(): same code
+   objects and line numbers of the first MAX_FRAME_DEPTH frames, and same
+   number of frames.
+
+   This function is signal safe. */
+
+static int
+same_frames(PyFrameObject *frame1, PyFrameObject *frame2)
+{
+    unsigned int depth;
+
+    for (depth=0; depth < MAX_FRAME_DEPTH; depth++) {
+        if (frame1 != NULL && !PyFrame_Check(frame1))
+            frame1 = NULL;
+        if (frame2 != NULL && !PyFrame_Check(frame2))
+            frame2 = NULL;
+        if (frame1 == NULL || frame2 == NULL)
+            return (frame1 == frame2);
+        if (frame1->f_code != frame2->f_code
+            || _Py_GetFrameLineNumber(frame1)
+               != _Py_GetFrameLineNumber(frame2))
+            return 0;
+        frame1 = frame1->f_back;
+        frame2 = frame2->f_back;
+    }
+    return (_Py_CountFrames(frame1, depth) == _Py_CountFrames(frame2, depth));
+}
+
+static int
+collect_greenlet(PyObject *op)
+{
+    PyGreenlet *greenlet;
+
+    if (!is_greenlet(op))
+        return 0;
+    greenlet = (PyGreenlet *)op;
+    /* skip dead and not started greenlets, and running greenlets: the
+       frames of a running greenlet are the frames of its thread */
+    if (!PyGreenlet_ACTIVE(greenlet) || greenlet->top_frame == NULL)
+        return 0;
+
+    if (MAX_COLLECTED_GREENLETS <= ngreenlet)
+        return 1;
+    greenlet_frames[ngreenlet] = greenlet->top_frame;
+    greenlet_hashes[ngreenlet] = hash_frames(greenlet->top_frame);
+    ngreenlet++;
+    return 0;
+}
+#endif
+
+/* Write the suspended greenlets tracked by the garbage collector, grouped by
+   identical stacks, most frequent stack first. Collect at most
+   MAX_COLLECTED_GREENLETS greenlets and write at most MAX_GREENLET_STACKS
+   stacks:
+
+   3 suspended greenlet(s) (most recent call first):
+     File "xxx", line xxx in xxx
+
+   This function is signal safe. */
+
+static void
+dump_greenlets(int fd, int flags)
+{
+#ifdef HAVE_GREENLET_H
+    size_t i, j, best;
+    unsigned int nstack;
+
+    ngreenlet = 0;
+    visit_gc_objects(collect_greenlet);
+
+    /* group identical stacks: greenlet_counts[i] is the number of greenlets
+       with the stack of the greenlet i if it is the first greenlet with this
+       stack, 0 otherwise */
+    for (i=0; i < ngreenlet; i++)
+        greenlet_counts[i] = 1;
+    for (i=0; i < ngreenlet; i++) {
+        if (greenlet_counts[i] == 0)
+            continue;
+        for (j=i + 1; j < ngreenlet; j++) {
+            if (greenlet_counts[j] != 0
+                && greenlet_hashes[j] == greenlet_hashes[i]
+                && same_frames(greenlet_frames[j], greenlet_frames[i])) {
+                greenlet_counts[i]++;
+                greenlet_counts[j] = 0;
+            }
+        }
+    }
+
+    for (nstack=0; ; nstack++) {
+        best = 0;
+        for (i=0; i < ngreenlet; i++) {
+            if (greenlet_counts[i] > greenlet_counts[best])
+                best = i;
+        }
+        if (ngreenlet == 0 || greenlet_counts[best] == 0)
+            break;
+
+        if (MAX_GREENLET_STACKS <= nstack) {
+            PUTS(fd, "\n...\n");
+            break;
+        }
+
+        PUTS(fd, "\n");
+        _Py_dump_decimal(fd, (unsigned long)greenlet_counts[best]);
+        PUTS(fd, " suspended greenlet(s) (most recent call first):\n");
+        dump_frames(fd, greenlet_frames[best], flags, NULL, 0);
+        greenlet_counts[best] = 0;
+    }
+#endif
+}
+
+static void
+dump_traceback(int fd, PyThreadState *tstate, int write_header, int flags)
+{
+    PyFrameObject *frame;
+    PyObject *c_function;
+    _Py_ShadowEntry *entries;
+    unsigned int nentry;
+
+    if (write_header)
+        PUTS(fd, "Stack (most recent call first):\n");
+
+    if (flags & _Py_DUMP_EXCEPTIONS) {
+        dump_exception(fd, "Current exception",
+                       tstate->curexc_type, tstate->curexc_value);
+        dump_exception(fd, "Handled exception",
+                       tstate->exc_type, tstate->exc_value);
+    }
+
+    c_function = _Py_GetShadowCFunction(tstate);
+    if (c_function != NULL)
+        _Py_DumpCFunction(fd, c_function);
+
+    frame = _PyThreadState_GetFrame(tstate);
+    nentry = _Py_GetShadowStack(tstate, &entries);
+    if (nentry == 0)
+        entries = NULL;
+    dump_frames(fd, frame, flags, entries, nentry);
+}
+
 /* Dump the traceback of a Python thread into fd. Use write() to write the
    traceback and retry if write() is interrupted by a signal (failed with
    EINTR), but don't call the Python signal handler.
@@ -252,9 +1185,13 @@ dump_traceback(int fd, PyThreadState *tstate, int write_header)
    The caller is responsible to call PyErr_CheckSignals() to call Python signal
    handlers if signals were received. */
 void
-_Py_DumpTraceback(int fd, PyThreadState *tstate)
+_Py_DumpTraceback(int fd, PyThreadState *tstate, int flags)
 {
-    dump_traceback(fd, tstate, 1);
+    dump_traceback(fd, tstate, 1, flags);
+    if (flags & _Py_DUMP_GENERATORS)
+        dump_generators(fd, flags);
+    if (flags & _Py_DUMP_GREENLETS)
+        dump_greenlets(fd, flags);
 }
 
 /* Write the thread identifier into the file 'fd': "Current thread 0xHHHH:\" if
@@ -263,13 +1200,13 @@ _Py_DumpTraceback(int fd, PyThreadState *tstate)
    This function is signal safe. */
 
 static void
-write_thread_id(int fd, PyThreadState *tstate, int is_current)
+write_thread_id(int fd, long thread_id, int is_current)
 {
     if (is_current)
         PUTS(fd, "Current thread 0x");
     else
         PUTS(fd, "Thread 0x");
-    _Py_dump_hexadecimal(fd, (unsigned long)tstate->thread_id, sizeof(unsigned long));
+    _Py_dump_hexadecimal(fd, (unsigned long)thread_id, sizeof(unsigned long));
 
 #ifdef __gnu_linux__
     /* Linux only, get and print thread name */
@@ -286,41 +1223,268 @@ write_thread_id(int fd, PyThreadState *tstate, int is_current)
     PUTS(fd, " (most recent call first):\n");
 }
 
+/* Dump the traceback of each thread of an interpreter into fd. nthreads is
+   the number of threads already written: stop after MAX_NTHREADS threads and
+   return -1 in this case, return 0 otherwise.
+
+   This function is signal safe. */
+
+static int
+dump_threads(int fd, PyInterpreterState *interp,
+             PyThreadState *current_thread, int flags,
+             unsigned int *nthreads)
+{
+    PyThreadState *tstate;
+
+    for (tstate = PyInterpreterState_ThreadHead(interp);
+         tstate != NULL;
+         tstate = PyThreadState_Next(tstate))
+    {
+        if (tstate != PyInterpreterState_ThreadHead(interp))
+            PUTS(fd, "\n");
+        if (*nthreads >= MAX_NTHREADS) {
+            PUTS(fd, "...\n");
+            return -1;
+        }
+        write_thread_id(fd, tstate->thread_id, tstate == current_thread);
+        dump_traceback(fd, tstate, 0, flags);
+        (*nthreads)++;
+    }
+    return 0;
+}
+
+/* Dump the traceback of each thread of all interpreters into fd. Write the
+   address of the interpreter before its threads:
+   "Interpreter 0xHHHH (current):\n" for the interpreter interp,
+   "Interpreter 0xHHHH:\n" for other interpreters.
+
+   This function is signal safe. */
+
+static void
+dump_interpreters(int fd, PyInterpreterState *interp,
+                  PyThreadState *current_thread, int flags)
+{
+    PyInterpreterState *it;
+    unsigned int ninterp, nthreads;
+
+    ninterp = 0;
+    nthreads = 0;
+    for (it = PyInterpreterState_Head();
+         it != NULL;
+         it = PyInterpreterState_Next(it))
+    {
+        if (ninterp != 0)
+            PUTS(fd, "\n");
+        if (ninterp >= MAX_NINTERPRETERS) {
+            PUTS(fd, "...\n");
+            break;
+        }
+        PUTS(fd, "Interpreter ");
+        dump_pointer(fd, it);
+        if (it == interp)
+            PUTS(fd, " (current)");
+        PUTS(fd, ":\n");
+        if (dump_threads(fd, it, current_thread, flags, &nthreads) < 0)
+            break;
+        ninterp++;
+    }
+}
+
 /* Dump the traceback of all Python threads into fd. Use write() to write the
    traceback and retry if write() is interrupted by a signal (failed with
    EINTR), but don't call the Python signal handler.
 
+   Dump the threads of all interpreters if flags contains
+   _Py_DUMP_ALL_INTERPRETERS, only the threads of interp otherwise.
+
    The caller is responsible to call PyErr_CheckSignals() to call Python signal
    handlers if signals were received. */
 const char*
 _Py_DumpTracebackThreads(int fd, PyInterpreterState *interp,
-                         PyThreadState *current_thread)
+                         PyThreadState *current_thread, int flags)
 {
     PyThreadState *tstate;
     unsigned int nthreads;
 
-    /* Get the current interpreter from the current thread */
+    if (flags & _Py_DUMP_ALL_INTERPRETERS) {
+        dump_interpreters(fd, interp, current_thread, flags);
+    }
+    else {
+        /* Get the current interpreter from the current thread */
+        tstate = PyInterpreterState_ThreadHead(interp);
+        if (tstate == NULL)
+            return "unable to get the thread head state";
+
+        /* Dump the traceback of each thread */
+        nthreads = 0;
+        (void)dump_threads(fd, interp, current_thread, flags, &nthreads);
+    }
+
+    if (flags & _Py_DUMP_GENERATORS)
+        dump_generators(fd, flags);
+    if (flags & _Py_DUMP_GREENLETS)
+        dump_greenlets(fd, flags);
+
+    return NULL;
+}
+
+/* Snapshot of the stacks taken by _Py_TakeSnapshot(): only the code object
+   and the bytecode offset of each frame are copied, they are formatted later
+   by _Py_DumpSnapshot(). */
+typedef struct {
+    PyCodeObject *code;
+    int lasti;
+    /* time when the frame was entered read from the shadow stack,
+       or -1 if unknown */
+    PY_LONG_LONG timestamp;
+} snapshot_frame_t;
+
+typedef struct {
+    long thread_id;
+    int is_current;
+    /* index of the first frame in snapshot_frames */
+    unsigned int first;
+    /* number of copied frames */
+    unsigned int nframe;
+    /* total number of frames */
+    unsigned int depth;
+} snapshot_thread_t;
+
+static snapshot_frame_t snapshot_frames[MAX_NTHREADS * MAX_FRAME_DEPTH];
+static snapshot_thread_t snapshot_threads[MAX_NTHREADS];
+static unsigned int snapshot_nthread = 0;
+/* non-zero if the interpreter has more than MAX_NTHREADS threads */
+static int snapshot_truncated = 0;
+
+/* Copy the code object and the bytecode offset of the frames of a thread.
+
+   This function is signal safe. */
+
+static void
+snapshot_thread(PyThreadState *tstate, int is_current)
+{
+    snapshot_thread_t *thread;
+    snapshot_frame_t *sframe;
+    PyFrameObject *frame;
+    _Py_ShadowEntry *entries;
+    unsigned int depth, nentry;
+
+    thread = &snapshot_threads[snapshot_nthread];
+    thread->thread_id = tstate->thread_id;
+    thread->is_current = is_current;
+    thread->first = snapshot_nthread * MAX_FRAME_DEPTH;
+    thread->nframe = 0;
+
+    nentry = _Py_GetShadowStack(tstate, &entries);
+    frame = _PyThreadState_GetFrame(tstate);
+    for (depth=0; frame != NULL && depth < MAX_FRAME_DEPTH; depth++) {
+        if (!PyFrame_Check(frame))
+            break;
+        sframe = &snapshot_frames[thread->first + depth];
+        sframe->code = frame->f_code;
+        sframe->lasti = frame->f_lasti;
+        if (depth < nentry && entries[nentry - 1 - depth].frame == frame)
+            sframe->timestamp = entries[nentry - 1 - depth].timestamp;
+        else
+            sframe->timestamp = -1;
+        thread->nframe++;
+        frame = frame->f_back;
+    }
+    if (depth == MAX_FRAME_DEPTH)
+        depth = _Py_CountFrames(frame, depth);
+    thread->depth = depth;
+
+    snapshot_nthread++;
+}
+
+/* Take a snapshot of the stack of all threads of the interpreter interp if
+   all_threads is true, or only of the current thread. Only copy the code
+   object and the bytecode offset of each frame into a preallocated array, to
+   minimize the time window in which stacks can change.
+
+   Return NULL on success, or an error message on error.
+
+   This function is signal safe. */
+
+const char*
+_Py_TakeSnapshot(PyInterpreterState *interp, PyThreadState *current_thread,
+                 int all_threads)
+{
+    PyThreadState *tstate;
+
+    snapshot_nthread = 0;
+    snapshot_truncated = 0;
+
+    if (!all_threads) {
+        if (current_thread != NULL)
+            snapshot_thread(current_thread, 1);
+        return NULL;
+    }
+
     tstate = PyInterpreterState_ThreadHead(interp);
     if (tstate == NULL)
         return "unable to get the thread head state";
 
-    /* Dump the traceback of each thread */
-    tstate = PyInterpreterState_ThreadHead(interp);
-    nthreads = 0;
-    do
-    {
-        if (nthreads != 0)
-            PUTS(fd, "\n");
-        if (nthreads >= MAX_NTHREADS) {
-            PUTS(fd, "...\n");
+    for (; tstate != NULL; tstate = PyThreadState_Next(tstate)) {
+        if (snapshot_nthread >= MAX_NTHREADS) {
+            snapshot_truncated = 1;
             break;
         }
-        write_thread_id(fd, tstate, tstate == current_thread);
-        dump_traceback(fd, tstate, 0);
-        tstate = PyThreadState_Next(tstate);
-        nthreads++;
-    } while (tstate != NULL);
-
+        snapshot_thread(tstate, tstate == current_thread);
+    }
     return NULL;
 }
 
+/* Format the snapshot taken by _Py_TakeSnapshot() into fd, in the same format
+   than _Py_DumpTraceback() if all_threads is false, or than
+   _Py_DumpTracebackThreads() otherwise. The _Py_DUMP_OPCODES,
+   _Py_DUMP_GENERATORS and _Py_DUMP_GREENLETS flags are supported.
+
+   This function is signal safe. */
+
+void
+_Py_DumpSnapshot(int fd, int all_threads, int flags)
+{
+    snapshot_thread_t *thread;
+    snapshot_frame_t *sframe;
+    unsigned int i, j;
+    PY_LONG_LONG now;
+
+    now = _Py_monotonic();
+    for (i=0; i < snapshot_nthread; i++) {
+        thread = &snapshot_threads[i];
+        if (all_threads) {
+            if (i != 0)
+                PUTS(fd, "\n");
+            write_thread_id(fd, thread->thread_id, thread->is_current);
+        }
+        else
+            PUTS(fd, "Stack (most recent call first):\n");
+
+        for (j=0; j < thread->nframe; j++) {
+            sframe = &snapshot_frames[thread->first + j];
+            dump_code_location(fd, sframe->code,
+                               PyCode_Addr2Line(sframe->code, sframe->lasti));
+            if (flags & _Py_DUMP_OPCODES)
+                dump_instruction(fd, sframe->code, sframe->lasti);
+            if (sframe->timestamp >= 0)
+                dump_age(fd, now - sframe->timestamp);
+            PUTS(fd, "\n");
+        }
+        if (thread->depth > thread->nframe) {
+            if (thread->depth < MAX_FRAME_COUNT)
+                PUTS(fd, "  ... (");
+            else
+                PUTS(fd, "  ... (at least ");
+            _Py_dump_decimal(fd, thread->depth);
+            PUTS(fd, " frames in total)\n");
+        }
+    }
+    if (snapshot_truncated)
+        PUTS(fd, "\n...\n");
+
+    if (flags & _Py_DUMP_GENERATORS)
+        dump_generators(fd, flags);
+    if (flags & _Py_DUMP_GREENLETS)
+        dump_greenlets(fd, flags);
+}